@@ -0,0 +1,168 @@
+#ifndef FACTORMATRIX_H
+#define FACTORMATRIX_H
+
+/*
+    Row-major factor matrix kept in one aligned buffer
+
+    Every row starts on a 64-byte boundary: the row length (stride) is
+    padded up to a whole number of cache lines. Padding entries are zero,
+    so vector loads may run over them without changing a dot product.
+    A matrix either owns its buffer or is a view on memory owned
+    elsewhere, e.g. a memory-mapped model file.
+
+    Elements are factor_t: double by default, float when compiled with
+    -DMMFNN_SINGLE_PRECISION, which halves memory traffic and doubles
+    the SIMD width. Dot products then accumulate in accum_t, float
+    unless -DMMFNN_DOUBLE_ACCUMULATION is also given.
+
+    Part of MMFNN guiding code. Provided as is.
+    Tested with C++17 (g++ ver. 12.2)
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#ifdef MMFNN_SINGLE_PRECISION
+typedef float factor_t;
+#else
+typedef double factor_t;
+#endif
+
+#if defined(MMFNN_SINGLE_PRECISION) && !defined(MMFNN_DOUBLE_ACCUMULATION)
+typedef float accum_t;
+#else
+typedef double accum_t;
+#endif
+
+class FactorMatrix {
+
+    private:
+
+        factor_t* data;
+        unsigned int numRows;
+        unsigned int numCols;
+        unsigned int stride; // row length in elements, padding included
+        bool ownsData;
+
+        void allocate(){
+            this->data = nullptr;
+            size_t bytes = (size_t)this->numRows * this->stride * sizeof(factor_t);
+            if( bytes == 0 ){
+                return;
+            }
+            void* buffer = nullptr;
+            if( posix_memalign(&buffer, ALIGNMENT, bytes) != 0 ){
+                throw std::bad_alloc();
+            }
+            memset(buffer, 0, bytes);
+            this->data = static_cast<factor_t*>(buffer);
+        }
+
+    public:
+
+        static const unsigned int ALIGNMENT = 64; // bytes
+
+        // -------------------------------------
+        // row length rounded up to full cache lines
+        // -------------------------------------
+        static unsigned int paddedStride(unsigned int numCols){
+            const unsigned int perLine = ALIGNMENT / sizeof(factor_t);
+            return (numCols + perLine - 1) / perLine * perLine;
+        }
+
+        // -------------------------------------
+        // Constructors
+        // -------------------------------------
+        FactorMatrix() : data(nullptr), numRows(0), numCols(0), stride(0), ownsData(true) {}
+
+        FactorMatrix(unsigned int numRows, unsigned int numCols){
+            this->numRows = numRows;
+            this->numCols = numCols;
+            this->stride = paddedStride(numCols);
+            this->ownsData = true;
+            this->allocate();
+        }
+
+        // -------------------------------------
+        // non-owning view, data must be 64-byte aligned with
+        // paddedStride(numCols) elements per row and zero padding
+        // -------------------------------------
+        static FactorMatrix view(factor_t* data, unsigned int numRows, unsigned int numCols){
+            FactorMatrix m;
+            m.data = data;
+            m.numRows = numRows;
+            m.numCols = numCols;
+            m.stride = paddedStride(numCols);
+            m.ownsData = false;
+            return m;
+        }
+
+        // copies are explicit (see clone) since factor matrices can be large
+        FactorMatrix(const FactorMatrix&) = delete;
+        FactorMatrix& operator=(const FactorMatrix&) = delete;
+
+        FactorMatrix(FactorMatrix&& other) noexcept
+            : data(other.data), numRows(other.numRows), numCols(other.numCols),
+              stride(other.stride), ownsData(other.ownsData) {
+            other.data = nullptr;
+            other.numRows = other.numCols = other.stride = 0;
+        }
+
+        FactorMatrix& operator=(FactorMatrix&& other) noexcept {
+            if( this != &other ){
+                if( this->ownsData ){
+                    free(this->data);
+                }
+                this->data = other.data;
+                this->numRows = other.numRows;
+                this->numCols = other.numCols;
+                this->stride = other.stride;
+                this->ownsData = other.ownsData;
+                other.data = nullptr;
+                other.numRows = other.numCols = other.stride = 0;
+            }
+            return *this;
+        }
+
+        ~FactorMatrix(){
+            if( this->ownsData ){
+                free(this->data);
+            }
+        }
+
+        // -------------------------------------
+        // deep copy
+        // -------------------------------------
+        FactorMatrix clone() const {
+            FactorMatrix copy(this->numRows, this->numCols);
+            if( this->data != nullptr ){
+                memcpy(copy.data, this->data, (size_t)this->numRows * this->stride * sizeof(factor_t));
+            }
+            return copy;
+        }
+
+        // -------------------------------------
+        // row access, m[row][col]
+        // -------------------------------------
+        inline factor_t* operator[](unsigned int row){
+            return this->data + (size_t)row * this->stride;
+        }
+
+        inline const factor_t* operator[](unsigned int row) const {
+            return this->data + (size_t)row * this->stride;
+        }
+
+        // -------------------------------------
+        // Getters
+        // -------------------------------------
+        inline unsigned int getNumRows() const { return this->numRows; }
+        inline unsigned int getNumCols() const { return this->numCols; }
+        inline unsigned int getStride() const { return this->stride; }
+        inline factor_t* getData() { return this->data; }
+        inline const factor_t* getData() const { return this->data; }
+        inline bool isView() const { return !this->ownsData; }
+
+};
+
+#endif
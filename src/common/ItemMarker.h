@@ -0,0 +1,68 @@
+#ifndef ITEMMARKER_H
+#define ITEMMARKER_H
+
+/*
+    Epoch-stamped item set for per-thread scratch use
+
+    An item is marked when its stamp equals the current epoch, so the
+    whole set is cleared in O(1) by starting a new epoch. Stamps are
+    only rewritten when the 32-bit epoch wraps around.
+
+    Part of MMFNN guiding code. Provided as is.
+    Tested with C++17 (g++ ver. 12.2)
+ */
+
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+class ItemMarker{
+
+    private:
+
+        vector<unsigned int> stamps;
+        unsigned int epoch;
+
+    public:
+
+        ItemMarker() : epoch(1) {}
+
+        // ---------------------------------
+        // empty the set, sized for items 0 .. numItems-1
+        // ---------------------------------
+        inline void clear(unsigned int numItems){
+            if( this->stamps.size() < numItems ){
+                this->stamps.resize(numItems, 0);
+            }
+            this->epoch++;
+            if( this->epoch == 0 ){
+                fill(this->stamps.begin(), this->stamps.end(), 0);
+                this->epoch = 1;
+            }
+        }
+
+        inline void mark(unsigned int item){
+            this->stamps[item] = this->epoch;
+        }
+
+        inline void mark(const unsigned int* begin, const unsigned int* end){
+            for(const unsigned int* it=begin; it!=end; ++it){
+                this->stamps[*it] = this->epoch;
+            }
+        }
+
+        inline bool isMarked(unsigned int item) const {
+            return this->stamps[item] == this->epoch;
+        }
+
+        // marks item, true if it was not marked before
+        inline bool insert(unsigned int item){
+            bool isNew = this->stamps[item] != this->epoch;
+            this->stamps[item] = this->epoch;
+            return isNew;
+        }
+
+};
+
+#endif
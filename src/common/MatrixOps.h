@@ -0,0 +1,937 @@
+#ifndef MATRIXOPS_H
+#define MATRIXOPS_H
+
+/*
+    Matrix operations utility
+
+    dot and diffDot dispatch at runtime to the widest kernel the CPU
+    supports (AVX-512F, AVX2+FMA, SSE2, scalar). Kernels are compiled
+    with per-function target attributes, so no -m flags are needed.
+    The environment variable MMFNN_SIMD=scalar|sse2|avx2|avx512 caps
+    the selected level, e.g. for comparing against the scalar code.
+
+    scoreTile computes a block of row-by-row dot products (GEMM with a
+    transposed right operand) over the zero-padded rows of FactorMatrix,
+    using register-blocked micro-kernels. scoreRows scores one row
+    against gathered rows, four at a time, prefetching the next ones.
+
+    With -DMMFNN_SINGLE_PRECISION (factor_t = float, see FactorMatrix)
+    the AVX-512F and AVX2+FMA kernels work on 16 and 8 floats per
+    register. With -DMMFNN_DOUBLE_ACCUMULATION, and below AVX2, they are
+    portable loops written for the vectorizer and compiled per target,
+    accumulating in accum_t. Results are returned as double in all builds.
+
+    Part of MMFNN guiding code. Provided as is.
+    Tested with C++17 (g++ ver. 12.2)
+ */
+
+#include <iostream>
+#include <random>
+#include <cstdlib>
+#include <cstring>
+#include "FactorMatrix.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MMFNN_X86_SIMD
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+class MatrixOps {
+
+    private:
+
+        typedef double (*DotKernel)(const factor_t*, const factor_t*, unsigned int);
+        typedef double (*DiffDotKernel)(const factor_t*, const factor_t*, const factor_t*, unsigned int);
+        typedef void (*TileKernel)(const factor_t* const*, unsigned int, const factor_t*, unsigned int,
+                                   unsigned int, unsigned int, double*, unsigned int);
+        typedef void (*RowsKernel)(const factor_t*, const factor_t* const*, unsigned int, unsigned int, double*);
+
+        struct Kernels {
+            DotKernel dot;
+            DiffDotKernel diffDot;
+            TileKernel tile;
+            RowsKernel rows;
+            const char* name;
+        };
+
+        // -------------------------------------
+        // prefetch count rows of bytes each, for gathered rows the
+        // hardware prefetcher cannot predict
+        // -------------------------------------
+        static inline void prefetchRows(const factor_t* const* rows, unsigned int count, unsigned int bytes){
+            for(unsigned int r=0; r<count; r++){
+                const char* row = reinterpret_cast<const char*>(rows[r]);
+                for(unsigned int offset=0; offset<bytes; offset+=64){
+                    __builtin_prefetch(row + offset);
+                }
+            }
+        }
+
+        // -------------------------------------
+        // scalar kernels
+        // -------------------------------------
+        static double dotScalar(const factor_t* x, const factor_t* y, unsigned int n){
+            accum_t dotProduct = 0.0;
+            for(unsigned int f=0; f<n; f++){
+                dotProduct += x[f]*y[f];
+            }
+            return dotProduct;
+        }
+
+        static double diffDotScalar(const factor_t* x, const factor_t* y, const factor_t* z, unsigned int n){
+            accum_t diffDotProduct = 0.0;
+            for(unsigned int f=0; f<n; f++){
+                diffDotProduct += x[f]*(y[f]-z[f]);
+            }
+            return diffDotProduct;
+        }
+
+        // -------------------------------------
+        // score tile, one dot product per pair
+        // c[i*ldc+j] = a[i] . b[j*strideB], rows of length len
+        // -------------------------------------
+        static void tileGeneric(const factor_t* const* a, unsigned int numA,
+                                const factor_t* b, unsigned int strideB, unsigned int numB,
+                                unsigned int len, double* c, unsigned int ldc){
+            DotKernel dotKernel = kernels().dot;
+            for(unsigned int i=0; i<numA; i++){
+                for(unsigned int j=0; j<numB; j++){
+                    c[(size_t)i*ldc + j] = dotKernel(a[i], b + (size_t)j*strideB, len);
+                }
+            }
+        }
+
+        // -------------------------------------
+        // dot products of x with gathered rows
+        // c[r] = x . rows[r], rows of length len
+        // -------------------------------------
+        static void rowsGeneric(const factor_t* x, const factor_t* const* rows, unsigned int numRows,
+                                unsigned int len, double* c){
+            DotKernel dotKernel = kernels().dot;
+            for(unsigned int r=0; r<numRows; r++){
+                // the next 4 rows while scoring these 4
+                if( r % 4 == 0 && r+4 < numRows ){
+                    prefetchRows(rows + r + 4, min(4u, numRows-r-4), len*sizeof(factor_t));
+                }
+                c[r] = dotKernel(x, rows[r], len);
+            }
+        }
+
+#if defined(MMFNN_X86_SIMD) && !defined(MMFNN_SINGLE_PRECISION)
+
+        // -------------------------------------
+        // SSE2 kernels (2 doubles per register)
+        // -------------------------------------
+        __attribute__((target("sse2")))
+        static double dotSSE2(const double* x, const double* y, unsigned int n){
+            __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+            unsigned int f = 0;
+            for(; f+4<=n; f+=4){
+                acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(x+f), _mm_loadu_pd(y+f)));
+                acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(x+f+2), _mm_loadu_pd(y+f+2)));
+            }
+            acc0 = _mm_add_pd(acc0, acc1);
+            double lanes[2];
+            _mm_storeu_pd(lanes, acc0);
+            double dotProduct = lanes[0] + lanes[1];
+            for(; f<n; f++){
+                dotProduct += x[f]*y[f];
+            }
+            return dotProduct;
+        }
+
+        __attribute__((target("sse2")))
+        static double diffDotSSE2(const double* x, const double* y, const double* z, unsigned int n){
+            __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+            unsigned int f = 0;
+            for(; f+4<=n; f+=4){
+                acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(x+f),
+                                  _mm_sub_pd(_mm_loadu_pd(y+f), _mm_loadu_pd(z+f))));
+                acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(x+f+2),
+                                  _mm_sub_pd(_mm_loadu_pd(y+f+2), _mm_loadu_pd(z+f+2))));
+            }
+            acc0 = _mm_add_pd(acc0, acc1);
+            double lanes[2];
+            _mm_storeu_pd(lanes, acc0);
+            double diffDotProduct = lanes[0] + lanes[1];
+            for(; f<n; f++){
+                diffDotProduct += x[f]*(y[f]-z[f]);
+            }
+            return diffDotProduct;
+        }
+
+        // -------------------------------------
+        // AVX2 + FMA kernels (4 doubles per register)
+        // -------------------------------------
+        __attribute__((target("avx2,fma")))
+        static double hsumAVX2(__m256d v){
+            __m128d lo = _mm256_castpd256_pd128(v);
+            __m128d hi = _mm256_extractf128_pd(v, 1);
+            lo = _mm_add_pd(lo, hi);
+            return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+        }
+
+        __attribute__((target("avx2,fma")))
+        static double dotAVX2(const double* x, const double* y, unsigned int n){
+            __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+            unsigned int f = 0;
+            for(; f+8<=n; f+=8){
+                acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(x+f), _mm256_loadu_pd(y+f), acc0);
+                acc1 = _mm256_fmadd_pd(_mm256_loadu_pd(x+f+4), _mm256_loadu_pd(y+f+4), acc1);
+            }
+            if( f+4<=n ){
+                acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(x+f), _mm256_loadu_pd(y+f), acc0);
+                f += 4;
+            }
+            double dotProduct = hsumAVX2(_mm256_add_pd(acc0, acc1));
+            for(; f<n; f++){
+                dotProduct += x[f]*y[f];
+            }
+            return dotProduct;
+        }
+
+        __attribute__((target("avx2,fma")))
+        static double diffDotAVX2(const double* x, const double* y, const double* z, unsigned int n){
+            __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+            unsigned int f = 0;
+            for(; f+8<=n; f+=8){
+                acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(x+f),
+                       _mm256_sub_pd(_mm256_loadu_pd(y+f), _mm256_loadu_pd(z+f)), acc0);
+                acc1 = _mm256_fmadd_pd(_mm256_loadu_pd(x+f+4),
+                       _mm256_sub_pd(_mm256_loadu_pd(y+f+4), _mm256_loadu_pd(z+f+4)), acc1);
+            }
+            if( f+4<=n ){
+                acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(x+f),
+                       _mm256_sub_pd(_mm256_loadu_pd(y+f), _mm256_loadu_pd(z+f)), acc0);
+                f += 4;
+            }
+            double diffDotProduct = hsumAVX2(_mm256_add_pd(acc0, acc1));
+            for(; f<n; f++){
+                diffDotProduct += x[f]*(y[f]-z[f]);
+            }
+            return diffDotProduct;
+        }
+
+        // 2x4 register block, len must be a multiple of 4
+        __attribute__((target("avx2,fma")))
+        static void tileAVX2(const double* const* a, unsigned int numA,
+                             const double* b, unsigned int strideB, unsigned int numB,
+                             unsigned int len, double* c, unsigned int ldc){
+            unsigned int i = 0;
+            for(; i+2<=numA; i+=2){
+                const double *a0 = a[i], *a1 = a[i+1];
+                double *c0 = c + (size_t)i*ldc, *c1 = c0 + ldc;
+                unsigned int j = 0;
+                for(; j+4<=numB; j+=4){
+                    const double *b0 = b + (size_t)j*strideB, *b1 = b0 + strideB,
+                                 *b2 = b1 + strideB, *b3 = b2 + strideB;
+                    __m256d s00 = _mm256_setzero_pd(), s01 = _mm256_setzero_pd(),
+                            s02 = _mm256_setzero_pd(), s03 = _mm256_setzero_pd(),
+                            s10 = _mm256_setzero_pd(), s11 = _mm256_setzero_pd(),
+                            s12 = _mm256_setzero_pd(), s13 = _mm256_setzero_pd();
+                    for(unsigned int f=0; f<len; f+=4){
+                        __m256d x0 = _mm256_loadu_pd(a0+f), x1 = _mm256_loadu_pd(a1+f);
+                        __m256d y = _mm256_loadu_pd(b0+f);
+                        s00 = _mm256_fmadd_pd(x0, y, s00); s10 = _mm256_fmadd_pd(x1, y, s10);
+                        y = _mm256_loadu_pd(b1+f);
+                        s01 = _mm256_fmadd_pd(x0, y, s01); s11 = _mm256_fmadd_pd(x1, y, s11);
+                        y = _mm256_loadu_pd(b2+f);
+                        s02 = _mm256_fmadd_pd(x0, y, s02); s12 = _mm256_fmadd_pd(x1, y, s12);
+                        y = _mm256_loadu_pd(b3+f);
+                        s03 = _mm256_fmadd_pd(x0, y, s03); s13 = _mm256_fmadd_pd(x1, y, s13);
+                    }
+                    c0[j] = hsumAVX2(s00); c0[j+1] = hsumAVX2(s01); c0[j+2] = hsumAVX2(s02); c0[j+3] = hsumAVX2(s03);
+                    c1[j] = hsumAVX2(s10); c1[j+1] = hsumAVX2(s11); c1[j+2] = hsumAVX2(s12); c1[j+3] = hsumAVX2(s13);
+                }
+                for(; j<numB; j++){
+                    c0[j] = dotAVX2(a0, b + (size_t)j*strideB, len);
+                    c1[j] = dotAVX2(a1, b + (size_t)j*strideB, len);
+                }
+            }
+            for(; i<numA; i++){
+                for(unsigned int j=0; j<numB; j++){
+                    c[(size_t)i*ldc + j] = dotAVX2(a[i], b + (size_t)j*strideB, len);
+                }
+            }
+        }
+
+        // 4 rows per pass, len must be a multiple of 4
+        __attribute__((target("avx2,fma")))
+        static void rowsAVX2(const double* x, const double* const* rows, unsigned int numRows,
+                             unsigned int len, double* c){
+            unsigned int r = 0;
+            for(; r+4<=numRows; r+=4){
+                if( r+4 < numRows ){
+                    prefetchRows(rows + r + 4, min(4u, numRows-r-4), len*sizeof(double));
+                }
+                const double *r0 = rows[r], *r1 = rows[r+1], *r2 = rows[r+2], *r3 = rows[r+3];
+                __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd(),
+                        s2 = _mm256_setzero_pd(), s3 = _mm256_setzero_pd();
+                for(unsigned int f=0; f<len; f+=4){
+                    __m256d xf = _mm256_loadu_pd(x+f);
+                    s0 = _mm256_fmadd_pd(xf, _mm256_loadu_pd(r0+f), s0);
+                    s1 = _mm256_fmadd_pd(xf, _mm256_loadu_pd(r1+f), s1);
+                    s2 = _mm256_fmadd_pd(xf, _mm256_loadu_pd(r2+f), s2);
+                    s3 = _mm256_fmadd_pd(xf, _mm256_loadu_pd(r3+f), s3);
+                }
+                c[r] = hsumAVX2(s0); c[r+1] = hsumAVX2(s1); c[r+2] = hsumAVX2(s2); c[r+3] = hsumAVX2(s3);
+            }
+            for(; r<numRows; r++){
+                c[r] = dotAVX2(x, rows[r], len);
+            }
+        }
+
+        // -------------------------------------
+        // AVX-512F kernels (8 doubles per register, masked tail)
+        // -------------------------------------
+        __attribute__((target("avx512f")))
+        static double hsumAVX512(__m512d v){
+            double lanes[8];
+            _mm512_storeu_pd(lanes, v);
+            return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+                   ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+        }
+
+        __attribute__((target("avx512f")))
+        static double dotAVX512(const double* x, const double* y, unsigned int n){
+            __m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+            unsigned int f = 0;
+            for(; f+16<=n; f+=16){
+                acc0 = _mm512_fmadd_pd(_mm512_loadu_pd(x+f), _mm512_loadu_pd(y+f), acc0);
+                acc1 = _mm512_fmadd_pd(_mm512_loadu_pd(x+f+8), _mm512_loadu_pd(y+f+8), acc1);
+            }
+            if( f+8<=n ){
+                acc0 = _mm512_fmadd_pd(_mm512_loadu_pd(x+f), _mm512_loadu_pd(y+f), acc0);
+                f += 8;
+            }
+            if( f<n ){
+                __mmask8 mask = (__mmask8)((1u << (n-f)) - 1);
+                acc1 = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, x+f), _mm512_maskz_loadu_pd(mask, y+f), acc1);
+            }
+            return hsumAVX512(_mm512_add_pd(acc0, acc1));
+        }
+
+        __attribute__((target("avx512f")))
+        static double diffDotAVX512(const double* x, const double* y, const double* z, unsigned int n){
+            __m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+            unsigned int f = 0;
+            for(; f+16<=n; f+=16){
+                acc0 = _mm512_fmadd_pd(_mm512_loadu_pd(x+f),
+                       _mm512_sub_pd(_mm512_loadu_pd(y+f), _mm512_loadu_pd(z+f)), acc0);
+                acc1 = _mm512_fmadd_pd(_mm512_loadu_pd(x+f+8),
+                       _mm512_sub_pd(_mm512_loadu_pd(y+f+8), _mm512_loadu_pd(z+f+8)), acc1);
+            }
+            if( f+8<=n ){
+                acc0 = _mm512_fmadd_pd(_mm512_loadu_pd(x+f),
+                       _mm512_sub_pd(_mm512_loadu_pd(y+f), _mm512_loadu_pd(z+f)), acc0);
+                f += 8;
+            }
+            if( f<n ){
+                __mmask8 mask = (__mmask8)((1u << (n-f)) - 1);
+                acc1 = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, x+f),
+                       _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, y+f), _mm512_maskz_loadu_pd(mask, z+f)), acc1);
+            }
+            return hsumAVX512(_mm512_add_pd(acc0, acc1));
+        }
+
+        // 4x4 register block, len must be a multiple of 8
+        __attribute__((target("avx512f")))
+        static void tileAVX512(const double* const* a, unsigned int numA,
+                               const double* b, unsigned int strideB, unsigned int numB,
+                               unsigned int len, double* c, unsigned int ldc){
+            unsigned int i = 0;
+            for(; i+4<=numA; i+=4){
+                const double *a0 = a[i], *a1 = a[i+1], *a2 = a[i+2], *a3 = a[i+3];
+                double *c0 = c + (size_t)i*ldc, *c1 = c0 + ldc, *c2 = c1 + ldc, *c3 = c2 + ldc;
+                unsigned int j = 0;
+                for(; j+4<=numB; j+=4){
+                    const double *b0 = b + (size_t)j*strideB, *b1 = b0 + strideB,
+                                 *b2 = b1 + strideB, *b3 = b2 + strideB;
+                    __m512d s[4][4];
+                    for(unsigned int r=0; r<4; r++){
+                        for(unsigned int q=0; q<4; q++){
+                            s[r][q] = _mm512_setzero_pd();
+                        }
+                    }
+                    for(unsigned int f=0; f<len; f+=8){
+                        __m512d x0 = _mm512_loadu_pd(a0+f), x1 = _mm512_loadu_pd(a1+f),
+                                x2 = _mm512_loadu_pd(a2+f), x3 = _mm512_loadu_pd(a3+f);
+                        __m512d y = _mm512_loadu_pd(b0+f);
+                        s[0][0] = _mm512_fmadd_pd(x0, y, s[0][0]); s[1][0] = _mm512_fmadd_pd(x1, y, s[1][0]);
+                        s[2][0] = _mm512_fmadd_pd(x2, y, s[2][0]); s[3][0] = _mm512_fmadd_pd(x3, y, s[3][0]);
+                        y = _mm512_loadu_pd(b1+f);
+                        s[0][1] = _mm512_fmadd_pd(x0, y, s[0][1]); s[1][1] = _mm512_fmadd_pd(x1, y, s[1][1]);
+                        s[2][1] = _mm512_fmadd_pd(x2, y, s[2][1]); s[3][1] = _mm512_fmadd_pd(x3, y, s[3][1]);
+                        y = _mm512_loadu_pd(b2+f);
+                        s[0][2] = _mm512_fmadd_pd(x0, y, s[0][2]); s[1][2] = _mm512_fmadd_pd(x1, y, s[1][2]);
+                        s[2][2] = _mm512_fmadd_pd(x2, y, s[2][2]); s[3][2] = _mm512_fmadd_pd(x3, y, s[3][2]);
+                        y = _mm512_loadu_pd(b3+f);
+                        s[0][3] = _mm512_fmadd_pd(x0, y, s[0][3]); s[1][3] = _mm512_fmadd_pd(x1, y, s[1][3]);
+                        s[2][3] = _mm512_fmadd_pd(x2, y, s[2][3]); s[3][3] = _mm512_fmadd_pd(x3, y, s[3][3]);
+                    }
+                    for(unsigned int q=0; q<4; q++){
+                        c0[j+q] = hsumAVX512(s[0][q]);
+                        c1[j+q] = hsumAVX512(s[1][q]);
+                        c2[j+q] = hsumAVX512(s[2][q]);
+                        c3[j+q] = hsumAVX512(s[3][q]);
+                    }
+                }
+                for(; j<numB; j++){
+                    const double* bj = b + (size_t)j*strideB;
+                    c0[j] = dotAVX512(a0, bj, len);
+                    c1[j] = dotAVX512(a1, bj, len);
+                    c2[j] = dotAVX512(a2, bj, len);
+                    c3[j] = dotAVX512(a3, bj, len);
+                }
+            }
+            for(; i<numA; i++){
+                for(unsigned int j=0; j<numB; j++){
+                    c[(size_t)i*ldc + j] = dotAVX512(a[i], b + (size_t)j*strideB, len);
+                }
+            }
+        }
+
+        // 4 rows per pass, len must be a multiple of 8
+        __attribute__((target("avx512f")))
+        static void rowsAVX512(const double* x, const double* const* rows, unsigned int numRows,
+                               unsigned int len, double* c){
+            unsigned int r = 0;
+            for(; r+4<=numRows; r+=4){
+                if( r+4 < numRows ){
+                    prefetchRows(rows + r + 4, min(4u, numRows-r-4), len*sizeof(double));
+                }
+                const double *r0 = rows[r], *r1 = rows[r+1], *r2 = rows[r+2], *r3 = rows[r+3];
+                __m512d s0 = _mm512_setzero_pd(), s1 = _mm512_setzero_pd(),
+                        s2 = _mm512_setzero_pd(), s3 = _mm512_setzero_pd();
+                for(unsigned int f=0; f<len; f+=8){
+                    __m512d xf = _mm512_loadu_pd(x+f);
+                    s0 = _mm512_fmadd_pd(xf, _mm512_loadu_pd(r0+f), s0);
+                    s1 = _mm512_fmadd_pd(xf, _mm512_loadu_pd(r1+f), s1);
+                    s2 = _mm512_fmadd_pd(xf, _mm512_loadu_pd(r2+f), s2);
+                    s3 = _mm512_fmadd_pd(xf, _mm512_loadu_pd(r3+f), s3);
+                }
+                c[r] = hsumAVX512(s0); c[r+1] = hsumAVX512(s1); c[r+2] = hsumAVX512(s2); c[r+3] = hsumAVX512(s3);
+            }
+            for(; r<numRows; r++){
+                c[r] = dotAVX512(x, rows[r], len);
+            }
+        }
+
+#endif
+
+#if defined(MMFNN_X86_SIMD) && defined(MMFNN_SINGLE_PRECISION)
+
+        // -------------------------------------
+        // float kernels, the loops are vectorized for the target of
+        // the function they are inlined into
+        // -------------------------------------
+        static inline __attribute__((always_inline))
+        double dotBody(const float* x, const float* y, unsigned int n){
+            accum_t dotProduct = 0.0;
+            #pragma omp simd reduction(+:dotProduct)
+            for(unsigned int f=0; f<n; f++){
+                dotProduct += (accum_t)x[f]*y[f];
+            }
+            return dotProduct;
+        }
+
+        static inline __attribute__((always_inline))
+        double diffDotBody(const float* x, const float* y, const float* z, unsigned int n){
+            accum_t diffDotProduct = 0.0;
+            #pragma omp simd reduction(+:diffDotProduct)
+            for(unsigned int f=0; f<n; f++){
+                diffDotProduct += (accum_t)x[f]*(y[f]-z[f]);
+            }
+            return diffDotProduct;
+        }
+
+        // one row of a against 4 rows of b per pass
+        static inline __attribute__((always_inline))
+        void tileBody(const float* const* a, unsigned int numA,
+                      const float* b, unsigned int strideB, unsigned int numB,
+                      unsigned int len, double* c, unsigned int ldc){
+            for(unsigned int i=0; i<numA; i++){
+                const float* ai = a[i];
+                double* ci = c + (size_t)i*ldc;
+                unsigned int j = 0;
+                for(; j+4<=numB; j+=4){
+                    const float *b0 = b + (size_t)j*strideB, *b1 = b0 + strideB,
+                                *b2 = b1 + strideB, *b3 = b2 + strideB;
+                    accum_t s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+                    #pragma omp simd reduction(+:s0,s1,s2,s3)
+                    for(unsigned int f=0; f<len; f++){
+                        accum_t x = ai[f];
+                        s0 += x*b0[f]; s1 += x*b1[f]; s2 += x*b2[f]; s3 += x*b3[f];
+                    }
+                    ci[j] = s0; ci[j+1] = s1; ci[j+2] = s2; ci[j+3] = s3;
+                }
+                for(; j<numB; j++){
+                    ci[j] = dotBody(ai, b + (size_t)j*strideB, len);
+                }
+            }
+        }
+
+        static double dotFloat(const float* x, const float* y, unsigned int n){
+            return dotBody(x, y, n);
+        }
+
+        static double diffDotFloat(const float* x, const float* y, const float* z, unsigned int n){
+            return diffDotBody(x, y, z, n);
+        }
+
+        static void tileFloat(const float* const* a, unsigned int numA, const float* b, unsigned int strideB,
+                              unsigned int numB, unsigned int len, double* c, unsigned int ldc){
+            tileBody(a, numA, b, strideB, numB, len, c, ldc);
+        }
+
+#ifdef MMFNN_DOUBLE_ACCUMULATION
+        __attribute__((target("avx2,fma")))
+        static double dotFloatAVX2(const float* x, const float* y, unsigned int n){
+            return dotBody(x, y, n);
+        }
+
+        __attribute__((target("avx2,fma")))
+        static double diffDotFloatAVX2(const float* x, const float* y, const float* z, unsigned int n){
+            return diffDotBody(x, y, z, n);
+        }
+
+        __attribute__((target("avx2,fma")))
+        static void tileFloatAVX2(const float* const* a, unsigned int numA, const float* b, unsigned int strideB,
+                                  unsigned int numB, unsigned int len, double* c, unsigned int ldc){
+            tileBody(a, numA, b, strideB, numB, len, c, ldc);
+        }
+
+        __attribute__((target("avx512f")))
+        static double dotFloatAVX512(const float* x, const float* y, unsigned int n){
+            return dotBody(x, y, n);
+        }
+
+        __attribute__((target("avx512f")))
+        static double diffDotFloatAVX512(const float* x, const float* y, const float* z, unsigned int n){
+            return diffDotBody(x, y, z, n);
+        }
+
+        __attribute__((target("avx512f")))
+        static void tileFloatAVX512(const float* const* a, unsigned int numA, const float* b, unsigned int strideB,
+                                    unsigned int numB, unsigned int len, double* c, unsigned int ldc){
+            tileBody(a, numA, b, strideB, numB, len, c, ldc);
+        }
+#else
+        // -------------------------------------
+        // AVX2 + FMA float kernels (8 floats per register)
+        // -------------------------------------
+        __attribute__((target("avx2,fma")))
+        static float hsumFloatAVX2(__m256 v){
+            __m128 lo = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+            lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+            return _mm_cvtss_f32(_mm_add_ss(lo, _mm_movehdup_ps(lo)));
+        }
+
+        __attribute__((target("avx2,fma")))
+        static double dotFloatAVX2(const float* x, const float* y, unsigned int n){
+            __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+            unsigned int f = 0;
+            for(; f+16<=n; f+=16){
+                acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x+f), _mm256_loadu_ps(y+f), acc0);
+                acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x+f+8), _mm256_loadu_ps(y+f+8), acc1);
+            }
+            if( f+8<=n ){
+                acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x+f), _mm256_loadu_ps(y+f), acc0);
+                f += 8;
+            }
+            float dotProduct = hsumFloatAVX2(_mm256_add_ps(acc0, acc1));
+            for(; f<n; f++){
+                dotProduct += x[f]*y[f];
+            }
+            return dotProduct;
+        }
+
+        __attribute__((target("avx2,fma")))
+        static double diffDotFloatAVX2(const float* x, const float* y, const float* z, unsigned int n){
+            __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+            unsigned int f = 0;
+            for(; f+16<=n; f+=16){
+                acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x+f),
+                       _mm256_sub_ps(_mm256_loadu_ps(y+f), _mm256_loadu_ps(z+f)), acc0);
+                acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x+f+8),
+                       _mm256_sub_ps(_mm256_loadu_ps(y+f+8), _mm256_loadu_ps(z+f+8)), acc1);
+            }
+            if( f+8<=n ){
+                acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x+f),
+                       _mm256_sub_ps(_mm256_loadu_ps(y+f), _mm256_loadu_ps(z+f)), acc0);
+                f += 8;
+            }
+            float diffDotProduct = hsumFloatAVX2(_mm256_add_ps(acc0, acc1));
+            for(; f<n; f++){
+                diffDotProduct += x[f]*(y[f]-z[f]);
+            }
+            return diffDotProduct;
+        }
+
+        // 2x4 register block, len must be a multiple of 8
+        __attribute__((target("avx2,fma")))
+        static void tileFloatAVX2(const float* const* a, unsigned int numA,
+                                  const float* b, unsigned int strideB, unsigned int numB,
+                                  unsigned int len, double* c, unsigned int ldc){
+            unsigned int i = 0;
+            for(; i+2<=numA; i+=2){
+                const float *a0 = a[i], *a1 = a[i+1];
+                double *c0 = c + (size_t)i*ldc, *c1 = c0 + ldc;
+                unsigned int j = 0;
+                for(; j+4<=numB; j+=4){
+                    const float *b0 = b + (size_t)j*strideB, *b1 = b0 + strideB,
+                                *b2 = b1 + strideB, *b3 = b2 + strideB;
+                    __m256 s00 = _mm256_setzero_ps(), s01 = _mm256_setzero_ps(),
+                           s02 = _mm256_setzero_ps(), s03 = _mm256_setzero_ps(),
+                           s10 = _mm256_setzero_ps(), s11 = _mm256_setzero_ps(),
+                           s12 = _mm256_setzero_ps(), s13 = _mm256_setzero_ps();
+                    for(unsigned int f=0; f<len; f+=8){
+                        __m256 x0 = _mm256_loadu_ps(a0+f), x1 = _mm256_loadu_ps(a1+f);
+                        __m256 y = _mm256_loadu_ps(b0+f);
+                        s00 = _mm256_fmadd_ps(x0, y, s00); s10 = _mm256_fmadd_ps(x1, y, s10);
+                        y = _mm256_loadu_ps(b1+f);
+                        s01 = _mm256_fmadd_ps(x0, y, s01); s11 = _mm256_fmadd_ps(x1, y, s11);
+                        y = _mm256_loadu_ps(b2+f);
+                        s02 = _mm256_fmadd_ps(x0, y, s02); s12 = _mm256_fmadd_ps(x1, y, s12);
+                        y = _mm256_loadu_ps(b3+f);
+                        s03 = _mm256_fmadd_ps(x0, y, s03); s13 = _mm256_fmadd_ps(x1, y, s13);
+                    }
+                    c0[j] = hsumFloatAVX2(s00); c0[j+1] = hsumFloatAVX2(s01);
+                    c0[j+2] = hsumFloatAVX2(s02); c0[j+3] = hsumFloatAVX2(s03);
+                    c1[j] = hsumFloatAVX2(s10); c1[j+1] = hsumFloatAVX2(s11);
+                    c1[j+2] = hsumFloatAVX2(s12); c1[j+3] = hsumFloatAVX2(s13);
+                }
+                for(; j<numB; j++){
+                    c0[j] = dotFloatAVX2(a0, b + (size_t)j*strideB, len);
+                    c1[j] = dotFloatAVX2(a1, b + (size_t)j*strideB, len);
+                }
+            }
+            for(; i<numA; i++){
+                for(unsigned int j=0; j<numB; j++){
+                    c[(size_t)i*ldc + j] = dotFloatAVX2(a[i], b + (size_t)j*strideB, len);
+                }
+            }
+        }
+
+        // 4 rows per pass, len must be a multiple of 8
+        __attribute__((target("avx2,fma")))
+        static void rowsFloatAVX2(const float* x, const float* const* rows, unsigned int numRows,
+                                  unsigned int len, double* c){
+            unsigned int r = 0;
+            for(; r+4<=numRows; r+=4){
+                if( r+4 < numRows ){
+                    prefetchRows(rows + r + 4, min(4u, numRows-r-4), len*sizeof(float));
+                }
+                const float *r0 = rows[r], *r1 = rows[r+1], *r2 = rows[r+2], *r3 = rows[r+3];
+                __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps(),
+                       s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+                for(unsigned int f=0; f<len; f+=8){
+                    __m256 xf = _mm256_loadu_ps(x+f);
+                    s0 = _mm256_fmadd_ps(xf, _mm256_loadu_ps(r0+f), s0);
+                    s1 = _mm256_fmadd_ps(xf, _mm256_loadu_ps(r1+f), s1);
+                    s2 = _mm256_fmadd_ps(xf, _mm256_loadu_ps(r2+f), s2);
+                    s3 = _mm256_fmadd_ps(xf, _mm256_loadu_ps(r3+f), s3);
+                }
+                c[r] = hsumFloatAVX2(s0); c[r+1] = hsumFloatAVX2(s1);
+                c[r+2] = hsumFloatAVX2(s2); c[r+3] = hsumFloatAVX2(s3);
+            }
+            for(; r<numRows; r++){
+                c[r] = dotFloatAVX2(x, rows[r], len);
+            }
+        }
+
+        // -------------------------------------
+        // AVX-512F float kernels (16 floats per register, masked tail)
+        // -------------------------------------
+        __attribute__((target("avx512f")))
+        static float hsumFloatAVX512(__m512 v){
+            float lanes[16];
+            _mm512_storeu_ps(lanes, v);
+            float sum = 0.0f;
+            for(unsigned int l=0; l<8; l++){
+                sum += lanes[l] + lanes[l+8];
+            }
+            return sum;
+        }
+
+        __attribute__((target("avx512f")))
+        static double dotFloatAVX512(const float* x, const float* y, unsigned int n){
+            __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+            unsigned int f = 0;
+            for(; f+32<=n; f+=32){
+                acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x+f), _mm512_loadu_ps(y+f), acc0);
+                acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(x+f+16), _mm512_loadu_ps(y+f+16), acc1);
+            }
+            if( f+16<=n ){
+                acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x+f), _mm512_loadu_ps(y+f), acc0);
+                f += 16;
+            }
+            if( f<n ){
+                __mmask16 mask = (__mmask16)((1u << (n-f)) - 1);
+                acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, x+f), _mm512_maskz_loadu_ps(mask, y+f), acc1);
+            }
+            return hsumFloatAVX512(_mm512_add_ps(acc0, acc1));
+        }
+
+        __attribute__((target("avx512f")))
+        static double diffDotFloatAVX512(const float* x, const float* y, const float* z, unsigned int n){
+            __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+            unsigned int f = 0;
+            for(; f+32<=n; f+=32){
+                acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x+f),
+                       _mm512_sub_ps(_mm512_loadu_ps(y+f), _mm512_loadu_ps(z+f)), acc0);
+                acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(x+f+16),
+                       _mm512_sub_ps(_mm512_loadu_ps(y+f+16), _mm512_loadu_ps(z+f+16)), acc1);
+            }
+            if( f+16<=n ){
+                acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x+f),
+                       _mm512_sub_ps(_mm512_loadu_ps(y+f), _mm512_loadu_ps(z+f)), acc0);
+                f += 16;
+            }
+            if( f<n ){
+                __mmask16 mask = (__mmask16)((1u << (n-f)) - 1);
+                acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, x+f),
+                       _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, y+f), _mm512_maskz_loadu_ps(mask, z+f)), acc1);
+            }
+            return hsumFloatAVX512(_mm512_add_ps(acc0, acc1));
+        }
+
+        // 4x4 register block, len must be a multiple of 16
+        __attribute__((target("avx512f")))
+        static void tileFloatAVX512(const float* const* a, unsigned int numA,
+                                    const float* b, unsigned int strideB, unsigned int numB,
+                                    unsigned int len, double* c, unsigned int ldc){
+            unsigned int i = 0;
+            for(; i+4<=numA; i+=4){
+                const float *a0 = a[i], *a1 = a[i+1], *a2 = a[i+2], *a3 = a[i+3];
+                double *c0 = c + (size_t)i*ldc, *c1 = c0 + ldc, *c2 = c1 + ldc, *c3 = c2 + ldc;
+                unsigned int j = 0;
+                for(; j+4<=numB; j+=4){
+                    const float *b0 = b + (size_t)j*strideB, *b1 = b0 + strideB,
+                                *b2 = b1 + strideB, *b3 = b2 + strideB;
+                    __m512 s[4][4];
+                    for(unsigned int r=0; r<4; r++){
+                        for(unsigned int q=0; q<4; q++){
+                            s[r][q] = _mm512_setzero_ps();
+                        }
+                    }
+                    for(unsigned int f=0; f<len; f+=16){
+                        __m512 x0 = _mm512_loadu_ps(a0+f), x1 = _mm512_loadu_ps(a1+f),
+                               x2 = _mm512_loadu_ps(a2+f), x3 = _mm512_loadu_ps(a3+f);
+                        __m512 y = _mm512_loadu_ps(b0+f);
+                        s[0][0] = _mm512_fmadd_ps(x0, y, s[0][0]); s[1][0] = _mm512_fmadd_ps(x1, y, s[1][0]);
+                        s[2][0] = _mm512_fmadd_ps(x2, y, s[2][0]); s[3][0] = _mm512_fmadd_ps(x3, y, s[3][0]);
+                        y = _mm512_loadu_ps(b1+f);
+                        s[0][1] = _mm512_fmadd_ps(x0, y, s[0][1]); s[1][1] = _mm512_fmadd_ps(x1, y, s[1][1]);
+                        s[2][1] = _mm512_fmadd_ps(x2, y, s[2][1]); s[3][1] = _mm512_fmadd_ps(x3, y, s[3][1]);
+                        y = _mm512_loadu_ps(b2+f);
+                        s[0][2] = _mm512_fmadd_ps(x0, y, s[0][2]); s[1][2] = _mm512_fmadd_ps(x1, y, s[1][2]);
+                        s[2][2] = _mm512_fmadd_ps(x2, y, s[2][2]); s[3][2] = _mm512_fmadd_ps(x3, y, s[3][2]);
+                        y = _mm512_loadu_ps(b3+f);
+                        s[0][3] = _mm512_fmadd_ps(x0, y, s[0][3]); s[1][3] = _mm512_fmadd_ps(x1, y, s[1][3]);
+                        s[2][3] = _mm512_fmadd_ps(x2, y, s[2][3]); s[3][3] = _mm512_fmadd_ps(x3, y, s[3][3]);
+                    }
+                    for(unsigned int q=0; q<4; q++){
+                        c0[j+q] = hsumFloatAVX512(s[0][q]);
+                        c1[j+q] = hsumFloatAVX512(s[1][q]);
+                        c2[j+q] = hsumFloatAVX512(s[2][q]);
+                        c3[j+q] = hsumFloatAVX512(s[3][q]);
+                    }
+                }
+                for(; j<numB; j++){
+                    const float* bj = b + (size_t)j*strideB;
+                    c0[j] = dotFloatAVX512(a0, bj, len);
+                    c1[j] = dotFloatAVX512(a1, bj, len);
+                    c2[j] = dotFloatAVX512(a2, bj, len);
+                    c3[j] = dotFloatAVX512(a3, bj, len);
+                }
+            }
+            for(; i<numA; i++){
+                for(unsigned int j=0; j<numB; j++){
+                    c[(size_t)i*ldc + j] = dotFloatAVX512(a[i], b + (size_t)j*strideB, len);
+                }
+            }
+        }
+
+        // 4 rows per pass, len must be a multiple of 16
+        __attribute__((target("avx512f")))
+        static void rowsFloatAVX512(const float* x, const float* const* rows, unsigned int numRows,
+                                    unsigned int len, double* c){
+            unsigned int r = 0;
+            for(; r+4<=numRows; r+=4){
+                if( r+4 < numRows ){
+                    prefetchRows(rows + r + 4, min(4u, numRows-r-4), len*sizeof(float));
+                }
+                const float *r0 = rows[r], *r1 = rows[r+1], *r2 = rows[r+2], *r3 = rows[r+3];
+                __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps(),
+                       s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+                for(unsigned int f=0; f<len; f+=16){
+                    __m512 xf = _mm512_loadu_ps(x+f);
+                    s0 = _mm512_fmadd_ps(xf, _mm512_loadu_ps(r0+f), s0);
+                    s1 = _mm512_fmadd_ps(xf, _mm512_loadu_ps(r1+f), s1);
+                    s2 = _mm512_fmadd_ps(xf, _mm512_loadu_ps(r2+f), s2);
+                    s3 = _mm512_fmadd_ps(xf, _mm512_loadu_ps(r3+f), s3);
+                }
+                c[r] = hsumFloatAVX512(s0); c[r+1] = hsumFloatAVX512(s1);
+                c[r+2] = hsumFloatAVX512(s2); c[r+3] = hsumFloatAVX512(s3);
+            }
+            for(; r<numRows; r++){
+                c[r] = dotFloatAVX512(x, rows[r], len);
+            }
+        }
+#endif
+
+#endif
+
+        // -------------------------------------
+        // kernel selection, done once per process
+        // -------------------------------------
+        static Kernels selectKernels(){
+
+            Kernels k = {&dotScalar, &diffDotScalar, &tileGeneric, &rowsGeneric, "scalar"};
+
+#ifdef MMFNN_X86_SIMD
+            // optional cap on the instruction set, see header comment
+            int maxLevel = 3;
+            const char* env = getenv("MMFNN_SIMD");
+            if( env != nullptr ){
+                if( strcmp(env, "scalar") == 0 )      maxLevel = 0;
+                else if( strcmp(env, "sse2") == 0 )   maxLevel = 1;
+                else if( strcmp(env, "avx2") == 0 )   maxLevel = 2;
+            }
+
+            __builtin_cpu_init();
+#ifdef MMFNN_SINGLE_PRECISION
+            if( maxLevel >= 3 && __builtin_cpu_supports("avx512f") ){
+                k.dot = &dotFloatAVX512;
+                k.diffDot = &diffDotFloatAVX512;
+                k.tile = &tileFloatAVX512;
+#ifndef MMFNN_DOUBLE_ACCUMULATION
+                k.rows = &rowsFloatAVX512;
+#endif
+                k.name = "avx512";
+            } else if( maxLevel >= 2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ){
+                k.dot = &dotFloatAVX2;
+                k.diffDot = &diffDotFloatAVX2;
+                k.tile = &tileFloatAVX2;
+#ifndef MMFNN_DOUBLE_ACCUMULATION
+                k.rows = &rowsFloatAVX2;
+#endif
+                k.name = "avx2";
+            } else if( maxLevel >= 1 ){
+                k.dot = &dotFloat;
+                k.diffDot = &diffDotFloat;
+                k.tile = &tileFloat;
+                k.name = "sse2";
+            }
+#else
+            if( maxLevel >= 3 && __builtin_cpu_supports("avx512f") ){
+                k.dot = &dotAVX512;
+                k.diffDot = &diffDotAVX512;
+                k.tile = &tileAVX512;
+                k.rows = &rowsAVX512;
+                k.name = "avx512";
+            } else if( maxLevel >= 2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ){
+                k.dot = &dotAVX2;
+                k.diffDot = &diffDotAVX2;
+                k.tile = &tileAVX2;
+                k.rows = &rowsAVX2;
+                k.name = "avx2";
+            } else if( maxLevel >= 1 && __builtin_cpu_supports("sse2") ){
+                k.dot = &dotSSE2;
+                k.diffDot = &diffDotSSE2;
+                k.name = "sse2";
+            }
+#endif
+#endif
+
+            return k;
+        }
+
+        static const Kernels& kernels(){
+            static const Kernels k = selectKernels();
+            return k;
+        }
+
+    public:
+
+        // -------------------------------------
+        // gaussian random matrix builder
+        // -------------------------------------
+        static FactorMatrix gaussianMatrixBuilder( double mu,
+                                                   double sigma,
+                                                   unsigned int numRows,
+                                                   unsigned int numCols ){
+            random_device rd{};
+            return gaussianMatrixBuilder(mu, sigma, numRows, numCols, rd());
+        }
+
+        // same matrix for the same seed
+        static FactorMatrix gaussianMatrixBuilder( double mu,
+                                                   double sigma,
+                                                   unsigned int numRows,
+                                                   unsigned int numCols,
+                                                   unsigned int seed ){
+
+            FactorMatrix matrix(numRows, numCols);
+
+            mt19937 generator{seed}; // using Mersenne twister
+            normal_distribution<double> distribution(mu,sigma);
+
+            for(unsigned int i=0; i<numRows; i++){
+                for(unsigned int j=0; j<numCols; j++){
+                    matrix[i][j] = distribution(generator);
+                }
+            }
+            return matrix;
+        }
+
+        // -------------------------------------
+        // name of the selected kernel set
+        // -------------------------------------
+        static const char* simdLevel(){
+            return kernels().name;
+        }
+
+        // -------------------------------------
+        // dot product of two vectors
+        // -------------------------------------
+        static inline double dot(const factor_t* x, const factor_t* y, unsigned int const &numLatentFactors){
+            return kernels().dot(x, y, numLatentFactors);
+        }
+
+        // -------------------------------------
+        // difference of dot products
+        // -------------------------------------
+        static inline double diffDot(const factor_t* x, const factor_t* y, const factor_t* z, unsigned int const &numLatentFactors){
+            return kernels().diffDot(x, y, z, numLatentFactors);
+        }
+
+        // -------------------------------------
+        // tile of dot products between rows
+        // scores[a*ldScores + b] = rowsA[a] . B[beginB+b]
+        // rowsA must be rows of a FactorMatrix with B's number of columns,
+        // their zero padding is part of the product
+        // -------------------------------------
+        static inline void scoreTile(const factor_t* const* rowsA, unsigned int numA,
+                                     const FactorMatrix& B, unsigned int beginB, unsigned int numB,
+                                     double* scores, unsigned int ldScores){
+            kernels().tile(rowsA, numA, B[beginB], B.getStride(), numB, B.getStride(), scores, ldScores);
+        }
+
+        // -------------------------------------
+        // dot products of one row with gathered rows
+        // scores[r] = x . rows[r]
+        // x and rows must be rows of FactorMatrix objects of the given
+        // stride, their zero padding is part of the product
+        // -------------------------------------
+        static inline void scoreRows(const factor_t* x, const factor_t* const* rows, unsigned int numRows,
+                                     unsigned int stride, double* scores){
+            kernels().rows(x, rows, numRows, stride, scores);
+        }
+
+};
+
+#endif
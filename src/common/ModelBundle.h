@@ -0,0 +1,338 @@
+#ifndef MODELBUNDLE_H
+#define MODELBUNDLE_H
+
+/*
+    Binary model bundle: P, Q, user histories and item knns in one file
+
+    Layout (native byte order), every section starts on a 64-byte boundary:
+      header        BundleHeader
+      P             numUsers x stride factor_t, rows as in FactorMatrix
+      Q             numItems x stride factor_t
+      offsets       numUsers+1 uint64, CSR offsets of user histories
+      items         numHistoryItems uint32, history items sorted per user
+      knns          numItems x knnCols int32, optional (knnCols == 0)
+
+    The reader maps the file read-only and hands out views on it,
+    nothing is parsed or copied. open() checks that every section lies
+    inside the file and that the history offsets are monotone, so a
+    truncated or corrupt bundle is rejected instead of read past the
+    mapping.
+
+    Part of MMFNN guiding code. Provided as is.
+    Tested with C++17 (g++ ver. 12.2)
+ */
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "FactorMatrix.h"
+#include "UserHistory.h"
+
+using namespace std;
+
+struct BundleHeader{
+    char magic[8];
+    uint32_t version;
+    uint32_t elementSize; // bytes per factor element
+    uint32_t numUsers;
+    uint32_t numItems;
+    uint32_t numLatentFactors;
+    uint32_t stride; // elements per factor row
+    uint32_t knnCols; // 0 if the bundle has no knns
+    uint32_t knnMetric; // metric of the knns, KnnMetric in predict, 0 = L2
+    uint64_t numHistoryItems;
+    uint64_t offsetP;
+    uint64_t offsetQ;
+    uint64_t offsetHistoryOffsets;
+    uint64_t offsetHistoryItems;
+    uint64_t offsetKnns;
+    uint64_t fileSize;
+};
+
+class ModelBundle{
+
+    private:
+
+        static const uint32_t VERSION = 1;
+
+        void* mapping;
+        size_t mappingSize;
+        const BundleHeader* header;
+
+        static const char* magic(){
+            return "MMFNNBDL";
+        }
+
+        static uint64_t alignUp(uint64_t offset){
+            return (offset + FactorMatrix::ALIGNMENT - 1) / FactorMatrix::ALIGNMENT * FactorMatrix::ALIGNMENT;
+        }
+
+        template<typename T>
+        T* section(uint64_t offset) const {
+            return reinterpret_cast<T*>(static_cast<char*>(this->mapping) + offset);
+        }
+
+        // ---------------------------------
+        // count elements of elementBytes at offset end inside fileSize,
+        // end is set to the end of the section
+        // ---------------------------------
+        static bool sectionFits(uint64_t offset, uint64_t count, uint64_t elementBytes, uint64_t fileSize, uint64_t& end){
+            if( offset % FactorMatrix::ALIGNMENT != 0 || offset > fileSize ){
+                return false;
+            }
+            if( elementBytes > 0 && count > (fileSize - offset) / elementBytes ){
+                return false;
+            }
+            end = offset + count*elementBytes;
+            return true;
+        }
+
+        // ---------------------------------
+        // sections in file order, each after the previous one and
+        // inside the file, monotone history offsets, and history items
+        // and knns (or -1) that are item ids
+        // ---------------------------------
+        static bool validSections(const BundleHeader* header, const void* mapping){
+            uint64_t fileSize = header->fileSize;
+            uint64_t rowBytes = (uint64_t)header->stride * header->elementSize;
+            uint64_t end = sizeof(BundleHeader);
+            if( header->offsetP < end ||
+                !sectionFits(header->offsetP, header->numUsers, rowBytes, fileSize, end) ||
+                header->offsetQ < end ||
+                !sectionFits(header->offsetQ, header->numItems, rowBytes, fileSize, end) ||
+                header->offsetHistoryOffsets < end ||
+                !sectionFits(header->offsetHistoryOffsets, (uint64_t)header->numUsers+1, sizeof(uint64_t), fileSize, end) ||
+                header->offsetHistoryItems < end ||
+                !sectionFits(header->offsetHistoryItems, header->numHistoryItems, sizeof(unsigned int), fileSize, end) ||
+                header->offsetKnns < end ||
+                !sectionFits(header->offsetKnns, header->numItems, (uint64_t)header->knnCols*sizeof(int), fileSize, end) ){
+                return false;
+            }
+
+            const uint64_t* offsets = reinterpret_cast<const uint64_t*>(static_cast<const char*>(mapping) + header->offsetHistoryOffsets);
+            if( offsets[0] != 0 || offsets[header->numUsers] > header->numHistoryItems ){
+                return false;
+            }
+            for(unsigned int u=0; u<header->numUsers; u++){
+                if( offsets[u] > offsets[u+1] ){
+                    return false;
+                }
+            }
+
+            const unsigned int* items = reinterpret_cast<const unsigned int*>(static_cast<const char*>(mapping) + header->offsetHistoryItems);
+            const int* knns = reinterpret_cast<const int*>(static_cast<const char*>(mapping) + header->offsetKnns);
+            unsigned int numItems = header->numItems;
+            uint64_t numKnns = (uint64_t)header->numItems * header->knnCols;
+            return none_of(items, items + header->numHistoryItems, [&](unsigned int i){ return i >= numItems; }) &&
+                   none_of(knns, knns + numKnns, [&](int i){ return i < -1 || (i >= 0 && (unsigned int)i >= numItems); });
+        }
+
+        static void writeAt(ofstream& ofs, uint64_t offset, const void* data, size_t bytes){
+            static const char zeros[FactorMatrix::ALIGNMENT] = {0};
+            uint64_t position = ofs.tellp();
+            while( position < offset ){
+                size_t pad = min<uint64_t>(offset - position, sizeof(zeros));
+                ofs.write(zeros, pad);
+                position += pad;
+            }
+            ofs.write(static_cast<const char*>(data), bytes);
+        }
+
+    public:
+
+        ModelBundle() : mapping(nullptr), mappingSize(0), header(nullptr) {}
+
+        ModelBundle(const ModelBundle&) = delete;
+        ModelBundle& operator=(const ModelBundle&) = delete;
+
+        ~ModelBundle(){
+            this->close();
+        }
+
+        // ---------------------------------
+        // map a bundle, false if missing or incompatible
+        // ---------------------------------
+        bool open(const string& path){
+
+            this->close();
+
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if( fd < 0 ){
+                cout << "ERROR: Unable to open file " << path << endl;
+                return false;
+            }
+            struct stat st;
+            if( fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(BundleHeader) ){
+                cout << "ERROR: Not a model bundle " << path << endl;
+                ::close(fd);
+                return false;
+            }
+
+            void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if( mapping == MAP_FAILED ){
+                cout << "ERROR: Unable to map file " << path << endl;
+                return false;
+            }
+
+            const BundleHeader* header = static_cast<const BundleHeader*>(mapping);
+            if( memcmp(header->magic, magic(), sizeof(header->magic)) != 0 ||
+                header->version != VERSION ||
+                header->elementSize != sizeof(factor_t) ||
+                header->stride != FactorMatrix::paddedStride(header->numLatentFactors) ||
+                header->fileSize != (uint64_t)st.st_size ){
+                cout << "ERROR: Incompatible model bundle " << path << endl;
+                munmap(mapping, st.st_size);
+                return false;
+            }
+            if( !validSections(header, mapping) ){
+                cout << "ERROR: Corrupt model bundle " << path << endl;
+                munmap(mapping, st.st_size);
+                return false;
+            }
+
+            madvise(mapping, st.st_size, MADV_WILLNEED);
+            this->mapping = mapping;
+            this->mappingSize = st.st_size;
+            this->header = header;
+            return true;
+        }
+
+        void close(){
+            if( this->mapping != nullptr ){
+                munmap(this->mapping, this->mappingSize);
+            }
+            this->mapping = nullptr;
+            this->mappingSize = 0;
+            this->header = nullptr;
+        }
+
+        bool isOpen() const {
+            return this->mapping != nullptr;
+        }
+
+        // ---------------------------------
+        // Getters, valid while the bundle is open; the factor views
+        // are on read-only pages, clone() them to modify
+        // ---------------------------------
+        unsigned int getNumUsers() const { return this->header->numUsers; }
+        unsigned int getNumItems() const { return this->header->numItems; }
+        unsigned int getNumLatentFactors() const { return this->header->numLatentFactors; }
+        unsigned int getKnnCols() const { return this->header->knnCols; }
+        unsigned int getKnnMetric() const { return this->header->knnMetric; }
+
+        FactorMatrix getP() const {
+            return FactorMatrix::view(section<factor_t>(this->header->offsetP),
+                                      this->header->numUsers, this->header->numLatentFactors);
+        }
+
+        FactorMatrix getQ() const {
+            return FactorMatrix::view(section<factor_t>(this->header->offsetQ),
+                                      this->header->numItems, this->header->numLatentFactors);
+        }
+
+        const uint64_t* getHistoryOffsets() const {
+            return section<uint64_t>(this->header->offsetHistoryOffsets);
+        }
+
+        const unsigned int* getHistoryItems() const {
+            return section<unsigned int>(this->header->offsetHistoryItems);
+        }
+
+        // numItems x knnCols, nullptr if the bundle has no knns
+        const int* getKnns() const {
+            return (this->header != nullptr && this->header->knnCols > 0) ? section<int>(this->header->offsetKnns) : nullptr;
+        }
+
+        // user histories, a view on the mapped CSR arrays
+        UserHistory getUserHistory() const {
+            return UserHistory::view(getHistoryOffsets(), getHistoryItems(), this->header->numUsers);
+        }
+
+        // ---------------------------------
+        // write a bundle
+        // The file is written next to path and renamed into place, so a
+        // bundle that is currently mapped (even from path) stays valid.
+        // ---------------------------------
+        static bool write( const string& path,
+                           const FactorMatrix& P,
+                           const FactorMatrix& Q,
+                           const UserHistory& history,
+                           const int* knns,
+                           unsigned int knnCols,
+                           unsigned int knnMetric = 0 ){
+
+            if( P.getNumCols() != Q.getNumCols() ){
+                cout << "ERROR: P has " << P.getNumCols() << " and Q has " << Q.getNumCols() << " latent factors" << endl;
+                return false;
+            }
+
+            BundleHeader header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, magic(), sizeof(header.magic));
+            header.version = VERSION;
+            header.elementSize = sizeof(factor_t);
+            header.numUsers = P.getNumRows();
+            header.numItems = Q.getNumRows();
+            header.numLatentFactors = Q.getNumCols();
+            header.stride = Q.getStride();
+            header.knnCols = (knns != nullptr) ? knnCols : 0;
+            header.knnMetric = (knns != nullptr) ? knnMetric : 0;
+            header.numHistoryItems = history.getNumEntries();
+
+            // one offset per user of P, users beyond the history get none
+            vector<uint64_t> historyOffsets(header.numUsers+1, header.numHistoryItems);
+            if( history.getNumUsers() > 0 ){
+                unsigned int numCopied = min(header.numUsers, history.getNumUsers()) + 1;
+                copy(history.getOffsets(), history.getOffsets() + numCopied, historyOffsets.begin());
+            }
+            historyOffsets[0] = 0;
+            header.numHistoryItems = historyOffsets[header.numUsers];
+
+            size_t bytesP = (size_t)header.numUsers * header.stride * sizeof(factor_t);
+            size_t bytesQ = (size_t)header.numItems * header.stride * sizeof(factor_t);
+            size_t bytesOffsets = ((size_t)header.numUsers + 1) * sizeof(uint64_t);
+            size_t bytesItems = header.numHistoryItems * sizeof(unsigned int);
+            size_t bytesKnns = (size_t)header.numItems * header.knnCols * sizeof(int);
+
+            header.offsetP = alignUp(sizeof(BundleHeader));
+            header.offsetQ = alignUp(header.offsetP + bytesP);
+            header.offsetHistoryOffsets = alignUp(header.offsetQ + bytesQ);
+            header.offsetHistoryItems = alignUp(header.offsetHistoryOffsets + bytesOffsets);
+            header.offsetKnns = alignUp(header.offsetHistoryItems + bytesItems);
+            header.fileSize = header.offsetKnns + bytesKnns;
+
+            string tmpPath = path + ".tmp";
+            ofstream ofs(tmpPath, ios::binary | ios::trunc);
+            if( !ofs.is_open() ){
+                cout << "ERROR: Unable to open file " << tmpPath << endl;
+                return false;
+            }
+            writeAt(ofs, 0, &header, sizeof(header));
+            writeAt(ofs, header.offsetP, P.getData(), bytesP);
+            writeAt(ofs, header.offsetQ, Q.getData(), bytesQ);
+            writeAt(ofs, header.offsetHistoryOffsets, historyOffsets.data(), bytesOffsets);
+            writeAt(ofs, header.offsetHistoryItems, history.getItems(), bytesItems);
+            writeAt(ofs, header.offsetKnns, knns, bytesKnns);
+            ofs.close();
+
+            if( ofs.fail() || rename(tmpPath.c_str(), path.c_str()) != 0 ){
+                cout << "ERROR: Unable to write file " << path << endl;
+                remove(tmpPath.c_str());
+                return false;
+            }
+            return true;
+        }
+
+};
+
+#endif
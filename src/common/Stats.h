@@ -0,0 +1,314 @@
+#ifndef STATS_H
+#define STATS_H
+
+/*
+    Hot-path counters and latency histograms, compiled in with
+    -DMMFNN_STATS and no-ops otherwise
+
+    Every thread adds to its own slot, so an update is a plain add to
+    thread-local memory, without locking or shared cache lines. Slots
+    are kept to the end of the program and summed when the statistics
+    are dumped. Values are relaxed atomics only so that a dump may read
+    them while other threads keep counting.
+
+    Histograms have four linear sub-buckets per power of two of the
+    nanoseconds, so percentiles are within 25%.
+
+    install(path) writes the JSON dump to path at exit and every time
+    the process gets SIGUSR1 (kill -USR1 <pid>). The signal is taken by
+    a dedicated thread with sigwait, so install() has to run before any
+    other thread is started, e.g. first thing in main.
+
+    Part of MMFNN guiding code. Provided as is.
+    Tested with C++17 (g++ ver. 12.2)
+ */
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <time.h>
+#ifdef MMFNN_STATS
+#include <thread>
+#include <cstdlib>
+#include <csignal>
+#include <pthread.h>
+#endif
+
+using namespace std;
+
+enum StatCounter {
+    STAT_TRAIN_SAMPLES = 0, // (user, item) samples drawn
+    STAT_TRAIN_NEGATIVE_DRAWS, // negative item trials
+    STAT_TRAIN_NEGATIVE_FAILURES, // samples without a negative after the trials
+    STAT_TRAIN_UPDATES, // SGD steps
+    STAT_TRAIN_NS, // wall time of the epochs
+    STAT_EP_CALLS,
+    STAT_EP_SCORED, // exact dot products
+    STAT_EP_HISTORY_EXCLUDED,
+    STAT_NN_CALLS,
+    STAT_NN_CANDIDATES,
+    STAT_NN_DUPLICATES, // neighbors already among the candidates
+    STAT_NN_HISTORY_EXCLUDED, // neighbors in the user's history
+    STAT_TOPK_INSERTS, // pairs that entered a top-N heap or buffer
+    NUM_STAT_COUNTERS
+};
+
+enum StatHistogram {
+    STAT_TRAIN_EPOCH_NS = 0,
+    STAT_EP_CALL_NS,
+    STAT_NN_CALL_NS,
+    NUM_STAT_HISTOGRAMS
+};
+
+class Stats{
+
+    public:
+
+#ifdef MMFNN_STATS
+        static constexpr bool ENABLED = true;
+#else
+        static constexpr bool ENABLED = false;
+#endif
+
+        static const unsigned int NUM_BUCKETS = 252;
+
+    private:
+
+        struct alignas(64) Slot{
+            atomic<uint64_t> counters[NUM_STAT_COUNTERS];
+            atomic<uint64_t> sums[NUM_STAT_HISTOGRAMS];
+            atomic<uint64_t> buckets[NUM_STAT_HISTOGRAMS][NUM_BUCKETS];
+
+            Slot(){
+                for(auto& counter : this->counters) counter.store(0, memory_order_relaxed);
+                for(auto& sum : this->sums) sum.store(0, memory_order_relaxed);
+                for(auto& histogram : this->buckets){
+                    for(auto& bucket : histogram) bucket.store(0, memory_order_relaxed);
+                }
+            }
+        };
+
+        struct Registry{
+            mutex lock;
+            vector<unique_ptr<Slot>> slots;
+            string path;
+        };
+
+        static Registry& registry(){
+            static Registry* instance = new Registry(); // never destroyed, dumps run at exit
+            return *instance;
+        }
+
+        static Slot& local(){
+            thread_local Slot* slot = nullptr;
+            if( slot == nullptr ){
+                Registry& r = registry();
+                lock_guard<mutex> guard(r.lock);
+                r.slots.emplace_back(new Slot());
+                slot = r.slots.back().get();
+            }
+            return *slot;
+        }
+
+        static inline void increase(atomic<uint64_t>& value, uint64_t n){
+            value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+        }
+
+        static const char* counterName(unsigned int c){
+            static const char* names[NUM_STAT_COUNTERS] = {
+                "train_samples", "train_negative_draws", "train_negative_failures", "train_updates", "train_ns",
+                "ep_calls", "ep_scored", "ep_history_excluded",
+                "nn_calls", "nn_candidates", "nn_duplicates", "nn_history_excluded",
+                "topk_inserts"
+            };
+            return names[c];
+        }
+
+        static const char* histogramName(unsigned int h){
+            static const char* names[NUM_STAT_HISTOGRAMS] = {"train_epoch_ns", "ep_call_ns", "nn_call_ns"};
+            return names[h];
+        }
+
+        // ---------------------------------
+        // values below 4 have their own bucket, then 4 buckets per
+        // power of two
+        // ---------------------------------
+        static inline unsigned int bucketOf(uint64_t value){
+            if( value < 4 ){
+                return value;
+            }
+            unsigned int exponent = 63 - __builtin_clzll(value);
+            return 4*(exponent-1) + ((value >> (exponent-2)) & 3);
+        }
+
+        static uint64_t bucketUpper(unsigned int bucket){
+            if( bucket < 4 ){
+                return bucket;
+            }
+            unsigned int exponent = bucket/4 + 1;
+            uint64_t lower = (uint64_t)(4 + bucket%4) << (exponent-2);
+            return lower + ((uint64_t)1 << (exponent-2)) - 1;
+        }
+
+#ifdef MMFNN_STATS
+        static void dumpAtExit(){
+            dump(registry().path);
+        }
+#endif
+
+    public:
+
+        static inline uint64_t now(){
+            struct timespec time;
+            clock_gettime(CLOCK_MONOTONIC, &time);
+            return (uint64_t)time.tv_sec*1000000000ull + time.tv_nsec;
+        }
+
+        static inline void add(StatCounter counter, uint64_t n = 1){
+            if constexpr (ENABLED){
+                increase(local().counters[counter], n);
+            }
+        }
+
+        static inline void record(StatHistogram histogram, uint64_t nanoseconds){
+            if constexpr (ENABLED){
+                Slot& slot = local();
+                increase(slot.sums[histogram], nanoseconds);
+                increase(slot.buckets[histogram][bucketOf(nanoseconds)], 1);
+            }
+        }
+
+        // ---------------------------------
+        // sums of all threads as JSON
+        // ---------------------------------
+        static void writeJSON(ostream& out){
+            Registry& r = registry();
+            lock_guard<mutex> guard(r.lock);
+
+            vector<uint64_t> counters(NUM_STAT_COUNTERS, 0);
+            for(const auto& slot : r.slots){
+                for(unsigned int c=0; c<NUM_STAT_COUNTERS; c++){
+                    counters[c] += slot->counters[c].load(memory_order_relaxed);
+                }
+            }
+            out << "{\n  \"counters\": {";
+            for(unsigned int c=0; c<NUM_STAT_COUNTERS; c++){
+                out << (c > 0 ? "," : "") << "\n    \"" << counterName(c) << "\": " << counters[c];
+            }
+            double trainSeconds = counters[STAT_TRAIN_NS] / 1e9;
+            out << "\n  },\n  \"train_updates_per_sec\": "
+                << (trainSeconds > 0 ? counters[STAT_TRAIN_UPDATES] / trainSeconds : 0.0)
+                << ",\n  \"histograms\": {";
+
+            for(unsigned int h=0; h<NUM_STAT_HISTOGRAMS; h++){
+                vector<uint64_t> buckets(NUM_BUCKETS, 0);
+                uint64_t count = 0, sum = 0;
+                for(const auto& slot : r.slots){
+                    sum += slot->sums[h].load(memory_order_relaxed);
+                    for(unsigned int b=0; b<NUM_BUCKETS; b++){
+                        buckets[b] += slot->buckets[h][b].load(memory_order_relaxed);
+                    }
+                }
+                for(uint64_t bucket : buckets){
+                    count += bucket;
+                }
+
+                // percentiles as bucket upper bounds
+                const double quantiles[4] = {0.5, 0.95, 0.99, 1.0};
+                uint64_t values[4] = {0, 0, 0, 0};
+                uint64_t seen = 0;
+                unsigned int q = 0;
+                for(unsigned int b=0; b<NUM_BUCKETS && q<4 && count>0; b++){
+                    seen += buckets[b];
+                    while( q < 4 && seen >= quantiles[q]*count ){
+                        values[q++] = bucketUpper(b);
+                    }
+                }
+
+                out << (h > 0 ? "," : "") << "\n    \"" << histogramName(h) << "\": {"
+                    << "\"count\": " << count << ", \"mean\": " << (count > 0 ? 1.*sum/count : 0.0)
+                    << ", \"p50\": " << values[0] << ", \"p95\": " << values[1]
+                    << ", \"p99\": " << values[2] << ", \"max\": " << values[3] << ", \"buckets\": [";
+                bool first = true;
+                for(unsigned int b=0; b<NUM_BUCKETS; b++){
+                    if( buckets[b] > 0 ){
+                        out << (first ? "" : ", ") << "[" << bucketUpper(b) << ", " << buckets[b] << "]";
+                        first = false;
+                    }
+                }
+                out << "]}";
+            }
+            out << "\n  }\n}\n";
+        }
+
+        static bool dump(const string& path){
+            ofstream out(path);
+            if( !out ){
+                cout << "ERROR: Cannot write " << path << endl;
+                return false;
+            }
+            writeJSON(out);
+            return (bool)out;
+        }
+
+        // ---------------------------------
+        // dump to path at exit and on SIGUSR1, nothing without
+        // MMFNN_STATS; to be called before other threads start
+        // ---------------------------------
+        static void install(const string& path){
+#ifdef MMFNN_STATS
+            registry().path = path;
+            atexit(dumpAtExit);
+
+            // threads started from here on inherit the blocked signal,
+            // only the waiting thread takes it
+            sigset_t signals;
+            sigemptyset(&signals);
+            sigaddset(&signals, SIGUSR1);
+            pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+            thread([signals](){
+                int signal;
+                while( sigwait(&signals, &signal) == 0 ){
+                    dump(registry().path);
+                }
+            }).detach();
+            cout << "statistics are written to " << path << " at exit and on SIGUSR1" << endl;
+#else
+            (void)path;
+#endif
+        }
+
+};
+
+// ---------------------------------
+// records the lifetime of a scope into a histogram
+// ---------------------------------
+class StatsTimer{
+
+    private:
+
+        StatHistogram histogram;
+        uint64_t start;
+
+    public:
+
+        explicit StatsTimer(StatHistogram histogram) : histogram(histogram), start(0) {
+            if constexpr (Stats::ENABLED){
+                this->start = Stats::now();
+            }
+        }
+
+        ~StatsTimer(){
+            if constexpr (Stats::ENABLED){
+                Stats::record(this->histogram, Stats::now() - this->start);
+            }
+        }
+
+};
+
+#endif
@@ -0,0 +1,244 @@
+#ifndef TEXTREADER_H
+#define TEXTREADER_H
+
+/*
+    Parallel reader for line-oriented text files (train/test/factor files)
+
+    The file is memory-mapped and cut into chunks at line boundaries.
+    A first parallel pass counts the lines of every chunk, so each line
+    gets a global index and callers can size their output arrays up
+    front. A second parallel pass hands every line to a parser that
+    writes straight into those arrays. Fields are read with
+    std::from_chars, no strings or streams are created.
+
+    Empty lines are skipped and do not get an index.
+
+    Part of MMFNN guiding code. Provided as is.
+    Tested with C++17 (g++ ver. 12.2)
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <charconv>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <omp.h>
+
+using namespace std;
+
+class TextReader{
+
+    private:
+
+        const char* data;
+        size_t size;
+        vector<size_t> chunkBegins; // numChunks+1 byte offsets
+        vector<size_t> chunkFirstLines; // numChunks+1 line indices
+
+        // ---------------------------------
+        // end of the line starting at p, without '\r'
+        // ---------------------------------
+        static const char* lineEnd(const char* p, const char* end, const char*& next){
+            const char* newline = static_cast<const char*>(memchr(p, '\n', end-p));
+            next = (newline != nullptr) ? newline+1 : end;
+            const char* e = (newline != nullptr) ? newline : end;
+            if( e > p && e[-1] == '\r' ){
+                e--;
+            }
+            return e;
+        }
+
+    public:
+
+        TextReader() : data(nullptr), size(0) {}
+
+        TextReader(const TextReader&) = delete;
+        TextReader& operator=(const TextReader&) = delete;
+
+        ~TextReader(){
+            this->close();
+        }
+
+        // ---------------------------------
+        // map a file and index its lines
+        // numThreads == 0 uses all cores
+        // ---------------------------------
+        bool open(const string& path, bool skipHeaderLine = false, unsigned int numThreads = 0){
+
+            this->close();
+
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if( fd < 0 ){
+                cout << "ERROR: Unable to open file " << path << endl;
+                return false;
+            }
+            struct stat st;
+            if( fstat(fd, &st) != 0 ){
+                ::close(fd);
+                cout << "ERROR: Unable to open file " << path << endl;
+                return false;
+            }
+            if( st.st_size > 0 ){
+                void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if( mapping == MAP_FAILED ){
+                    ::close(fd);
+                    cout << "ERROR: Unable to map file " << path << endl;
+                    return false;
+                }
+                madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+                this->data = static_cast<const char*>(mapping);
+                this->size = st.st_size;
+            }
+            ::close(fd);
+
+            size_t begin = 0;
+            if( skipHeaderLine && this->size > 0 ){
+                const char* next;
+                lineEnd(this->data, this->data + this->size, next);
+                begin = next - this->data;
+            }
+
+            // chunk boundaries, each moved forward to the start of a line
+            unsigned int numChunks = (numThreads > 0 ? numThreads : omp_get_max_threads()) * 4;
+            size_t chunkSize = (this->size - begin) / numChunks + 1;
+            this->chunkBegins.assign(numChunks+1, this->size);
+            this->chunkBegins[0] = begin;
+            for(unsigned int c=1; c<numChunks; c++){
+                size_t b = max(this->chunkBegins[c-1], begin + c*chunkSize);
+                if( b < this->size ){
+                    const char* newline = static_cast<const char*>(memchr(this->data + b - 1, '\n', this->size - b + 1));
+                    b = (newline != nullptr) ? newline + 1 - this->data : this->size;
+                }
+                this->chunkBegins[c] = min(b, this->size);
+            }
+
+            // count non-empty lines per chunk
+            this->chunkFirstLines.assign(numChunks+1, 0);
+            #pragma omp parallel for schedule(dynamic) num_threads(numThreads > 0 ? numThreads : omp_get_max_threads())
+            for(unsigned int c=0; c<numChunks; c++){
+                const char* p = this->data + this->chunkBegins[c];
+                const char* end = this->data + this->chunkBegins[c+1];
+                size_t numLines = 0;
+                while( p < end ){
+                    const char* next;
+                    if( lineEnd(p, end, next) > p ){
+                        numLines++;
+                    }
+                    p = next;
+                }
+                this->chunkFirstLines[c+1] = numLines;
+            }
+            for(unsigned int c=0; c<numChunks; c++){
+                this->chunkFirstLines[c+1] += this->chunkFirstLines[c];
+            }
+
+            return true;
+        }
+
+        void close(){
+            if( this->data != nullptr ){
+                munmap(const_cast<char*>(this->data), this->size);
+            }
+            this->data = nullptr;
+            this->size = 0;
+            this->chunkBegins.clear();
+            this->chunkFirstLines.clear();
+        }
+
+        size_t getNumLines() const {
+            return this->chunkFirstLines.empty() ? 0 : this->chunkFirstLines.back();
+        }
+
+        // ---------------------------------
+        // call parse(lineIndex, begin, end) for every non-empty line,
+        // chunks run in parallel, lines of a chunk in order
+        // ---------------------------------
+        template<typename LineParser>
+        void parseLines(LineParser parse, unsigned int numThreads = 0) const {
+            unsigned int numChunks = this->chunkBegins.empty() ? 0 : this->chunkBegins.size()-1;
+            #pragma omp parallel for schedule(dynamic) num_threads(numThreads > 0 ? numThreads : omp_get_max_threads())
+            for(unsigned int c=0; c<numChunks; c++){
+                const char* p = this->data + this->chunkBegins[c];
+                const char* end = this->data + this->chunkBegins[c+1];
+                size_t lineIndex = this->chunkFirstLines[c];
+                while( p < end ){
+                    const char* next;
+                    const char* e = lineEnd(p, end, next);
+                    if( e > p ){
+                        parse(lineIndex, p, e);
+                        lineIndex++;
+                    }
+                    p = next;
+                }
+            }
+        }
+
+        // ---------------------------------
+        // read the fields at columnIndexes (ascending or not) of a
+        // delimited line into values; fields missing from the line keep
+        // their value. Returns the number of fields read.
+        // ---------------------------------
+        template<typename T>
+        static unsigned int parseColumns(const char* begin, const char* end, char delimiter,
+                                         const int* columnIndexes, unsigned int numColumns, T* values){
+            unsigned int numRead = 0;
+            int column = 0;
+            const char* p = begin;
+            while( p <= end ){
+                const char* fieldEnd = static_cast<const char*>(memchr(p, delimiter, end-p));
+                if( fieldEnd == nullptr ){
+                    fieldEnd = end;
+                }
+                for(unsigned int k=0; k<numColumns; k++){
+                    if( columnIndexes[k] == column ){
+                        const char* f = p;
+                        while( f < fieldEnd && *f == ' ' ){
+                            f++;
+                        }
+                        if( from_chars(f, fieldEnd, values[k]).ec == errc() ){
+                            numRead++;
+                        }
+                    }
+                }
+                if( numRead == numColumns ){
+                    break;
+                }
+                p = fieldEnd + 1;
+                column++;
+            }
+            return numRead;
+        }
+
+        // ---------------------------------
+        // read up to maxValues delimited numbers into values,
+        // returns the number read
+        // ---------------------------------
+        template<typename T>
+        static unsigned int parseRow(const char* begin, const char* end, char delimiter,
+                                     T* values, unsigned int maxValues){
+            unsigned int numRead = 0;
+            const char* p = begin;
+            while( p < end && numRead < maxValues ){
+                while( p < end && *p == ' ' ){
+                    p++;
+                }
+                from_chars_result result = from_chars(p, end, values[numRead]);
+                if( result.ec != errc() ){
+                    break;
+                }
+                numRead++;
+                p = result.ptr;
+                if( p < end && *p == delimiter ){
+                    p++;
+                }
+            }
+            return numRead;
+        }
+
+};
+
+#endif
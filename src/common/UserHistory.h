@@ -0,0 +1,326 @@
+#ifndef USERHISTORY_H
+#define USERHISTORY_H
+
+/*
+    User histories (I_u^+) in compressed sparse row form
+
+    offsets[u] .. offsets[u+1] index the items of user u, which are kept
+    sorted and unique. The arrays are either owned or a view on memory
+    owned elsewhere, e.g. a memory-mapped model bundle. A history is
+    read-only once built and can be shared by any number of threads.
+    As text, "user<TAB>item,item,..." per line (see read).
+
+    Part of MMFNN guiding code. Provided as is.
+    Tested with C++17 (g++ ver. 12.2)
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <charconv>
+#include <atomic>
+#include <algorithm>
+#include <omp.h>
+#include "TextReader.h"
+
+using namespace std;
+
+class UserHistory{
+
+    private:
+
+        vector<uint64_t> ownedOffsets;
+        vector<unsigned int> ownedItems;
+
+        const uint64_t* offsets;
+        const unsigned int* items;
+        unsigned int numUsers;
+
+        void useOwned(){
+            this->offsets = this->ownedOffsets.data();
+            this->items = this->ownedItems.data();
+            this->numUsers = this->ownedOffsets.empty() ? 0 : this->ownedOffsets.size()-1;
+        }
+
+        // ---------------------------------
+        // calls item(value) for every number of a comma separated list,
+        // empty or malformed fields (e.g. a trailing comma) are skipped
+        // ---------------------------------
+        template<typename ItemFn>
+        static void forEachItem(const char* p, const char* end, ItemFn item){
+            while( p < end ){
+                const char* fieldEnd = static_cast<const char*>(memchr(p, ',', end-p));
+                if( fieldEnd == nullptr ){
+                    fieldEnd = end;
+                }
+                while( p < fieldEnd && *p == ' ' ){
+                    p++;
+                }
+                unsigned int value;
+                if( p < fieldEnd && from_chars(p, fieldEnd, value).ec == errc() ){
+                    item(value);
+                }
+                p = fieldEnd + 1;
+            }
+        }
+
+    public:
+
+        UserHistory() : offsets(nullptr), items(nullptr), numUsers(0) {}
+
+        UserHistory(const UserHistory&) = delete;
+        UserHistory& operator=(const UserHistory&) = delete;
+
+        UserHistory(UserHistory&& other) noexcept {
+            *this = std::move(other);
+        }
+
+        UserHistory& operator=(UserHistory&& other) noexcept {
+            if( this != &other ){
+                bool otherOwns = !other.ownedOffsets.empty();
+                this->ownedOffsets = std::move(other.ownedOffsets);
+                this->ownedItems = std::move(other.ownedItems);
+                if( otherOwns ){
+                    this->useOwned();
+                } else {
+                    this->offsets = other.offsets;
+                    this->items = other.items;
+                    this->numUsers = other.numUsers;
+                }
+                other.offsets = nullptr;
+                other.items = nullptr;
+                other.numUsers = 0;
+            }
+            return *this;
+        }
+
+        // ---------------------------------
+        // non-owning view on CSR arrays (offsets has numUsers+1 entries,
+        // items sorted and unique per user)
+        // ---------------------------------
+        static UserHistory view(const uint64_t* offsets, const unsigned int* items, unsigned int numUsers){
+            UserHistory history;
+            history.offsets = offsets;
+            history.items = items;
+            history.numUsers = numUsers;
+            return history;
+        }
+
+        // ---------------------------------
+        // build from raw CSR arrays, rows need not be sorted or unique
+        // ---------------------------------
+        static UserHistory fromCSR(vector<uint64_t>&& offsets, vector<unsigned int>&& items){
+
+            UserHistory history;
+            history.ownedOffsets = std::move(offsets);
+            history.ownedItems = std::move(items);
+            if( history.ownedOffsets.empty() ){
+                history.ownedOffsets.assign(1, 0);
+            }
+            unsigned int numUsers = history.ownedOffsets.size()-1;
+            uint64_t* rowOffsets = history.ownedOffsets.data();
+            unsigned int* rowItems = history.ownedItems.data();
+
+            // sort and dedup every row in place, keep the new row sizes
+            vector<uint64_t> rowSizes(numUsers);
+            #pragma omp parallel for schedule(dynamic, 256)
+            for(long long u=0; u<numUsers; u++){
+                unsigned int* begin = rowItems + rowOffsets[u];
+                unsigned int* end = rowItems + rowOffsets[u+1];
+                sort(begin, end);
+                rowSizes[u] = unique(begin, end) - begin;
+            }
+
+            // compact rows that lost duplicates
+            uint64_t position = 0;
+            for(unsigned int u=0; u<numUsers; u++){
+                uint64_t begin = rowOffsets[u];
+                if( position != begin ){
+                    copy(rowItems + begin, rowItems + begin + rowSizes[u], rowItems + position);
+                }
+                rowOffsets[u] = position;
+                position += rowSizes[u];
+            }
+            rowOffsets[numUsers] = position;
+            history.ownedItems.resize(position);
+            history.ownedItems.shrink_to_fit();
+
+            history.useOwned();
+            return history;
+        }
+
+        // ---------------------------------
+        // build from (user,item) pairs, pairAt(k, user, item) yields pair k
+        // ---------------------------------
+        template<typename PairAt>
+        static UserHistory fromPairs(unsigned int numUsers, size_t numPairs, PairAt pairAt){
+
+            vector<uint64_t> offsets(numUsers+1, 0);
+            for(size_t k=0; k<numPairs; k++){
+                unsigned int user, item;
+                pairAt(k, user, item);
+                if( user < numUsers ){
+                    offsets[user+1]++;
+                }
+            }
+            for(unsigned int u=0; u<numUsers; u++){
+                offsets[u+1] += offsets[u];
+            }
+
+            vector<unsigned int> items(offsets[numUsers]);
+            vector<uint64_t> cursor(offsets.begin(), offsets.end()-1);
+            for(size_t k=0; k<numPairs; k++){
+                unsigned int user, item;
+                pairAt(k, user, item);
+                if( user < numUsers ){
+                    items[cursor[user]++] = item;
+                }
+            }
+
+            return fromCSR(std::move(offsets), std::move(items));
+        }
+
+        // ---------------------------------
+        // read "user<TAB>item,item,..." lines, users >= numUsers are
+        // skipped and items >= numItems dropped (with a warning); empty
+        // if the file cannot be opened
+        // ---------------------------------
+        static UserHistory read(const string& path, unsigned int numUsers, unsigned int numItems, unsigned int numThreads = 0){
+
+            TextReader reader;
+            if( !reader.open(path, false, numThreads) ){
+                return UserHistory();
+            }
+
+            // first pass: user and number of items of every line
+            size_t numLines = reader.getNumLines();
+            vector<unsigned int> lineUsers(numLines, numUsers);
+            vector<uint64_t> lineSizes(numLines, 0);
+            atomic<size_t> numDropped(0);
+            reader.parseLines([&](size_t ll, const char* begin, const char* end){
+                const char* tab = static_cast<const char*>(memchr(begin, '\t', end-begin));
+                if( tab == nullptr ){
+                    return;
+                }
+                if( from_chars(begin, tab, lineUsers[ll]).ec != errc() ){
+                    lineUsers[ll] = numUsers;
+                    return;
+                }
+                size_t lineDropped = 0;
+                forEachItem(tab+1, end, [&](unsigned int item){
+                    if( item < numItems ){
+                        lineSizes[ll]++;
+                    } else {
+                        lineDropped++;
+                    }
+                });
+                numDropped += lineDropped;
+            }, numThreads);
+            if( numDropped > 0 ){
+                cout << "WARNING: " << numDropped << " out of range items in " << path << " skipped" << endl;
+            }
+
+            // CSR offsets, and where the items of every line go
+            vector<uint64_t> offsets(numUsers+1, 0);
+            for(size_t ll=0; ll<numLines; ll++){
+                if( lineUsers[ll] < numUsers ){
+                    offsets[lineUsers[ll]+1] += lineSizes[ll];
+                }
+            }
+            for(unsigned int u=0; u<numUsers; u++){
+                offsets[u+1] += offsets[u];
+            }
+            vector<uint64_t> lineBegins(numLines, 0);
+            vector<uint64_t> cursor(offsets.begin(), offsets.end()-1);
+            for(size_t ll=0; ll<numLines; ll++){
+                if( lineUsers[ll] < numUsers ){
+                    lineBegins[ll] = cursor[lineUsers[ll]];
+                    cursor[lineUsers[ll]] += lineSizes[ll];
+                }
+            }
+
+            // second pass: items straight into place
+            vector<unsigned int> items(offsets[numUsers]);
+            reader.parseLines([&](size_t ll, const char* begin, const char* end){
+                if( lineUsers[ll] < numUsers ){
+                    const char* tab = static_cast<const char*>(memchr(begin, '\t', end-begin));
+                    unsigned int* lineItems = items.data()+lineBegins[ll];
+                    forEachItem(tab+1, end, [&](unsigned int item){
+                        if( item < numItems ){
+                            *lineItems++ = item;
+                        }
+                    });
+                }
+            }, numThreads);
+
+            return fromCSR(std::move(offsets), std::move(items));
+        }
+
+        // ---------------------------------
+        // union of two histories over numUsers users, either may have
+        // fewer users (or none)
+        // ---------------------------------
+        static UserHistory merge(const UserHistory& a, const UserHistory& b, unsigned int numUsers){
+
+            vector<uint64_t> offsets(numUsers+1, 0);
+            for(unsigned int u=0; u<numUsers; u++){
+                offsets[u+1] = offsets[u] + a.size(u) + b.size(u);
+            }
+
+            vector<unsigned int> items(offsets[numUsers]);
+            #pragma omp parallel for schedule(dynamic, 256)
+            for(long long u=0; u<numUsers; u++){
+                unsigned int* out = items.data() + offsets[u];
+                if( a.size(u) > 0 ){
+                    out = copy(a.begin(u), a.end(u), out);
+                }
+                if( b.size(u) > 0 ){
+                    copy(b.begin(u), b.end(u), out);
+                }
+            }
+
+            return fromCSR(std::move(offsets), std::move(items));
+        }
+
+        // ---------------------------------
+        // Getters
+        // ---------------------------------
+        inline unsigned int getNumUsers() const { return this->numUsers; }
+        inline uint64_t getNumEntries() const { return this->numUsers > 0 ? this->offsets[this->numUsers] : 0; }
+        inline const uint64_t* getOffsets() const { return this->offsets; }
+        inline const unsigned int* getItems() const { return this->items; }
+
+        // ---------------------------------
+        // items of a user, [begin(u), end(u)) sorted
+        // ---------------------------------
+        inline const unsigned int* begin(unsigned int user) const {
+            return this->items + this->offsets[user];
+        }
+
+        inline const unsigned int* end(unsigned int user) const {
+            return this->items + this->offsets[user+1];
+        }
+
+        inline unsigned int size(unsigned int user) const {
+            return user < this->numUsers ? this->offsets[user+1] - this->offsets[user] : 0;
+        }
+
+        inline bool hasHistory(unsigned int user) const {
+            return this->size(user) > 0;
+        }
+
+        // ---------------------------------
+        // membership by binary search
+        // ---------------------------------
+        inline bool contains(unsigned int user, unsigned int item) const {
+            if( user >= this->numUsers ){
+                return false;
+            }
+            return binary_search(this->begin(user), this->end(user), item);
+        }
+
+};
+
+#endif
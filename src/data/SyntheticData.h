@@ -0,0 +1,359 @@
+#ifndef SYNTHETICDATA_H
+#define SYNTHETICDATA_H
+
+/*
+    Synthetic implicit feedback for scaling tests
+
+    Item popularity follows a power law (Zipf): the item of popularity
+    rank r is drawn with weight 1/(r+1)^itemExponent, and ranks are
+    spread randomly over item ids. User history lengths are heavy
+    tailed, Pareto with minHistory and historyAlpha and capped at
+    maxHistory (and half the catalog).
+
+    Planted structure: items belong to one of numClusters clusters and
+    every user prefers clustersPerUser of them. With probability
+    structure an item is drawn from a preferred cluster (by popularity
+    within the cluster), else from the whole catalog, so a model can
+    learn the clusters and accuracy means something. structure = 0
+    gives popularity only.
+
+    One item of every user with at least two items is held out as the
+    test item, as in data/ml1m. Files have "user<TAB>item<TAB>1" lines,
+    as read by the BPRMF driver and getTestData.
+
+    Optionally, planted factors are written as a model bundle for
+    prediction-only benchmarks: Q[i] is the centroid of its cluster,
+    scaled up with popularity, P[u] the weighted centroids of the
+    preferred clusters, both plus gaussian noise; the bundle history is
+    the training part.
+
+    Users are generated in blocks with one generator per block, so the
+    output only depends on the seed, not on the number of threads.
+
+    Part of MMFNN guiding code. Provided as is.
+    Tested with C++17 (g++ ver. 12.2)
+ */
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <random>
+#include <cmath>
+#include <charconv>
+#include <algorithm>
+#include <omp.h>
+#include "../common/FactorMatrix.h"
+#include "../common/UserHistory.h"
+#include "../common/ModelBundle.h"
+
+using namespace std;
+
+struct SyntheticParams{
+    unsigned int numUsers = 100000;
+    unsigned int numItems = 10000;
+    double itemExponent = 1.0; // Zipf exponent of item popularity
+    unsigned int minHistory = 5; // items per user before the test item
+    unsigned int maxHistory = 5000;
+    double historyAlpha = 1.5; // Pareto exponent of history lengths, smaller is heavier
+    unsigned int numClusters = 64;
+    unsigned int clustersPerUser = 3;
+    double structure = 0.8; // share of items from the preferred clusters
+    double factorNoise = 0.3; // of the planted factors
+    unsigned int seed = 1234;
+};
+
+class SyntheticData{
+
+    private:
+
+        static const unsigned int USER_BLOCK = 1024;
+
+        SyntheticParams params;
+        bool valid; // false for an empty catalog or no users, write() fails
+        unsigned int maxLength;
+
+        vector<unsigned int> itemClusters;
+        vector<double> itemPopularity; // relative, in (0,1], 1 for the most popular item
+
+        // cumulative weights of all items, and of the items of each cluster
+        vector<unsigned int> itemOfRank;
+        vector<double> cdf;
+        vector<uint64_t> clusterOffsets;
+        vector<unsigned int> clusterItems;
+        vector<double> clusterCdf;
+
+        // per-block scratch
+        struct Scratch{
+            vector<unsigned int> clusters;
+            vector<double> weights; // cumulative
+            vector<unsigned int> items;
+        };
+
+        static unsigned int pick(const double* cdf, size_t size, double u){
+            return min<size_t>(upper_bound(cdf, cdf + size, u * cdf[size-1]) - cdf, size-1);
+        }
+
+        static void appendLine(string& out, unsigned int user, unsigned int item){
+            char line[32]; // two 10-digit numbers and 4 chars
+            char* end = to_chars(line, line + 10, user).ptr;
+            *end++ = '\t';
+            end = to_chars(end, end + 10, item).ptr;
+            *end++ = '\t';
+            *end++ = '1';
+            *end++ = '\n';
+            out.append(line, end);
+        }
+
+        // ---------------------------------
+        // preferred clusters of a user and the items of its history,
+        // sorted and unique; may fall short of the drawn length if the
+        // preferred clusters are small
+        // ---------------------------------
+        void generateUser(mt19937& generator, Scratch& scratch) const {
+            uniform_real_distribution<double> uniform(0.0, 1.0);
+            exponential_distribution<double> exponential(1.0);
+            uniform_int_distribution<unsigned int> anyCluster(0, this->params.numClusters-1);
+
+            scratch.clusters.resize(this->params.clustersPerUser);
+            scratch.weights.resize(this->params.clustersPerUser);
+            double total = 0.0;
+            for(unsigned int c=0; c<this->params.clustersPerUser; c++){
+                scratch.clusters[c] = anyCluster(generator);
+                total += exponential(generator);
+                scratch.weights[c] = total;
+            }
+
+            double length = this->params.minHistory / pow(1.0 - uniform(generator), 1.0/this->params.historyAlpha);
+            unsigned int target = (unsigned int)min<double>(length, this->maxLength) + 1; // + test item
+
+            vector<unsigned int>& items = scratch.items;
+            items.clear();
+            for(unsigned int round=0; round<32 && items.size()<target; round++){
+                for(size_t n=items.size(); n<target; n++){
+                    if( uniform(generator) < this->params.structure ){
+                        unsigned int cluster = scratch.clusters[pick(scratch.weights.data(), scratch.weights.size(), uniform(generator))];
+                        uint64_t begin = this->clusterOffsets[cluster];
+                        uint64_t size = this->clusterOffsets[cluster+1] - begin;
+                        if( size > 0 ){
+                            items.push_back(this->clusterItems[begin + pick(&this->clusterCdf[begin], size, uniform(generator))]);
+                            continue;
+                        }
+                    }
+                    items.push_back(this->itemOfRank[pick(this->cdf.data(), this->cdf.size(), uniform(generator))]);
+                }
+                sort(items.begin(), items.end());
+                items.erase(unique(items.begin(), items.end()), items.end());
+            }
+        }
+
+        // ---------------------------------
+        // row of the planted factors around the weighted centroids
+        // ---------------------------------
+        static void plantRow(const FactorMatrix& centroids, const unsigned int* clusters, const double* weights,
+                             unsigned int numClusters, double scale, double noise,
+                             mt19937& generator, factor_t* row){
+            unsigned int numLatentFactors = centroids.getNumCols();
+            normal_distribution<double> gaussian(0.0, noise / sqrt((double)numLatentFactors));
+            for(unsigned int j=0; j<numLatentFactors; j++){
+                double value = 0.0;
+                for(unsigned int c=0; c<numClusters; c++){
+                    value += weights[c] * centroids[clusters[c]][j];
+                }
+                row[j] = scale*value + gaussian(generator);
+            }
+        }
+
+    public:
+
+        explicit SyntheticData(const SyntheticParams& params) : params(params), valid(false), maxLength(0) {
+
+            unsigned int numItems = this->params.numItems;
+            if( numItems == 0 || this->params.numUsers == 0 ){
+                cout << "ERROR: Synthetic data needs at least one user and one item" << endl;
+                return;
+            }
+            this->valid = true;
+            this->params.numClusters = max(1u, this->params.numClusters);
+            this->params.clustersPerUser = max(1u, this->params.clustersPerUser);
+            this->maxLength = max(1u, min(this->params.maxHistory, numItems/2));
+
+            mt19937 generator(this->params.seed);
+
+            // popularity ranks spread over item ids
+            this->itemOfRank.resize(numItems);
+            for(unsigned int i=0; i<numItems; i++){
+                this->itemOfRank[i] = i;
+            }
+            shuffle(this->itemOfRank.begin(), this->itemOfRank.end(), generator);
+
+            this->cdf.resize(numItems);
+            this->itemPopularity.resize(numItems);
+            double total = 0.0;
+            for(unsigned int r=0; r<numItems; r++){
+                total += 1.0 / pow(r+1.0, this->params.itemExponent);
+                this->cdf[r] = total;
+                this->itemPopularity[this->itemOfRank[r]] = 1.0 - log(r+1.0)/log(numItems+1.0);
+            }
+
+            // clusters, items of a cluster by popularity rank
+            uniform_int_distribution<unsigned int> anyCluster(0, this->params.numClusters-1);
+            this->itemClusters.resize(numItems);
+            this->clusterOffsets.assign(this->params.numClusters+1, 0);
+            for(unsigned int i=0; i<numItems; i++){
+                this->itemClusters[i] = anyCluster(generator);
+                this->clusterOffsets[this->itemClusters[i]+1]++;
+            }
+            for(unsigned int c=0; c<this->params.numClusters; c++){
+                this->clusterOffsets[c+1] += this->clusterOffsets[c];
+            }
+            this->clusterItems.resize(numItems);
+            this->clusterCdf.resize(numItems);
+            vector<uint64_t> positions(this->clusterOffsets.begin(), this->clusterOffsets.end()-1);
+            vector<double> totals(this->params.numClusters, 0.0);
+            for(unsigned int r=0; r<numItems; r++){
+                unsigned int item = this->itemOfRank[r];
+                unsigned int cluster = this->itemClusters[item];
+                totals[cluster] += 1.0 / pow(r+1.0, this->params.itemExponent);
+                this->clusterItems[positions[cluster]] = item;
+                this->clusterCdf[positions[cluster]] = totals[cluster];
+                positions[cluster]++;
+            }
+        }
+
+        // ---------------------------------
+        // writes train and test pairs, and the planted factors with
+        // numLatentFactors columns to modelBundleFile if not empty
+        // numThreads == 0 uses all cores
+        // ---------------------------------
+        bool write(const string& trainFile, const string& testFile,
+                   const string& modelBundleFile, unsigned int numLatentFactors, unsigned int numThreads = 0){
+
+            unsigned int numUsers = this->params.numUsers;
+            unsigned int numClusters = this->params.numClusters;
+            unsigned int clustersPerUser = this->params.clustersPerUser;
+            bool withFactors = !modelBundleFile.empty() && numLatentFactors > 0;
+            if( !this->valid ){
+                return false;
+            }
+
+            ofstream trainOut(trainFile, ios::binary), testOut(testFile, ios::binary);
+            if( !trainOut || !testOut ){
+                cout << "ERROR: Cannot write " << trainFile << " or " << testFile << endl;
+                return false;
+            }
+
+            FactorMatrix centroids, P, Q;
+            vector<uint64_t> offsets;
+            vector<unsigned int> historyItems;
+            if( withFactors ){
+                mt19937 generator(this->params.seed + 1);
+                normal_distribution<double> gaussian(0.0, 1.0 / sqrt((double)numLatentFactors));
+                centroids = FactorMatrix(numClusters, numLatentFactors);
+                for(unsigned int c=0; c<numClusters; c++){
+                    for(unsigned int j=0; j<numLatentFactors; j++){
+                        centroids[c][j] = gaussian(generator);
+                    }
+                }
+                Q = FactorMatrix(this->params.numItems, numLatentFactors);
+                double one = 1.0;
+                for(unsigned int i=0; i<this->params.numItems; i++){
+                    plantRow(centroids, &this->itemClusters[i], &one, 1, 0.5 + this->itemPopularity[i],
+                             this->params.factorNoise, generator, Q[i]);
+                }
+                P = FactorMatrix(numUsers, numLatentFactors);
+                offsets.reserve((size_t)numUsers+1);
+                offsets.push_back(0);
+            }
+
+            size_t numTrain = 0, numTest = 0, maxLength = 0;
+            long long numBlocks = ((long long)numUsers + USER_BLOCK - 1) / USER_BLOCK;
+
+            #pragma omp parallel num_threads(numThreads > 0 ? numThreads : omp_get_max_threads())
+            {
+                Scratch scratch;
+                vector<double> shares(clustersPerUser);
+                string trainText, testText;
+                vector<unsigned int> blockSizes, blockItems;
+
+                #pragma omp for ordered schedule(static, 1)
+                for(long long b=0; b<numBlocks; b++){
+                    seed_seq blockSeed{this->params.seed, (unsigned int)b};
+                    mt19937 generator(blockSeed);
+                    seed_seq factorSeed{this->params.seed, (unsigned int)b, 1u};
+                    mt19937 factorGenerator(factorSeed);
+
+                    trainText.clear();
+                    testText.clear();
+                    blockSizes.clear();
+                    blockItems.clear();
+                    size_t blockTrain = 0, blockTest = 0, blockMax = 0;
+                    unsigned int firstUser = b*USER_BLOCK;
+                    unsigned int lastUser = min<long long>(numUsers, firstUser + (long long)USER_BLOCK);
+                    for(unsigned int u=firstUser; u<lastUser; u++){
+                        generateUser(generator, scratch);
+                        vector<unsigned int>& items = scratch.items;
+
+                        // hold out one item, kept out of the sorted training row
+                        if( items.size() >= 2 ){
+                            uniform_int_distribution<size_t> anyItem(0, items.size()-1);
+                            size_t held = anyItem(generator);
+                            appendLine(testText, u, items[held]);
+                            items.erase(items.begin() + held);
+                            blockTest++;
+                        }
+                        blockTrain += items.size();
+                        blockMax = max(blockMax, items.size());
+                        for(unsigned int item : items){
+                            appendLine(trainText, u, item);
+                        }
+
+                        if( withFactors ){
+                            double total = scratch.weights.back();
+                            for(unsigned int c=0; c<clustersPerUser; c++){
+                                shares[c] = (scratch.weights[c] - (c > 0 ? scratch.weights[c-1] : 0.0)) / total;
+                            }
+                            plantRow(centroids, scratch.clusters.data(), shares.data(), clustersPerUser, 1.0,
+                                     this->params.factorNoise, factorGenerator, P[u]);
+                            blockSizes.push_back(items.size());
+                            blockItems.insert(blockItems.end(), items.begin(), items.end());
+                        }
+                    }
+
+                    #pragma omp ordered
+                    {
+                        trainOut.write(trainText.data(), trainText.size());
+                        testOut.write(testText.data(), testText.size());
+                        numTrain += blockTrain;
+                        numTest += blockTest;
+                        maxLength = max(maxLength, blockMax);
+                        if( withFactors ){
+                            for(unsigned int size : blockSizes){
+                                offsets.push_back(offsets.back() + size);
+                            }
+                            historyItems.insert(historyItems.end(), blockItems.begin(), blockItems.end());
+                        }
+                    }
+                }
+            }
+            trainOut.close();
+            testOut.close();
+            if( !trainOut || !testOut ){
+                cout << "ERROR: Writing " << trainFile << " or " << testFile << " failed" << endl;
+                return false;
+            }
+            cout << "train pairs = " << numTrain << ", test pairs = " << numTest
+                 << ", mean history = " << 1.*numTrain/max(1u, numUsers) << ", max history = " << maxLength << endl;
+
+            if( withFactors ){
+                UserHistory history = UserHistory::fromCSR(std::move(offsets), std::move(historyItems));
+                if( !ModelBundle::write(modelBundleFile, P, Q, history, nullptr, 0) ){
+                    return false;
+                }
+            }
+            return true;
+        }
+
+};
+
+#endif
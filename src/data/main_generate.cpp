@@ -0,0 +1,76 @@
+/*
+    Generator of synthetic datasets for scaling tests, see SyntheticData
+
+    Writes train and test files in the format of data/ml1m and,
+    optionally, a model bundle of planted factors that main_EP,
+    main_NN and main_bench read without training. To train on the
+    generated data, point trainFile of the BPRMF driver to trainFile
+    below and set numUsers and numItems as here.
+
+    To compile : g++ -O3 -std=c++17 main_generate.cpp -fopenmp -o main_generate.x
+
+    Part of MMFNN guiding code. Provided as is.
+    Tested with C++17 (g++ ver. 12.2)
+
+*/
+
+#include <iostream>
+#include <sys/stat.h>
+#include "SyntheticData.h"
+
+using namespace std;
+
+int main(){
+
+    // ------------------------------------
+    // User input parameters
+    // ------------------------------------
+
+    SyntheticParams params;
+    params.numUsers = 1000000; // up to 10^7
+    params.numItems = 100000; // up to 10^6
+    params.itemExponent = 1.0;
+    params.minHistory = 10;
+    params.maxHistory = 10000;
+    params.historyAlpha = 1.2;
+    params.numClusters = 256;
+    params.clustersPerUser = 3;
+    params.structure = 0.8; // 0 for popularity only
+    params.factorNoise = 0.3;
+    params.seed = 1234;
+
+    // Output files, the directory is created
+    string outputDir = "output/synth";
+    string trainFile = outputDir + "/train.csv";
+    string testFile = outputDir + "/test.csv";
+    string modelBundleFile = outputDir + "/model.bin"; // planted factors, empty to skip
+    unsigned int numLatentFactors = 40;
+
+    unsigned int numThreads = 0; // use 0 for all cores
+
+    // ------------------------------------
+    // Generate
+    // ------------------------------------
+    for(size_t slash = outputDir.find('/'); ; slash = outputDir.find('/', slash+1)){
+        mkdir(outputDir.substr(0, slash).c_str(), 0755);
+        if( slash == string::npos ){
+            break;
+        }
+    }
+
+    cout << "generating " << params.numUsers << " users and " << params.numItems << " items ..." << endl;
+
+    struct timespec start, finish;
+    double elapsed;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    SyntheticData data(params);
+    bool written = data.write(trainFile, testFile, modelBundleFile, numLatentFactors, numThreads);
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    elapsed = (finish.tv_sec - start.tv_sec);
+    elapsed += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+    cout << "*** Generation - elapsed time : " << elapsed << " sec ***" << endl;
+
+    return written ? 0 : 1;
+}
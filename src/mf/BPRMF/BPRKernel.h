@@ -0,0 +1,136 @@
+#ifndef BPRKERNEL_H
+#define BPRKERNEL_H
+
+/*
+    Fused BPR SGD step
+
+    One call does a whole update for a (user, positive, negative) triple:
+    x = p.(qPos-qNeg), delta = 1-sigmoid(x), then all three rows are
+    updated from their old values in a single loop:
+      p    += eta*(delta*(qPos-qNeg) - lambP*p)
+      qPos += eta*(delta*p           - lambQPlus*qPos)
+      qNeg += eta*(-delta*p          - lambQMinus*qNeg)
+    The rows are fetched once by the dot product and still in L1 for
+    the update loop. The dot product accumulates in accum_t, the update
+    runs in factor_t (see FactorMatrix).
+
+    The step is instantiated for the common dimensions 16/32/40/64/128,
+    where the loops are fully unrolled, and for any other dimension,
+    each for the instruction sets of MatrixOps (AVX-512F, AVX2+FMA,
+    generic). select() picks the instance for a dimension once, using
+    the level MatrixOps dispatches to (including the MMFNN_SIMD cap).
+
+    Part of MMFNN guiding code. Provided as is.
+    Tested with C++17 (g++ ver. 12.2)
+ */
+
+#include <cmath>
+#include <cstring>
+#include "../../common/MatrixOps.h"
+
+using namespace std;
+
+class BPRKernel{
+
+    public:
+
+        struct Params{
+            double eta; // learning rate
+            double lambP; // regularization parameters
+            double lambQPlus;
+            double lambQMinus;
+        };
+
+        typedef void (*Step)(factor_t* p, factor_t* qPos, factor_t* qNeg, unsigned int numLatentFactors, const Params& params);
+
+    private:
+
+        // ---------------------------------
+        // the step, D == 0 for a runtime dimension
+        // ---------------------------------
+        template<unsigned int D>
+        static inline __attribute__((always_inline))
+        void body(factor_t* __restrict p, factor_t* __restrict qPos, factor_t* __restrict qNeg,
+                  unsigned int numLatentFactors, const Params& params){
+
+            const unsigned int n = (D > 0) ? D : numLatentFactors;
+
+            accum_t x = 0.0;
+            #pragma omp simd reduction(+:x)
+            for(unsigned int f=0; f<n; f++){
+                x += (accum_t)p[f]*(qPos[f]-qNeg[f]);
+            }
+
+            // 1 - sigmoid(x), stable for both signs
+            double delta;
+            if( x > 0 ){
+                double ex = exp(-x);
+                delta = ex / (1.0 + ex);
+            } else {
+                delta = 1.0 / (1.0 + exp(x));
+            }
+
+            const factor_t eta = params.eta;
+            const factor_t lambP = params.lambP;
+            const factor_t lambQPlus = params.lambQPlus;
+            const factor_t lambQMinus = params.lambQMinus;
+            const factor_t d = delta;
+            #pragma omp simd
+            for(unsigned int f=0; f<n; f++){
+                factor_t pf = p[f];
+                factor_t pos = qPos[f];
+                factor_t neg = qNeg[f];
+                p[f] = pf + eta*(d*(pos-neg) - lambP*pf);
+                qPos[f] = pos + eta*(d*pf - lambQPlus*pos);
+                qNeg[f] = neg + eta*(-d*pf - lambQMinus*neg);
+            }
+        }
+
+        template<unsigned int D>
+        static void stepGeneric(factor_t* p, factor_t* qPos, factor_t* qNeg, unsigned int n, const Params& params){
+            body<D>(p, qPos, qNeg, n, params);
+        }
+
+#ifdef MMFNN_X86_SIMD
+        template<unsigned int D>
+        __attribute__((target("avx2,fma")))
+        static void stepAVX2(factor_t* p, factor_t* qPos, factor_t* qNeg, unsigned int n, const Params& params){
+            body<D>(p, qPos, qNeg, n, params);
+        }
+
+        template<unsigned int D>
+        __attribute__((target("avx512f")))
+        static void stepAVX512(factor_t* p, factor_t* qPos, factor_t* qNeg, unsigned int n, const Params& params){
+            body<D>(p, qPos, qNeg, n, params);
+        }
+#endif
+
+        template<unsigned int D>
+        static Step pick(){
+#ifdef MMFNN_X86_SIMD
+            const char* level = MatrixOps::simdLevel();
+            if( strcmp(level, "avx512") == 0 ) return &stepAVX512<D>;
+            if( strcmp(level, "avx2") == 0 ) return &stepAVX2<D>;
+#endif
+            return &stepGeneric<D>;
+        }
+
+    public:
+
+        // ---------------------------------
+        // step for rows of numLatentFactors factor_t
+        // ---------------------------------
+        static Step select(unsigned int numLatentFactors){
+            switch( numLatentFactors ){
+                case 16: return pick<16>();
+                case 32: return pick<32>();
+                case 40: return pick<40>();
+                case 64: return pick<64>();
+                case 128: return pick<128>();
+                default: return pick<0>();
+            }
+        }
+
+};
+
+#endif
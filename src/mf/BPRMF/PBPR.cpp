@@ -3,82 +3,250 @@
     (Yagci et al., On Parallelizing SGD for pairwise LtR in CF RSs, 2017)
 
     Part of MMFNN guiding code. Provided as is.
-    Tested with C++11 (g++ ver. 4.9.4)
+    Tested with C++17 (g++ ver. 12.2)
  */
  
 #include "PBPR.h"
+#include <algorithm>
 
 // -------------------------------------
-// Update model
+// One SGD step for a (user, positive item, negative item) triple,
+// gradients from the old values of all three rows (see BPRKernel);
+// frozen rows are stepped on a scratch copy that is thrown away
 // -------------------------------------
-void PBPR::updateParallel(){
+void PBPR::updateTriple(unsigned int user, unsigned int posItem, unsigned int negItem){
 
-    unsigned int lenData = data.size();
+    if( user >= this->firstTrainableUser && posItem >= this->firstTrainableItem && negItem >= this->firstTrainableItem ){
+        this->step(P[user], Q[posItem], Q[negItem], this->numLatentFactors, this->stepParams);
+        return;
+    }
 
-    random_device rd{};
-    mt19937 generator{rd()};
-    uniform_int_distribution<unsigned int> dataDistribution(0, lenData-1);
-    random_device rd2{};
-    mt19937 generator2{rd2()};
+    FactorMatrix& scratch = this->frozenRows[omp_get_thread_num()];
+    factor_t* p = P[user];
+    factor_t* qPos = Q[posItem];
+    factor_t* qNeg = Q[negItem];
+    if( user < this->firstTrainableUser ){
+        copy_n(p, this->numLatentFactors, scratch[0]);
+        p = scratch[0];
+    }
+    if( posItem < this->firstTrainableItem ){
+        copy_n(qPos, this->numLatentFactors, scratch[1]);
+        qPos = scratch[1];
+    }
+    if( negItem < this->firstTrainableItem ){
+        copy_n(qNeg, this->numLatentFactors, scratch[2]);
+        qNeg = scratch[2];
+    }
+    this->step(p, qPos, qNeg, this->numLatentFactors, this->stepParams);
+}
+
+// -------------------------------------
+// Sampling statistics of a shard or cell, see Stats
+// -------------------------------------
+void PBPR::countSamples(size_t numSamples, size_t numDraws, size_t numFailures){
+    Stats::add(STAT_TRAIN_SAMPLES, numSamples);
+    Stats::add(STAT_TRAIN_NEGATIVE_DRAWS, numDraws);
+    Stats::add(STAT_TRAIN_NEGATIVE_FAILURES, numFailures);
+    Stats::add(STAT_TRAIN_UPDATES, numSamples - numFailures);
+}
+
+// -------------------------------------
+// Update model with the samples of one shard (one epoch of a thread)
+// returns the number of samples drawn
+// -------------------------------------
+size_t PBPR::updateShard(unsigned int shard){
+
+    size_t shardBegin = this->shardBegins[shard];
+    size_t shardSize = this->shardBegins[shard+1] - shardBegin;
+    if( shardSize == 0 ){
+        return 0;
+    }
+
+    mt19937& generator = this->generators[shard];
+    uniform_int_distribution<size_t> dataDistribution(shardBegin, shardBegin+shardSize-1);
     uniform_int_distribution<unsigned int> itemDistribution(0, indexCounterItem-1);
 
-    unsigned int epoch = 0;
-    for( unsigned int k=0; k<this->numEpochs/this->numProcs; k++ ){
-        cout << "epoch: " << epoch << endl;
-        for( int j=0; j<lenData; j++ ){
-            // sample with repetition
-            unsigned int rnd = dataDistribution(generator);
-            unsigned int user = data[rnd].getUserId();
-            unsigned int posItem = data[rnd].getItemId();
-            int negItem = -1;
-            unsigned int numTrials = 0;
-            while (numTrials < 10){
-                unsigned int rnd2 = itemDistribution(generator2);
-                if( IPlus[user].find(rnd2) == IPlus[user].end() ){
-                    negItem = rnd2;
-                    break;
-                }
-                numTrials += 1;
+    size_t numDraws = 0, numFailures = 0;
+    for( size_t j=0; j<shardSize; j++ ){
+        // sample with repetition
+        size_t rnd = dataDistribution(generator);
+        unsigned int user = data[rnd].getUserId();
+        unsigned int posItem = data[rnd].getItemId();
+        int negItem = -1;
+        unsigned int numTrials = 0;
+        while (numTrials < 10){
+            unsigned int rnd2 = itemDistribution(generator);
+            if( !IPlus.contains(user, rnd2) ){
+                negItem = rnd2;
+                break;
             }
-            if( negItem != -1 ){
+            numTrials += 1;
+        }
+        numDraws += min(numTrials+1, 10u);
+        if( negItem != -1 ){
+            this->updateTriple(user, posItem, negItem);
+        } else {
+            numFailures++;
+        }
+    }
 
-                double delta = 1.0 - this->sigmoid( MatrixOps::diffDot(P[user], Q[posItem], Q[negItem], this->numLatentFactors) );
+    countSamples(shardSize, numDraws, numFailures);
+    return shardSize;
+}
 
-                for(int f=0; f<this->numLatentFactors; f++){
-                    P[user][f] += this->eta *
-                    (delta * (Q[posItem][f] - Q[negItem][f]) - this->lambP * P[user][f]);
-                }
+// -------------------------------------
+// Update model with the samples of one stratum cell, negatives from
+// the cell's item block only
+// returns the number of samples drawn
+// -------------------------------------
+size_t PBPR::updateCell(unsigned int userBlock, unsigned int itemBlock, mt19937& generator){
 
-                for(int f=0; f<this->numLatentFactors; f++){
-                    Q[posItem][f] += this->eta *
-                    (delta * P[user][f] - this->lambQPlus * Q[posItem][f]);
-                }
+    unsigned int cell = userBlock*this->numProcs + itemBlock;
+    size_t cellBegin = this->cellBegins[cell];
+    size_t cellSize = this->cellBegins[cell+1] - cellBegin;
+    size_t itemsBegin = this->blockItemBegins[itemBlock];
+    size_t numBlockItems = this->blockItemBegins[itemBlock+1] - itemsBegin;
+    if( cellSize == 0 || numBlockItems == 0 ){
+        return 0;
+    }
 
-                for(int f=0; f<this->numLatentFactors; f++){
-                    Q[negItem][f] += this->eta *
-                    (delta * -1.0*P[user][f] - this->lambQMinus * Q[negItem][f]);
-                }
+    uniform_int_distribution<size_t> dataDistribution(cellBegin, cellBegin+cellSize-1);
+    uniform_int_distribution<size_t> itemDistribution(itemsBegin, itemsBegin+numBlockItems-1);
 
+    size_t numDraws = 0, numFailures = 0;
+    for( size_t j=0; j<cellSize; j++ ){
+        // sample with repetition
+        size_t rnd = dataDistribution(generator);
+        unsigned int user = data[rnd].getUserId();
+        unsigned int posItem = data[rnd].getItemId();
+        int negItem = -1;
+        unsigned int numTrials = 0;
+        while (numTrials < 10){
+            unsigned int rnd2 = this->blockItems[itemDistribution(generator)];
+            if( !IPlus.contains(user, rnd2) ){
+                negItem = rnd2;
+                break;
             }
-
+            numTrials += 1;
+        }
+        numDraws += min(numTrials+1, 10u);
+        if( negItem != -1 ){
+            this->updateTriple(user, posItem, negItem);
+        } else {
+            numFailures++;
         }
-        epoch += 1;
     }
+
+    countSamples(cellSize, numDraws, numFailures);
+    return cellSize;
+}
+
+// -------------------------------------
+// Assign entities to numBlocks blocks with about equal total counts,
+// in a seeded random order
+// -------------------------------------
+static vector<unsigned int> balancedBlocks(const vector<size_t>& counts, unsigned int numBlocks, mt19937& generator){
+
+    vector<unsigned int> order(counts.size());
+    for(unsigned int e=0; e<order.size(); e++){
+        order[e] = e;
+    }
+    shuffle(order.begin(), order.end(), generator);
+
+    size_t total = 0;
+    for(size_t c : counts){
+        total += c;
+    }
+
+    vector<unsigned int> blockOf(counts.size(), 0);
+    size_t cumulative = 0;
+    for(unsigned int e : order){
+        blockOf[e] = (total > 0) ? min<size_t>(numBlocks-1, cumulative*numBlocks/total) : e % numBlocks;
+        cumulative += counts[e];
+    }
+    return blockOf;
+}
+
+// -------------------------------------
+// Group data by (user block, item block) cell and collect the
+// negative candidates of every item block
+// -------------------------------------
+void PBPR::buildStrata(){
+
+    unsigned int numBlocks = this->numProcs;
+    mt19937 generator(this->seed+2);
+
+    vector<size_t> userCounts(this->numUsers, 0), itemCounts(this->numItems, 0);
+    for(Tuple& t : this->data){
+        userCounts[t.getUserId()]++;
+        itemCounts[t.getItemId()]++;
+    }
+    vector<unsigned int> userBlock = balancedBlocks(userCounts, numBlocks, generator);
+    vector<unsigned int> itemBlock = balancedBlocks(itemCounts, numBlocks, generator);
+
+    // counting sort of the data into cells
+    this->cellBegins.assign(numBlocks*numBlocks+1, 0);
+    for(Tuple& t : this->data){
+        this->cellBegins[userBlock[t.getUserId()]*numBlocks + itemBlock[t.getItemId()] + 1]++;
+    }
+    for(unsigned int c=0; c<numBlocks*numBlocks; c++){
+        this->cellBegins[c+1] += this->cellBegins[c];
+    }
+    vector<Tuple> grouped(this->data.size());
+    vector<size_t> cursor(this->cellBegins.begin(), this->cellBegins.end()-1);
+    for(Tuple& t : this->data){
+        grouped[cursor[userBlock[t.getUserId()]*numBlocks + itemBlock[t.getItemId()]]++] = t;
+    }
+    this->data.swap(grouped);
+
+    // negatives are drawn from 0 .. indexCounterItem-1 as in Hogwild
+    this->blockItemBegins.assign(numBlocks+1, 0);
+    for(unsigned int i=0; i<this->indexCounterItem && i<this->numItems; i++){
+        this->blockItemBegins[itemBlock[i]+1]++;
+    }
+    for(unsigned int b=0; b<numBlocks; b++){
+        this->blockItemBegins[b+1] += this->blockItemBegins[b];
+    }
+    this->blockItems.resize(this->blockItemBegins[numBlocks]);
+    vector<size_t> itemCursor(this->blockItemBegins.begin(), this->blockItemBegins.end()-1);
+    for(unsigned int i=0; i<this->indexCounterItem && i<this->numItems; i++){
+        this->blockItems[itemCursor[itemBlock[i]]++] = i;
+    }
+}
+
+// -------------------------------------
+// One epoch, every shard is updated by one thread, a thread may get
+// several if the team is smaller than numProcs
+// -------------------------------------
+size_t PBPR::epochHogwild(){
+    unsigned int numShards = this->numProcs;
+    size_t numSamples = 0;
+    #pragma omp parallel num_threads(numShards) reduction(+:numSamples)
+    {
+        for(unsigned int t=omp_get_thread_num(); t<numShards; t+=omp_get_num_threads()){
+            numSamples += this->updateShard(t);
+        }
+    } // end of epoch, all threads meet here
+    return numSamples;
 }
 
 // -------------------------------------
-// Sigmoid function
+// One epoch of numProcs sub-epochs, in sub-epoch s user block b is
+// paired with item block (b+s) % numProcs
 // -------------------------------------
-double PBPR::sigmoid(double const &x){
-    if( x > 0 ){
-        return 1.0 / (1.0 + exp(-x));
-    } else if (x <= 0) {
-        double ex = exp(x);
-        return ex / (1.0 + ex);
-    } else {
-        cout << "Sigmoid value error ..." << endl;
-        return 0.0;
+size_t PBPR::epochStratified(){
+    unsigned int numBlocks = this->numProcs;
+    size_t numSamples = 0;
+    #pragma omp parallel num_threads(numBlocks) reduction(+:numSamples)
+    {
+        for(unsigned int s=0; s<numBlocks; s++){
+            for(unsigned int b=omp_get_thread_num(); b<numBlocks; b+=omp_get_num_threads()){
+                numSamples += this->updateCell(b, (b+s) % numBlocks, this->generators[b]);
+            }
+            #pragma omp barrier
+        }
     }
+    return numSamples;
 }
 
 // -------------------------------------
@@ -93,68 +261,315 @@ PBPR::PBPR( int numUsers,
             double lambQPlus,
             double lambQMinus,
             double eta,
-            int numEpochs) {
+            int numEpochs,
+            unsigned int seed) {
 
     this->numUsers = numUsers;
     this->numItems = numItems;
     this->numLatentFactors = numLatentFactors;
-    this->P = MatrixOps::gaussianMatrixBuilder(mu, sigma, numUsers, numLatentFactors);
-    this->Q = MatrixOps::gaussianMatrixBuilder(mu, sigma, numItems, numLatentFactors);
-    this->lambP = lambP;
-    this->lambQPlus = lambQPlus;
-    this->lambQMinus = lambQMinus;
-    this->eta = eta;
+    this->P = MatrixOps::gaussianMatrixBuilder(mu, sigma, numUsers, numLatentFactors, seed);
+    this->Q = MatrixOps::gaussianMatrixBuilder(mu, sigma, numItems, numLatentFactors, seed+1);
+    this->stepParams = {eta, lambP, lambQPlus, lambQMinus};
+    this->step = BPRKernel::select(numLatentFactors);
     this->numEpochs = numEpochs;
+    this->seed = seed;
+    this->numValidationUsers = 0;
+    this->validationN = 10;
+    this->patience = 0;
+    this->validationMetric = VALIDATION_AUC;
+    this->validationNegatives = 100;
+    this->bestEpoch = 0;
+    this->firstTrainableUser = 0;
+    this->firstTrainableItem = 0;
 }
 
 // -------------------------------------
-// Learn model
+// Start from the factors of a previous model with the same number of
+// latent factors and at most as many users and items; its histories
+// are merged into I_u^+ (may be empty). False if it does not fit.
 // -------------------------------------
-void PBPR::learn(vector<Tuple>& data, unsigned int indexCounterItem, unsigned int numProcs){
+bool PBPR::warmStart(const FactorMatrix& previousP, const FactorMatrix& previousQ,
+                     const UserHistory& previousHistory){
 
-    // build user histories in the first pass
-    for( Tuple& uir : data){
-        unsigned int user = uir.getUserId();
-        unsigned int item = uir.getItemId();
+    if( previousP.getNumCols() != this->numLatentFactors || previousQ.getNumCols() != this->numLatentFactors ){
+        cout << "ERROR: Previous model has " << previousP.getNumCols() << " latent factors, expected "
+             << this->numLatentFactors << endl;
+        return false;
+    }
+    if( previousP.getNumRows() > this->numUsers || previousQ.getNumRows() > this->numItems ){
+        cout << "ERROR: Previous model has " << previousP.getNumRows() << " users and " << previousQ.getNumRows()
+             << " items, more than " << this->numUsers << " and " << this->numItems << endl;
+        return false;
+    }
+
+    for(unsigned int u=0; u<previousP.getNumRows(); u++){
+        copy_n(previousP[u], this->numLatentFactors, this->P[u]);
+    }
+    for(unsigned int i=0; i<previousQ.getNumRows(); i++){
+        copy_n(previousQ[i], this->numLatentFactors, this->Q[i]);
+    }
+    this->previousIPlus = UserHistory::merge(previousHistory, UserHistory(), this->numUsers);
+    return true;
+}
+
+// -------------------------------------
+// Only users >= firstUser and items >= firstItem are trained, e.g. the
+// sizes of the previous model for a fold-in; numItems freezes Q
+// -------------------------------------
+void PBPR::setTrainableRows(unsigned int firstUser, unsigned int firstItem){
+    this->firstTrainableUser = min(firstUser, this->numUsers);
+    this->firstTrainableItem = min(firstItem, this->numItems);
+}
+
+// -------------------------------------
+// Validation on numValidationUsers held-out pairs after every epoch,
+// see PBPR.h; numValidationUsers == 0 turns it off
+// -------------------------------------
+void PBPR::setValidation(unsigned int numValidationUsers, unsigned int N, unsigned int patience,
+                         ValidationMetric metric, unsigned int numNegatives){
+    this->numValidationUsers = numValidationUsers;
+    this->validationN = max(N, 1u);
+    this->patience = patience;
+    this->validationMetric = metric;
+    this->validationNegatives = max(numNegatives, 1u);
+}
+
+// -------------------------------------
+// Pick one (user, item) pair of each of numValidationUsers random
+// users with at least two items in data (not in the previous
+// histories of a warm start), and drop its samples from data
+// -------------------------------------
+void PBPR::holdOutValidation(){
+
+    this->validationPairs.clear();
+
+    // items of the training data, without those of a warm start's
+    // previous histories, which are not in data and cannot be held out
+    UserHistory dataIPlus = UserHistory::fromPairs(this->numUsers, this->data.size(),
+        [this](size_t k, unsigned int& user, unsigned int& item){
+            user = this->data[k].getUserId();
+            item = this->data[k].getItemId();
+            if( this->previousIPlus.contains(user, item) ){
+                user = this->numUsers;
+            }
+        });
+
+    vector<unsigned int> users;
+    for(unsigned int u=0; u<this->numUsers; u++){
+        if( dataIPlus.size(u) >= 2 ){
+            users.push_back(u);
+        }
+    }
+    mt19937 generator(this->seed+3);
+    shuffle(users.begin(), users.end(), generator);
+    users.resize(min<size_t>(users.size(), this->numValidationUsers));
+    sort(users.begin(), users.end());
+
+    vector<int> heldItems(this->numUsers, -1);
+    for(unsigned int u : users){
+        uniform_int_distribution<size_t> itemDistribution(0, dataIPlus.size(u)-1);
+        heldItems[u] = dataIPlus.begin(u)[itemDistribution(generator)];
+        this->validationPairs.emplace_back(u, heldItems[u], 1);
+    }
+
+    this->data.erase(remove_if(this->data.begin(), this->data.end(), [&heldItems](Tuple& t){
+        return heldItems[t.getUserId()] == (int)t.getItemId();
+    }), this->data.end());
+}
+
+// -------------------------------------
+// Loss, AUC and HR@N of the held-out pairs; the negatives of a pair
+// are the same in every epoch
+// -------------------------------------
+ValidationResult PBPR::validate(){
+
+    unsigned int numPairs = this->validationPairs.size();
+    double loss = 0.0, auc = 0.0;
+    size_t numComparisons = 0, hits = 0;
+
+    #pragma omp parallel reduction(+:loss,auc,numComparisons,hits)
+    {
+        ItemMarker history;
+
+        #pragma omp for schedule(dynamic, 16)
+        for(long long v=0; v<numPairs; v++){
+            unsigned int user = this->validationPairs[v].getUserId();
+            unsigned int posItem = this->validationPairs[v].getItemId();
+            const factor_t* p = this->P[user];
+            double posScore = MatrixOps::dot(p, this->Q[posItem], this->numLatentFactors);
+
+            // sampled loss and AUC
+            seed_seq pairSeed{this->seed, 4u, (unsigned int)v};
+            mt19937 generator(pairSeed);
+            uniform_int_distribution<unsigned int> itemDistribution(0, this->numItems-1);
+            for(unsigned int n=0; n<this->validationNegatives; n++){
+                for(unsigned int numTrials=0; numTrials<10; numTrials++){
+                    unsigned int negItem = itemDistribution(generator);
+                    if( !this->IPlus.contains(user, negItem) ){
+                        double x = posScore - MatrixOps::dot(p, this->Q[negItem], this->numLatentFactors);
+                        loss += (x > 0) ? log1p(exp(-x)) : -x + log1p(exp(x)); // -log(sigmoid(x))
+                        auc += (x > 0) ? 1.0 : (x == 0 ? 0.5 : 0.0);
+                        numComparisons++;
+                        break;
+                    }
+                }
+            }
 
-        if( IPlus.find(user) == IPlus.end() ){
-            unordered_set<unsigned int> setHistoryItems;
-            IPlus[user] = setHistoryItems;
+            // rank among all items outside the history
+            history.clear(this->numItems);
+            history.mark(this->IPlus.begin(user), this->IPlus.end(user));
+            unsigned int rank = 0;
+            for(unsigned int i=0; i<this->numItems && rank<this->validationN; i++){
+                if( !history.isMarked(i) && MatrixOps::dot(p, this->Q[i], this->numLatentFactors) > posScore ){
+                    rank++;
+                }
+            }
+            if( rank < this->validationN ){
+                hits++;
+            }
         }
-        IPlus[user].insert(item);
+    }
+
+    ValidationResult result;
+    result.loss = numComparisons > 0 ? loss/numComparisons : 0.0;
+    result.auc = numComparisons > 0 ? auc/numComparisons : 0.0;
+    result.hitRate = numPairs > 0 ? 1.*hits/numPairs : 0.0;
+    return result;
+}
+
+// -------------------------------------
+// Learn model
+// -------------------------------------
+void PBPR::learn(vector<Tuple>& data, unsigned int indexCounterItem, unsigned int numProcs,
+                 TrainingMode mode){
+
+    // build user histories in the first pass
+    this->IPlus = UserHistory::fromPairs(this->numUsers, data.size(),
+        [&](size_t k, unsigned int& user, unsigned int& item){
+            user = data[k].getUserId();
+            item = data[k].getItemId();
+        });
+    if( this->previousIPlus.getNumUsers() > 0 ){
+        this->IPlus = UserHistory::merge(this->IPlus, this->previousIPlus, this->numUsers);
     }
 
     // parallel processing coordination
     this->data = data;
+    if( this->firstTrainableUser > 0 || this->firstTrainableItem > 0 ){
+        unsigned int firstUser = this->firstTrainableUser, firstItem = this->firstTrainableItem;
+        this->data.erase(remove_if(this->data.begin(), this->data.end(), [firstUser, firstItem](Tuple& t){
+            return t.getUserId() < firstUser && t.getItemId() < firstItem;
+        }), this->data.end());
+        this->frozenRows.clear();
+        for(unsigned int t=0; t<max(numProcs, 1u); t++){
+            this->frozenRows.emplace_back(3, this->numLatentFactors);
+        }
+        cout << this->data.size() << " samples with trainable rows (users from " << firstUser
+             << ", items from " << firstItem << ")" << endl;
+    }
     this->indexCounterItem = indexCounterItem;
-    this->numProcs = numProcs;
+    this->numProcs = max(numProcs, 1u);
+    if( this->numValidationUsers > 0 ){
+        this->holdOutValidation();
+    }
+
+    // one shard and one random stream per thread
+    mt19937 shuffleGenerator(this->seed);
+    shuffle(this->data.begin(), this->data.end(), shuffleGenerator);
+    this->shardBegins.resize(this->numProcs+1);
+    this->generators.clear();
+    for(unsigned int t=0; t<=this->numProcs; t++){
+        this->shardBegins[t] = this->data.size() * t / this->numProcs;
+    }
+    for(unsigned int t=0; t<this->numProcs; t++){
+        seed_seq streamSeed{this->seed, t+1};
+        this->generators.emplace_back(streamSeed);
+    }
+    if( mode == TRAINING_STRATIFIED ){
+        this->buildStrata();
+    }
+
     omp_set_dynamic(0);
     omp_set_num_threads(this->numProcs);
-    #pragma omp parallel
-    {
-        this->updateParallel();
+    size_t totalSamples = 0;
+    double totalElapsed = 0.0;
+    bool validating = !this->validationPairs.empty();
+    double bestValue = -1.0;
+    FactorMatrix bestP, bestQ;
+    this->bestEpoch = this->numEpochs-1;
+    for(unsigned int epoch=0; epoch<this->numEpochs; epoch++){
+
+        struct timespec start, finish;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        size_t numSamples = (mode == TRAINING_STRATIFIED) ? this->epochStratified() : this->epochHogwild();
+
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        double elapsed = (finish.tv_sec - start.tv_sec);
+        elapsed += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+        totalSamples += numSamples;
+        totalElapsed += elapsed;
+        Stats::add(STAT_TRAIN_NS, (uint64_t)(elapsed*1e9));
+        Stats::record(STAT_TRAIN_EPOCH_NS, (uint64_t)(elapsed*1e9));
+        cout << "epoch: " << epoch << " - " << numSamples/elapsed << " samples/sec";
+
+        if( !validating ){
+            cout << endl;
+            continue;
+        }
+
+        ValidationResult result = this->validate();
+        cout << " - validation loss = " << result.loss << ", auc = " << result.auc
+             << ", hr@" << this->validationN << " = " << result.hitRate << endl;
+
+        // keep the model of the best epoch
+        double value = (this->validationMetric == VALIDATION_AUC) ? result.auc : result.hitRate;
+        if( value > bestValue ){
+            bestValue = value;
+            this->bestEpoch = epoch;
+            bestP = this->P.clone();
+            bestQ = this->Q.clone();
+        } else if( this->patience > 0 && epoch - this->bestEpoch >= this->patience ){
+            cout << "*** Early stopping after epoch " << epoch << ", no improvement in "
+                 << this->patience << " epochs ***" << endl;
+            break;
+        }
+    }
+    if( validating && this->bestEpoch != this->numEpochs-1 ){
+        cout << "keeping the model of epoch " << this->bestEpoch << endl;
+        this->P = std::move(bestP);
+        this->Q = std::move(bestQ);
     }
+    cout << "*** Training throughput : " << totalSamples/totalElapsed << " samples/sec ("
+         << this->numProcs << " threads) ***" << endl;
 
 }
 
+// -------------------------------------
+// Epoch of the kept model, the last one without validation
+// -------------------------------------
+unsigned int PBPR::getBestEpoch() const{
+    return this->bestEpoch;
+}
+
 // -------------------------------------
 // Getter for P
 // -------------------------------------
-double** PBPR::getP() const{
+const FactorMatrix& PBPR::getP() const{
     return this->P;
 }
 
 // -------------------------------------
 // Getter for Q
 // -------------------------------------
-double** PBPR::getQ() const{
+const FactorMatrix& PBPR::getQ() const{
     return this->Q;
 }
 
 // -------------------------------------
 // Getter for IPlus
 // -------------------------------------
-unordered_map<unsigned int, unordered_set<unsigned int>> PBPR::getIPlus() const{
+const UserHistory& PBPR::getIPlus() const{
     return this->IPlus;
 }
 
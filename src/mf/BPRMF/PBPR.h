@@ -5,20 +5,69 @@
     Interface of Parallel BPRMF based on PLtR-N
     (Yagci et al., On Parallelizing SGD for pairwise LtR in CF RSs, 2017)
 
+    Lock-free (Hogwild) updates: the training data is shuffled once with
+    the seed and cut into one shard per thread. In every epoch each
+    thread draws as many samples from its shard as the shard holds,
+    with its own random stream seeded by (seed, thread), and all threads
+    meet at the end of the epoch. An epoch thus always covers |data|
+    samples, independent of the number of threads. With one thread a
+    seed gives the same model on every run; with more threads the
+    samples are the same but the order of the racing updates is not.
+
+    Stratified (DSGD-style) updates: users and items are cut into
+    numProcs blocks each, balanced by number of samples. A sub-epoch
+    gives thread t the samples of user block t and item block
+    (t+s) % numProcs, and negatives are drawn from that item block too,
+    so no two threads write the same rows of P or Q. numProcs
+    sub-epochs, separated by barriers, make up an epoch.
+
+    Optional validation (setValidation): one item of each of
+    numValidationUsers sampled users is held out of the training
+    samples (it stays in I_u^+, so it is never drawn as a negative).
+    After every epoch the held-out pairs give the sampled BPR loss and
+    AUC against fixed random negatives, and HR@N against all items
+    outside the history. The model of the best epoch is kept, and
+    training stops after patience epochs without improvement.
+
+    Warm start (warmStart): P and Q begin with the rows of a previous
+    model instead of noise, and the previous histories are merged into
+    I_u^+, so a few epochs over the new interactions refresh the model.
+    The model may have more users and items than the previous one; the
+    new rows keep their random init. setTrainableRows freezes the rows
+    below the given indices (fold-in of the new rows only, or a frozen
+    Q): samples without a trainable row are dropped, and the updates of
+    frozen rows go to a scratch copy of the thread, so the gradients
+    of the other rows stay the same.
+
     Part of MMFNN guiding code. Provided as is.
-    Tested with C++11 (g++ ver. 4.9.4)
+    Tested with C++17 (g++ ver. 12.2)
  */
 
 #include <iostream>
 #include <cmath>
+#include <random>
 #include <omp.h>
-#include "MatrixOps.h"
+#include "../../common/MatrixOps.h"
+#include "../../common/UserHistory.h"
+#include "../../common/Stats.h"
+#include "../../common/ItemMarker.h"
+#include "BPRKernel.h"
 #include "Tuple.h"
-#include <unordered_map>
-#include <unordered_set>
 
 using namespace std;
 
+enum TrainingMode { TRAINING_HOGWILD, TRAINING_STRATIFIED };
+
+// metric of the validation set that decides the best epoch
+enum ValidationMetric { VALIDATION_AUC, VALIDATION_HR };
+
+// sampled BPR loss and AUC, and HR@N over the whole catalog
+struct ValidationResult{
+    double loss;
+    double auc;
+    double hitRate;
+};
+
 class PBPR{
 
     private:
@@ -26,22 +75,50 @@ class PBPR{
         unsigned int numUsers;
         unsigned int numItems;
         unsigned int numLatentFactors;
-        double** P; // user component matrix
-        double** Q; // item component matrix
-        double lambP; // regularization parameter
-        double lambQPlus; // regularization parameter
-        double lambQMinus; // regularization parameter
-        double eta; // learning rate
+        FactorMatrix P; // user component matrix
+        FactorMatrix Q; // item component matrix
+        BPRKernel::Params stepParams; // learning rate and regularization parameters
+        BPRKernel::Step step; // fused step for numLatentFactors
         unsigned int numEpochs; // number of training epochs
-        unordered_map<unsigned int,unordered_set<unsigned int>> IPlus; // user histories
+        unsigned int seed; // for initialization, shards and sampling
+        UserHistory IPlus; // user histories
 
         // global vars for parallelization
         vector<Tuple> data;
         unsigned int indexCounterItem;
         unsigned int numProcs;
+        vector<size_t> shardBegins; // numProcs+1 offsets into data
+        vector<mt19937> generators; // one stream per thread
+
+        // validation, one held-out (user, item) pair per sampled user
+        unsigned int numValidationUsers; // 0 for none
+        unsigned int validationN;
+        unsigned int patience; // epochs without improvement, 0 never stops
+        ValidationMetric validationMetric;
+        unsigned int validationNegatives; // per pair, for loss and AUC
+        vector<Tuple> validationPairs;
+        unsigned int bestEpoch;
+
+        // warm start and fold-in
+        UserHistory previousIPlus; // merged into IPlus by learn
+        unsigned int firstTrainableUser; // rows below are frozen
+        unsigned int firstTrainableItem;
+        vector<FactorMatrix> frozenRows; // per thread, takes the updates of frozen rows
+
+        // strata, data is grouped by (user block, item block) cell
+        vector<size_t> cellBegins; // numProcs*numProcs+1 offsets into data
+        vector<size_t> blockItemBegins; // numProcs+1 offsets into blockItems
+        vector<unsigned int> blockItems; // negative candidates per item block
 
-        void updateParallel();
-        double sigmoid(double const &x);
+        void updateTriple(unsigned int user, unsigned int posItem, unsigned int negItem);
+        size_t updateShard(unsigned int shard);
+        size_t updateCell(unsigned int userBlock, unsigned int itemBlock, mt19937& generator);
+        void countSamples(size_t numSamples, size_t numDraws, size_t numFailures);
+        void buildStrata();
+        size_t epochHogwild();
+        size_t epochStratified();
+        void holdOutValidation();
+        ValidationResult validate();
 
     public:
 
@@ -54,12 +131,20 @@ class PBPR{
               double lambQPlus,
               double lambQMinus,
               double eta,
-              int numEpochs );
+              int numEpochs,
+              unsigned int seed = 1234 );
         
-        void learn(vector<Tuple>& data, unsigned int indexCounterItem, unsigned int numProcs);
-        double** getP() const;
-        double** getQ() const;
-        unordered_map<unsigned int, unordered_set<unsigned int>> getIPlus() const;
+        void setValidation(unsigned int numValidationUsers, unsigned int N = 10, unsigned int patience = 5,
+                           ValidationMetric metric = VALIDATION_AUC, unsigned int numNegatives = 100);
+        bool warmStart(const FactorMatrix& previousP, const FactorMatrix& previousQ,
+                       const UserHistory& previousHistory);
+        void setTrainableRows(unsigned int firstUser, unsigned int firstItem);
+        void learn(vector<Tuple>& data, unsigned int indexCounterItem, unsigned int numProcs,
+                   TrainingMode mode = TRAINING_HOGWILD);
+        unsigned int getBestEpoch() const;
+        const FactorMatrix& getP() const;
+        const FactorMatrix& getQ() const;
+        const UserHistory& getIPlus() const;
 
 };
 
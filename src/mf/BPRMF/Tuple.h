@@ -5,7 +5,7 @@
     Tuple class
 
     Part of MMFNN guiding code. Provided as is.
-    Tested with C++11 (g++ ver. 4.9.4)
+    Tested with C++17 (g++ ver. 12.2)
  */
 
 class Tuple {
@@ -16,6 +16,8 @@ class Tuple {
         unsigned int relevance;
 
     public:
+        Tuple() : userId(0), itemId(0), relevance(1) {}
+
         Tuple(unsigned int userId, unsigned int itemId, unsigned int relevance){
             this->userId = userId;
             this->itemId = itemId;
@@ -1,25 +1,49 @@
 /*
     Example driver code
-    - Performs training
-    - Writes P, Q, and I_u^+ to files
+    - Performs training, optionally warm-started from a previous model
+    - Writes P, Q, and I_u^+ to files (CSV and a binary model bundle)
 
-    To compile : g++-4.9 -O3 -std=c++11 *.cpp -fopenmp -o main.x
+    To compile : g++ -O3 -std=c++17 *.cpp -fopenmp -o main.x
 
     Part of MMFNN guiding code. Provided as is.
-    Tested with C++11 (g++ ver. 4.9.4)
+    Tested with C++17 (g++ ver. 12.2)
  */
 
 #include <iostream>
-#include "MatrixOps.h"
+#include "../../common/MatrixOps.h"
 #include "Tuple.h"
 #include "PBPR.h"
-#include <unordered_map>
-#include <unordered_set>
+#include "../../common/ModelBundle.h"
+#include "../../common/TextReader.h"
 #include <fstream>
-#include <sstream>
+#include <algorithm>
+#include <atomic>
 
 using namespace std;
 
+// factors written by a previous run, one comma separated row per line;
+// empty if a row does not have numLatentFactors numbers
+FactorMatrix readFactors(const string& factorFile, unsigned int numLatentFactors, unsigned int numCores){
+    TextReader reader;
+    if( !reader.open(factorFile, false, numCores) ){
+        return FactorMatrix();
+    }
+    FactorMatrix factors(reader.getNumLines(), numLatentFactors);
+    atomic<size_t> numBadRows(0);
+    reader.parseLines([&](size_t n, const char* begin, const char* end){
+        unsigned int numRead = TextReader::parseRow(begin, end, ',', factors[n], numLatentFactors);
+        if( numRead != numLatentFactors || (unsigned int)count(begin, end, ',') != numLatentFactors-1 ){
+            numBadRows++;
+        }
+    }, numCores);
+    if( numBadRows > 0 ){
+        cout << "ERROR: " << numBadRows << " rows of " << factorFile << " do not have "
+             << numLatentFactors << " latent factors" << endl;
+        return FactorMatrix();
+    }
+    return factors;
+}
+
 int main(){
 
      // ------------------------------------
@@ -39,6 +63,7 @@ int main(){
     string factorPFile = "output/ml1m/factorP.csv";
     string factorQFile = "output/ml1m/factorQ.csv";
     string userHistoryFile = "output/ml1m/userHistory.csv";
+    string modelBundleFile = "output/ml1m/model.bin"; // read by EP/NN via mmap, empty to skip
 
     // BPR parameters
     unsigned int numLatentFactors = 40;
@@ -50,53 +75,110 @@ int main(){
     double eta = 0.01;
     unsigned int numEpochs = 64;
     unsigned int numCores = 4; // Choose 1 <= numCores <= Number of available cores
+    unsigned int seed = 1234; // same seed and numCores = 1 give the same model
+    TrainingMode trainingMode = TRAINING_HOGWILD; // or TRAINING_STRATIFIED (disjoint P/Q blocks per thread)
+
+    // validation after every epoch on one held-out item of numValidationUsers users, 0 for none;
+    // training stops after patience epochs without a better metric (0 runs all epochs),
+    // and the model of the best epoch is written
+    unsigned int numValidationUsers = 0;
+    unsigned int validationN = 10; // for HR@N
+    unsigned int patience = 5;
+    ValidationMetric validationMetric = VALIDATION_AUC; // or VALIDATION_HR, noisier on a small sample
+
+    // warm start from a previous model with the same numLatentFactors, from its model bundle or
+    // else its factor and user history files, empty for a cold start. trainFile then holds the new
+    // interactions and a few epochs are enough; numUsers and numItems may exceed those of the
+    // previous model, the new users and items start from the random init. The previous histories
+    // keep old interactions from being drawn as negatives.
+    string previousModelBundleFile = "";
+    string previousFactorPFile = "";
+    string previousFactorQFile = "";
+    string previousUserHistoryFile = "";
+    bool trainNewRowsOnly = false; // fold-in, the rows of the previous model are frozen
+    bool freezeQ = false; // all of Q is frozen, only users are trained
+
+    // counters and latency histograms, when compiled with -DMMFNN_STATS
+    string statsFile = "output/ml1m/stats.json";
+    Stats::install(statsFile);
 
     // ------------------------------------
     // Read data
     // ------------------------------------
     cout << "reading training set ..." << endl;
 
+    // lines are parsed in parallel straight into trainData
     vector<Tuple> trainData; // list of (u,i,r)s
-    ifstream dataStream;
-    string line, field;
-    int n = -1, ff;
-    unsigned int user, item, relevance = 1;
-    dataStream.open(trainFile);
-    while (getline(dataStream,line)){
-        n++;
-        if (skipHeaderLine && n==0)    continue;
-        istringstream lineStream(line);
-        ff = 0;
-        while (getline(lineStream, field, fileDelimiter)){
-            switch(ff){
-                case userItemRelevanceIndexes[0]:
-                    user = stoi(field);
-                    break;
-                case userItemRelevanceIndexes[1]:
-                    item = stoi(field);
-                    break;
-                case userItemRelevanceIndexes[2]:
-                    relevance = stoi(field);
-                    break;
-            }
-            ff++;
-        }
-        trainData.push_back({user,item,relevance});
+    TextReader reader;
+    if( reader.open(trainFile, skipHeaderLine, numCores) ){
+        trainData.resize(reader.getNumLines());
+        reader.parseLines([&](size_t n, const char* begin, const char* end){
+            unsigned int uir[3] = {numUsers, numItems, 1}; // relevance is 1 if the column is missing
+            TextReader::parseColumns(begin, end, fileDelimiter, userItemRelevanceIndexes, 3, uir);
+            trainData[n] = Tuple(uir[0], uir[1], uir[2]);
+        }, numCores);
+    }
+    reader.close();
+
+    // lines without a valid user and item are dropped
+    size_t numLines = trainData.size();
+    trainData.erase(remove_if(trainData.begin(), trainData.end(), [&](Tuple& t){
+        return t.getUserId() >= numUsers || t.getItemId() >= numItems;
+    }), trainData.end());
+    if( trainData.size() < numLines ){
+        cout << "WARNING: " << numLines - trainData.size() << " malformed or out of range lines in "
+             << trainFile << " skipped" << endl;
     }
-    dataStream.close();
 
     // ------------------------------------
     // Train
     // ------------------------------------
     cout << "initializing and learning model ..." << endl;
     
-    PBPR pbpr(numUsers, numItems, numLatentFactors, mu, sigma, lambP, lambQPlus, lambQMinus, eta, numEpochs);
+    PBPR pbpr(numUsers, numItems, numLatentFactors, mu, sigma, lambP, lambQPlus, lambQMinus, eta, numEpochs, seed);
+    pbpr.setValidation(numValidationUsers, validationN, patience, validationMetric);
+
+    if( !previousModelBundleFile.empty() || !previousFactorPFile.empty() ){
+        cout << "warm start from the previous model ..." << endl;
+        ModelBundle previousBundle;
+        FactorMatrix previousP, previousQ;
+        UserHistory previousHistory;
+        if( !previousModelBundleFile.empty() ){
+            if( !previousBundle.open(previousModelBundleFile) ){
+                return 1;
+            }
+            previousP = previousBundle.getP();
+            previousQ = previousBundle.getQ();
+            previousHistory = previousBundle.getUserHistory();
+        } else {
+            previousP = readFactors(previousFactorPFile, numLatentFactors, numCores);
+            previousQ = readFactors(previousFactorQFile, numLatentFactors, numCores);
+            if( previousP.getNumRows() == 0 || previousQ.getNumRows() == 0 ){
+                return 1;
+            }
+            if( previousUserHistoryFile.empty() ){
+                cout << "ERROR: A warm start from factor files needs previousUserHistoryFile" << endl;
+                return 1;
+            }
+            previousHistory = UserHistory::read(previousUserHistoryFile, previousP.getNumRows(), previousQ.getNumRows(), numCores);
+            if( previousHistory.getNumUsers() == 0 ){
+                return 1;
+            }
+        }
+        if( !pbpr.warmStart(previousP, previousQ, previousHistory) ){
+            return 1;
+        }
+        cout << previousP.getNumRows() << " users and " << previousQ.getNumRows() << " items from the previous model, "
+             << numUsers - previousP.getNumRows() << " and " << numItems - previousQ.getNumRows() << " new" << endl;
+        pbpr.setTrainableRows(trainNewRowsOnly ? previousP.getNumRows() : 0,
+                              freezeQ ? numItems : (trainNewRowsOnly ? previousQ.getNumRows() : 0));
+    }
 
     struct timespec start, finish;
     double elapsed;
     clock_gettime(CLOCK_MONOTONIC, &start);
 
-    pbpr.learn(trainData, numItems-1, numCores);
+    pbpr.learn(trainData, numItems-1, numCores, trainingMode);
 
     // end elapsed time
     clock_gettime(CLOCK_MONOTONIC, &finish);
@@ -114,7 +196,7 @@ int main(){
 
     // P
     cout << "Writing P to file ..." << endl;
-    double** P = pbpr.getP();
+    const FactorMatrix& P = pbpr.getP();
     outFile.open(factorPFile);
     for(int i=0;i<numUsers;i++){;
         for(int j=0;j<numLatentFactors-1;j++){
@@ -126,7 +208,7 @@ int main(){
 
     // Q
     cout << "Writing Q to file ..." << endl;
-    double** Q = pbpr.getQ();
+    const FactorMatrix& Q = pbpr.getQ();
     outFile.open(factorQFile);
     for(int i=0;i<numItems;i++){;
         for(int j=0;j<numLatentFactors-1;j++){
@@ -138,22 +220,26 @@ int main(){
 
     // I_u^+
     cout << "Writing user histories to file ..." << endl;
-    unordered_map<unsigned int, unordered_set<unsigned int>> IPlus = pbpr.getIPlus();
-    unordered_set<unsigned int> items;
+    const UserHistory& IPlus = pbpr.getIPlus();
     outFile.open(userHistoryFile);
-    for (auto& kv : IPlus) {
-        outFile << kv.first << '\t';
-        items = kv.second;
-        unsigned int ll = 0, lenItems = items.size();
-
-        for (unsigned int item : items){
-            ll++;
-            outFile << item;
-            if(ll <= lenItems-1) outFile << ',';
+    for(unsigned int u=0; u<IPlus.getNumUsers(); u++){
+        if( !IPlus.hasHistory(u) ){
+            continue;
+        }
+        outFile << u << '\t';
+        for(const unsigned int* it=IPlus.begin(u); it!=IPlus.end(u); ++it){
+            if( it != IPlus.begin(u) ) outFile << ',';
+            outFile << *it;
         }
         outFile << '\n';
     }
     outFile.close();
 
+    // binary bundle of P, Q and I_u^+
+    if( !modelBundleFile.empty() ){
+        cout << "Writing model bundle ..." << endl;
+        ModelBundle::write(modelBundleFile, P, Q, IPlus, nullptr, 0);
+    }
+
     return 0;
 }
@@ -0,0 +1,241 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+/*
+    Timing and reporting for the top-N benchmark (main_bench.cpp)
+
+    A pass runs every request once over a fixed number of threads.
+    Each thread keeps one context across passes, so warmup passes also
+    warm the scratch buffers. Every request is timed on its own, and
+    the rank of the test item is read after the clock stops, so the
+    accuracy check does not count as latency.
+
+    Results are rows of a BenchReport, written as CSV or JSON.
+
+    Part of MMFNN guiding code. Provided as is.
+    Tested with C++17 (g++ ver. 12.2)
+ */
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <algorithm>
+#include <time.h>
+#include <omp.h>
+
+using namespace std;
+
+// ---------------------------------
+// one benchmarked configuration
+// ---------------------------------
+struct BenchRun{
+    string dataset;
+    string method;
+    string knn; // knn method and parameter, empty for EP
+    unsigned int numUsers = 0;
+    unsigned int numItems = 0;
+    unsigned int numLatentFactors = 0;
+    unsigned int N = 0;
+    unsigned int K = 0;
+    unsigned int numThreads = 0;
+    long long numRequests = 0; // per repeat
+    unsigned int numRepeats = 0;
+    double p50 = 0.0, p95 = 0.0, p99 = 0.0, mean = 0.0, max = 0.0; // microseconds per request
+    double throughput = 0.0; // requests per second, median of repeats
+    double hitRate = 0.0;
+    double mrr = 0.0;
+    double candidatesPerRec = 0.0;
+    double knnSeconds = 0.0; // time to find the knns, 0 if loaded
+};
+
+// ---------------------------------
+// result of a pass over all requests
+// ---------------------------------
+struct BenchPass{
+    double seconds = 0.0;
+    size_t hits = 0;
+    double mrr = 0.0;
+};
+
+class Benchmark{
+
+    public:
+
+        static double seconds(const struct timespec& start, const struct timespec& finish){
+            return (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+        }
+
+        // ---------------------------------
+        // one pass over numRequests requests with contexts.size()
+        // threads; predict(r, context) is timed into latencies[r]
+        // (microseconds), rank(r, context) is then the 1-based rank of
+        // the test item of request r, 0 for a miss
+        // ---------------------------------
+        template <typename Context, typename Predict, typename Rank>
+        static BenchPass pass(long long numRequests, vector<Context>& contexts, double* latencies,
+                              Predict predict, Rank rank){
+            BenchPass result;
+            size_t hits = 0;
+            double mrr = 0.0;
+
+            struct timespec start, finish;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            #pragma omp parallel num_threads(contexts.size()) reduction(+:hits,mrr)
+            {
+                Context& context = contexts[omp_get_thread_num()];
+
+                #pragma omp for schedule(dynamic, 16)
+                for(long long r=0; r<numRequests; r++){
+                    struct timespec requestStart, requestFinish;
+                    clock_gettime(CLOCK_MONOTONIC, &requestStart);
+                    predict(r, context);
+                    clock_gettime(CLOCK_MONOTONIC, &requestFinish);
+                    latencies[r] = 1e6 * seconds(requestStart, requestFinish);
+
+                    unsigned int position = rank(r, context);
+                    if( position > 0 ){
+                        hits++;
+                        mrr += 1.0/position;
+                    }
+                }
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &finish);
+            result.seconds = seconds(start, finish);
+            result.hits = hits;
+            result.mrr = mrr;
+            return result;
+        }
+
+        // ---------------------------------
+        // q-quantile (0 <= q <= 1) of sorted values, nearest rank
+        // ---------------------------------
+        static double percentile(const vector<double>& sorted, double q){
+            if( sorted.empty() ){
+                return 0.0;
+            }
+            size_t rank = (size_t)(q * (sorted.size() - 1) + 0.5);
+            return sorted[min(rank, sorted.size() - 1)];
+        }
+
+        // ---------------------------------
+        // fills the latency fields of run from all timed requests
+        // ---------------------------------
+        static void summarize(vector<double>& latencies, BenchRun& run){
+            sort(latencies.begin(), latencies.end());
+            run.p50 = percentile(latencies, 0.50);
+            run.p95 = percentile(latencies, 0.95);
+            run.p99 = percentile(latencies, 0.99);
+            run.max = latencies.empty() ? 0.0 : latencies.back();
+            double sum = 0.0;
+            for(double latency : latencies){
+                sum += latency;
+            }
+            run.mean = latencies.empty() ? 0.0 : sum / latencies.size();
+        }
+
+};
+
+// ---------------------------------
+// benchmark runs with the build they were measured on
+// ---------------------------------
+class BenchReport{
+
+    private:
+
+        vector<BenchRun> runs;
+        string simd;
+        string precision;
+
+        // ---------------------------------
+        // value as a JSON string literal, with quotes
+        // ---------------------------------
+        static string quoted(const string& value){
+            string result = "\"";
+            for(char c : value){
+                if( c == '"' || c == '\\' ){
+                    result += '\\';
+                    result += c;
+                } else if( (unsigned char)c < 0x20 ){
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned int)c);
+                    result += escaped;
+                } else {
+                    result += c;
+                }
+            }
+            return result + "\"";
+        }
+
+    public:
+
+        BenchReport(const string& simd, const string& precision) : simd(simd), precision(precision) {}
+
+        void add(const BenchRun& run){
+            this->runs.push_back(run);
+        }
+
+        const vector<BenchRun>& getRuns() const {
+            return this->runs;
+        }
+
+        // ---------------------------------
+        // one line per run, with a header line
+        // ---------------------------------
+        bool writeCSV(const string& path) const {
+            ofstream out(path);
+            if( !out ){
+                cout << "ERROR: Cannot write " << path << endl;
+                return false;
+            }
+            out << "dataset,method,knn,users,items,dims,N,K,threads,requests,repeats,"
+                << "p50_us,p95_us,p99_us,mean_us,max_us,throughput_rps,hit_rate,mrr,candidates_per_rec,"
+                << "knn_sec,simd,precision\n";
+            for(const BenchRun& run : this->runs){
+                out << run.dataset << ',' << run.method << ',' << run.knn << ','
+                    << run.numUsers << ',' << run.numItems << ',' << run.numLatentFactors << ','
+                    << run.N << ',' << run.K << ',' << run.numThreads << ','
+                    << run.numRequests << ',' << run.numRepeats << ','
+                    << run.p50 << ',' << run.p95 << ',' << run.p99 << ',' << run.mean << ',' << run.max << ','
+                    << run.throughput << ',' << run.hitRate << ',' << run.mrr << ',' << run.candidatesPerRec << ','
+                    << run.knnSeconds << ',' << this->simd << ',' << this->precision << '\n';
+            }
+            return (bool)out;
+        }
+
+        // ---------------------------------
+        // {"simd": ..., "precision": ..., "runs": [{...}, ...]}
+        // ---------------------------------
+        bool writeJSON(const string& path) const {
+            ofstream out(path);
+            if( !out ){
+                cout << "ERROR: Cannot write " << path << endl;
+                return false;
+            }
+            out << "{\n  \"simd\": " << quoted(this->simd) << ",\n  \"precision\": " << quoted(this->precision)
+                << ",\n  \"runs\": [";
+            for(size_t r=0; r<this->runs.size(); r++){
+                const BenchRun& run = this->runs[r];
+                out << (r > 0 ? "," : "") << "\n    {"
+                    << "\"dataset\": " << quoted(run.dataset) << ", \"method\": " << quoted(run.method)
+                    << ", \"knn\": " << quoted(run.knn) << ", "
+                    << "\"users\": " << run.numUsers << ", \"items\": " << run.numItems
+                    << ", \"dims\": " << run.numLatentFactors << ", \"N\": " << run.N << ", \"K\": " << run.K
+                    << ", \"threads\": " << run.numThreads << ", \"requests\": " << run.numRequests
+                    << ", \"repeats\": " << run.numRepeats << ", "
+                    << "\"p50_us\": " << run.p50 << ", \"p95_us\": " << run.p95 << ", \"p99_us\": " << run.p99
+                    << ", \"mean_us\": " << run.mean << ", \"max_us\": " << run.max
+                    << ", \"throughput_rps\": " << run.throughput << ", \"hit_rate\": " << run.hitRate
+                    << ", \"mrr\": " << run.mrr << ", \"candidates_per_rec\": " << run.candidatesPerRec
+                    << ", \"knn_sec\": " << run.knnSeconds << "}";
+            }
+            out << "\n  ]\n}\n";
+            return (bool)out;
+        }
+
+};
+
+#endif
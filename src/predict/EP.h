@@ -4,20 +4,60 @@
 /*
     EP with and without min. heap
 
+    recommend() returns (item, score) pairs in a caller-owned buffer
+    and selects with a TopKBuffer; the list-returning calls keep their
+    list in the context. Nothing is allocated per call once a context
+    has grown to size.
+
+    An EP object is read-only after construction and can be shared by
+    threads. All per-call state lives in an EPContext, one per thread.
+
     Part of MMFNN guiding code. Provided as is.
-    Tested with C++11 (g++ ver. 4.9.4)
+    Tested with C++17 (g++ ver. 12.2)
  */
 
 #include <iostream>
 #include <vector>
-#include <unordered_map>
-#include <unordered_set>
 #include <algorithm>
 #include <queue>
 #include "helper.h"
+#include "../common/MatrixOps.h"
+#include "../common/UserHistory.h"
+#include "../common/ItemMarker.h"
+#include "QuantizedQ.h"
+#include "NormIndex.h"
+#include "TopKBuffer.h"
+#include "../common/Stats.h"
 
 using namespace std;
 
+// ---------------------------------
+// per-thread scratch for EP predictions
+// ---------------------------------
+struct EPContext{
+    vector<ScorePair> vecScorePairs; // holds (item,score) pairs
+    vector<unsigned int> topNList; // holds top-N list for a user
+    priority_queue<ScorePair> pq; // for min. heap
+    ItemMarker excluded; // history of the current user
+
+    // top-k selection
+    TopKBuffer topK;
+    vector<ScorePair> topScores;
+
+    // batch prediction
+    vector<const factor_t*> userRows;
+    vector<TopKBuffer> topKs;
+    vector<double> tile;
+
+    // quantized prediction
+    QuantizedScratch quantizedScratch;
+    vector<float> approximateScores;
+    vector<ScorePair> candidates;
+
+    // pruned prediction
+    size_t numScored = 0; // full dot products computed
+};
+
 class EP{
 
     private:
@@ -26,15 +66,30 @@ class EP{
         unsigned int numItems;
         unsigned int numLatentFactors;
 
-        double **factorQ;
-        double **factorP;
-        unordered_map<unsigned int, unordered_set<unsigned int>> mapUserHistory;
+        const FactorMatrix &factorQ;
+        const FactorMatrix &factorP;
+        const UserHistory &userHistory;
 
-        unordered_set<unsigned int> currentHistoryItems;
-        vector<ScorePair> vecScorePairs; // holds (item,score) pairs
-        unsigned int *topNList; // holds top-N list for a user
+        // tile sizes for batch prediction: a block of item rows (~80KB
+        // for 40 factors) stays in L2 while all users of a block use it
+        static const unsigned int BATCH_USER_BLOCK = 32;
+        static const unsigned int BATCH_ITEM_BLOCK = 256;
+
+        // ---------------------------------
+        // mark the history of a user in context.excluded
+        // ---------------------------------
+        void markHistory(unsigned int user, EPContext& context) const {
+            context.excluded.clear(this->numItems);
+            if( this->userHistory.hasHistory(user) ){
+                context.excluded.mark(this->userHistory.begin(user), this->userHistory.end(user));
+            }
+            Stats::add(STAT_EP_CALLS);
+            Stats::add(STAT_EP_HISTORY_EXCLUDED, historySizeOf(user));
+        }
 
-        priority_queue<ScorePair> pq; // for min. heap
+        unsigned int historySizeOf(unsigned int user) const {
+            return this->userHistory.hasHistory(user) ? this->userHistory.end(user) - this->userHistory.begin(user) : 0;
+        }
 
     public:
 
@@ -44,29 +99,30 @@ class EP{
         EP( unsigned int numUsers,
             unsigned int numItems,
             unsigned int numLatentFactors,
-            double **factorQ,
-            double **factorP,
-            unordered_map<unsigned int, unordered_set<unsigned int>> mapUserHistory) {
-            
+            const FactorMatrix &factorQ,
+            const FactorMatrix &factorP,
+            const UserHistory &userHistory)
+            : factorQ(factorQ), factorP(factorP), userHistory(userHistory) {
+
             this->numUsers = numUsers;
             this->numItems = numItems;
             this->numLatentFactors = numLatentFactors;
-            this->factorQ = factorQ;
-            this->factorP = factorP;
-            this->mapUserHistory = mapUserHistory;
-            this->vecScorePairs.resize(numItems);
         }
 
         // ---------------------------------
         // top-N prediction without min. heap
+        // returned list is owned by context
         // ---------------------------------
-        unsigned int* predictTopN(unsigned int user, unsigned int N){
+        const unsigned int* predictTopN(unsigned int user, unsigned int N, EPContext& context) const {
+
+            StatsTimer timer(STAT_EP_CALL_NS);
+            Stats::add(STAT_EP_SCORED, this->numItems);
+
+            vector<ScorePair>& vecScorePairs = context.vecScorePairs;
+            vecScorePairs.resize(this->numItems);
 
             for(unsigned int i=0; i<this->numItems; i++){
-                double score = 0.0;
-                for(unsigned int f=0; f<this->numLatentFactors; f++){
-                    score += this->factorP[user][f] * this->factorQ[i][f];
-                }
+                double score = MatrixOps::dot(this->factorP[user], this->factorQ[i], this->numLatentFactors);
                 vecScorePairs[i].index = i;
                 vecScorePairs[i].value = score;
             }
@@ -74,15 +130,14 @@ class EP{
             sort(vecScorePairs.begin(), vecScorePairs.end());
 
             // get top-N
-            currentHistoryItems = mapUserHistory[user];
+            markHistory(user, context);
             unsigned int n=0;
-            topNList = new unsigned int[N]();
+            context.topNList.assign(N, 0);
             for(unsigned int i=0; i<this->numItems; i++){
                 if( n<N ){
                     // exclude items already in user history
-                    if ( currentHistoryItems.find(vecScorePairs[i].index) ==
-                            currentHistoryItems.end() ){
-                        topNList[n] = vecScorePairs[i].index;
+                    if ( !context.excluded.isMarked(vecScorePairs[i].index) ){
+                        context.topNList[n] = vecScorePairs[i].index;
                         n++;
                     }
                 } else {
@@ -90,48 +145,236 @@ class EP{
                 }
             }
 
-            return topNList;
+            return context.topNList.data();
         }
 
         // ---------------------------------
         // top-N prediction using min. heap
+        // returned list is owned by context
         // ---------------------------------
-        unsigned int* predictTopNWithMinHeap(unsigned int user, unsigned int N){
+        const unsigned int* predictTopNWithMinHeap(unsigned int user, unsigned int N, EPContext& context) const {
 
-            currentHistoryItems = mapUserHistory[user];
+            StatsTimer timer(STAT_EP_CALL_NS);
+            markHistory(user, context);
+            Stats::add(STAT_EP_SCORED, this->numItems - historySizeOf(user));
+            priority_queue<ScorePair>& pq = context.pq;
+            size_t numInserts = 0;
 
             for(unsigned int i=0; i<this->numItems; i++){
                 // exclude items already in user history
-                if ( currentHistoryItems.find(i) == currentHistoryItems.end() ){
-                    double score = 0.0;
-                    for(unsigned int f=0; f<this->numLatentFactors; f++){
-                        score += this->factorP[user][f] * this->factorQ[i][f];
-                    }
+                if ( !context.excluded.isMarked(i) ){
+                    double score = MatrixOps::dot(this->factorP[user], this->factorQ[i], this->numLatentFactors);
 
                     if (pq.size() == N){
                         if (pq.top().value < score) {
                             pq.pop();
                             pq.push({i,score});
+                            numInserts++;
                         }
                     } else {
                         pq.push({i,score});
+                        numInserts++;
                     }
 
                 }
             }
+            Stats::add(STAT_TOPK_INSERTS, numInserts);
 
             // get top-N
             unsigned int n=N-1;
-            topNList = new unsigned int[N]();
+            context.topNList.assign(N, 0);
             while( !pq.empty() ) {
-                topNList[n] = pq.top().index;
+                context.topNList[n] = pq.top().index;
                 pq.pop();
                 n--;
             }
 
-            return topNList;
+            return context.topNList.data();
+        }
+
+        // ---------------------------------
+        // top-N (item, score) pairs of a user, best first, written to
+        // topN (room for N pairs); returns their number, less than N if
+        // fewer items are outside the history
+        // Of equal scores, the smaller item ranks first.
+        // ---------------------------------
+        unsigned int recommend(unsigned int user, unsigned int N, ScorePair* topN, EPContext& context) const {
+
+            StatsTimer timer(STAT_EP_CALL_NS);
+            markHistory(user, context);
+            Stats::add(STAT_EP_SCORED, this->numItems - historySizeOf(user));
+            TopKBuffer& topK = context.topK;
+            topK.reset(N);
+
+            const factor_t* p = this->factorP[user];
+            for(unsigned int i=0; i<this->numItems; i++){
+                // exclude items already in user history
+                if ( !context.excluded.isMarked(i) ){
+                    topK.push(i, MatrixOps::dot(p, this->factorQ[i], this->numLatentFactors));
+                }
+            }
+
+            return topK.extract(topN);
+        }
+
+        // ---------------------------------
+        // recommend() with a quantized first pass
+        // All items are scored with quantizedQ, the best numCandidates
+        // outside the history are rescored exactly. The result equals
+        // recommend() whenever its top-N are among them.
+        // ---------------------------------
+        unsigned int recommendQuantized(unsigned int user, unsigned int N, const QuantizedQ& quantizedQ,
+                                        unsigned int numCandidates, ScorePair* topN, EPContext& context) const {
+
+            StatsTimer timer(STAT_EP_CALL_NS);
+            markHistory(user, context);
+            context.approximateScores.resize(this->numItems);
+            quantizedQ.score(this->factorP[user], context.quantizedScratch, context.approximateScores.data());
+
+            // first pass, the best C items outside the history
+            unsigned int C = max(numCandidates, N);
+            TopKBuffer& topK = context.topK;
+            topK.reset(C);
+            const float* approximateScores = context.approximateScores.data();
+            for(unsigned int i=0; i<this->numItems; i++){
+                // cheap threshold test first, history lookup only for survivors
+                if ( topK.accepts(i, approximateScores[i]) && !context.excluded.isMarked(i) ){
+                    topK.push(i, approximateScores[i]);
+                }
+            }
+            vector<ScorePair>& candidates = context.candidates;
+            candidates.resize(C);
+            unsigned int numFound = topK.extract(candidates.data());
+
+            // rerank
+            Stats::add(STAT_EP_SCORED, numFound);
+            topK.reset(N);
+            for(unsigned int c=0; c<numFound; c++){
+                unsigned int i = candidates[c].index;
+                topK.push(i, MatrixOps::dot(this->factorP[user], this->factorQ[i], this->numLatentFactors));
+            }
+
+            return topK.extract(topN);
         }
 
+        // ---------------------------------
+        // recommend() on the rows of normIndex, which stops at the
+        // Cauchy-Schwarz bound (see NormIndex), same result
+        // ---------------------------------
+        unsigned int recommendPruned(unsigned int user, unsigned int N, const NormIndex& normIndex,
+                                     ScorePair* topN, EPContext& context) const {
+
+            StatsTimer timer(STAT_EP_CALL_NS);
+            markHistory(user, context);
+            size_t numScored = context.numScored;
+            TopKBuffer& topK = context.topK;
+            topK.reset(N);
+
+            const factor_t* p = this->factorP[user];
+            const FactorMatrix& sortedQ = normIndex.getSortedQ();
+            unsigned int head = normIndex.getHeadSize();
+            unsigned int tail = this->numLatentFactors - head;
+            double userNorm = sqrt(MatrixOps::dot(p, p, this->numLatentFactors));
+            double userTailNorm = sqrt(MatrixOps::dot(p + head, p + head, tail));
+            double slack = normIndex.slack();
+
+            for(unsigned int r=0; r<normIndex.getNumItems(); r++){
+
+                double threshold = 0.0;
+                double error = 0.0;
+                bool bounded = topK.isBounded();
+                if (bounded){
+                    // no later row can score above its norm bound
+                    threshold = topK.threshold();
+                    double bound = userNorm*normIndex.normOf(r);
+                    error = slack*bound;
+                    if (bound + error < threshold){
+                        break;
+                    }
+                }
+
+                // exclude items already in user history
+                unsigned int i = normIndex.itemOf(r);
+                if ( context.excluded.isMarked(i) ){
+                    continue;
+                }
+
+                // head columns, bound for the tail
+                if (bounded && head > 0 && tail > 0){
+                    double partial = MatrixOps::dot(p, sortedQ[r], head);
+                    if (partial + userTailNorm*normIndex.tailNormOf(r) + error < threshold){
+                        continue;
+                    }
+                }
+
+                context.numScored++;
+                topK.push(i, MatrixOps::dot(p, sortedQ[r], this->numLatentFactors));
+            }
+            Stats::add(STAT_EP_SCORED, context.numScored - numScored);
+
+            return topK.extract(topN);
+        }
+
+        // ---------------------------------
+        // top-N prediction for a batch of users
+        // Scores user-block x item-block tiles with a blocked kernel and
+        // keeps one top-k buffer per user, so factorQ is streamed once
+        // per user block instead of once per user.
+        // topNLists receives N items per user, in the order of users.
+        // ---------------------------------
+        void predictTopNBatch(const unsigned int* users, unsigned int numBatchUsers,
+                              unsigned int N, unsigned int* topNLists, EPContext& context) const {
+
+            vector<const factor_t*>& userRows = context.userRows;
+            vector<TopKBuffer>& topKs = context.topKs;
+            vector<double>& tile = context.tile;
+            userRows.resize(BATCH_USER_BLOCK);
+            topKs.resize(BATCH_USER_BLOCK);
+            tile.resize((size_t)BATCH_USER_BLOCK*BATCH_ITEM_BLOCK);
+            context.topScores.resize(N);
+            Stats::add(STAT_EP_CALLS, numBatchUsers);
+            Stats::add(STAT_EP_SCORED, (size_t)numBatchUsers*this->numItems);
+
+            for(unsigned int u0=0; u0<numBatchUsers; u0+=BATCH_USER_BLOCK){
+                unsigned int numBlockUsers = min(BATCH_USER_BLOCK, numBatchUsers-u0);
+
+                for(unsigned int b=0; b<numBlockUsers; b++){
+                    unsigned int user = users[u0+b];
+                    userRows[b] = this->factorP[user];
+                    topKs[b].reset(N);
+                }
+
+                for(unsigned int i0=0; i0<this->numItems; i0+=BATCH_ITEM_BLOCK){
+                    unsigned int numBlockItems = min(BATCH_ITEM_BLOCK, this->numItems-i0);
+
+                    MatrixOps::scoreTile(userRows.data(), numBlockUsers,
+                                         this->factorQ, i0, numBlockItems,
+                                         tile.data(), BATCH_ITEM_BLOCK);
+
+                    for(unsigned int b=0; b<numBlockUsers; b++){
+                        TopKBuffer& topK = topKs[b];
+                        const double* scores = &tile[(size_t)b*BATCH_ITEM_BLOCK];
+                        for(unsigned int j=0; j<numBlockItems; j++){
+                            unsigned int i = i0+j;
+                            // cheap threshold test first, history lookup only for survivors
+                            if ( topK.accepts(i, scores[j]) && !this->userHistory.contains(users[u0+b], i) ){
+                                topK.push(i, scores[j]);
+                            }
+                        }
+                    }
+                }
+
+                // get top-N
+                for(unsigned int b=0; b<numBlockUsers; b++){
+                    unsigned int* topNList = topNLists + (size_t)(u0+b)*N;
+                    fill(topNList, topNList+N, 0u);
+                    unsigned int count = topKs[b].extract(context.topScores.data());
+                    for(unsigned int n=0; n<count; n++){
+                        topNList[n] = context.topScores[n].index;
+                    }
+                }
+            }
+        }
 };
 
 #endif
@@ -0,0 +1,551 @@
+#ifndef HNSW_H
+#define HNSW_H
+
+/*
+    Hierarchical navigable small world graph over item factors (L2)
+
+    Approximate nearest neighbor index after Malkov & Yashunin. Every
+    item gets a random level; on each level up to its own it is linked
+    to M (2M on level 0) neighbors chosen by the diversity heuristic.
+    Searches descend greedily from the top level and run a beam search
+    of width ef on level 0.
+
+    Items are inserted in parallel. Each item has its own lock that
+    guards its neighbor lists, and the entry point has a global lock.
+    Levels are drawn from a seeded generator, so the graph is identical
+    between runs when built with one thread.
+
+    The index refers to the factor matrix, only the graph is saved,
+    with a checksum of the factors: a graph is loaded only for the
+    factors it was built on, not for a retrained model of the same
+    size. load() also checks levels and links, so a corrupt file is
+    rejected.
+
+    Part of MMFNN guiding code. Provided as is.
+    Tested with C++17 (g++ ver. 12.2)
+ */
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <queue>
+#include <mutex>
+#include <random>
+#include <algorithm>
+#include <omp.h>
+#include "../common/MatrixOps.h"
+#include "../common/ItemMarker.h"
+
+using namespace std;
+
+// ---------------------------------
+// per-thread scratch for HNSW searches
+// ---------------------------------
+struct HNSWContext{
+    ItemMarker visited;
+    vector<int> neighbors; // copy of a neighbor list
+    vector<pair<double,int>> results; // (distance,item), nearest first
+};
+
+struct HNSWHeader{
+    char magic[8];
+    uint32_t version;
+    uint32_t numItems;
+    uint32_t numLatentFactors;
+    uint32_t M;
+    int32_t maxLevel;
+    int32_t entryPoint;
+    uint64_t factorChecksum; // FNV-1a of the factor rows
+};
+
+class HNSW{
+
+    private:
+
+        static const uint32_t VERSION = 2;
+        static const uint32_t MAX_M = 1024; // bounds of a loaded graph
+        static const int MAX_LEVEL = 64;
+
+        typedef pair<double,int> DistItem;
+        typedef priority_queue<DistItem> MaxHeap;
+        typedef priority_queue<DistItem, vector<DistItem>, greater<DistItem>> MinHeap;
+
+        const FactorMatrix &factors;
+        unsigned int numItems;
+        unsigned int numLatentFactors;
+
+        unsigned int M; // links per item on levels > 0
+        unsigned int maxM0; // links per item on level 0
+        unsigned int efConstruction;
+        double levelMult;
+
+        vector<double> norms; // squared norms of the factors
+        vector<int> levels;
+        vector<int> links0; // numItems x (1+maxM0), count first
+        vector<vector<int>> upperLinks; // levels[i] x (1+M) per item
+        mutable vector<mutex> locks;
+        mutex entryLock;
+        int maxLevel;
+        int entryPoint;
+
+        static const char* magic(){
+            return "MMFNNHNS";
+        }
+
+        // ---------------------------------
+        // neighbor list of item on level, count first
+        // ---------------------------------
+        inline int* linkList(int item, int level){
+            return (level == 0) ? &this->links0[(size_t)item*(1+this->maxM0)]
+                                : &this->upperLinks[item][(size_t)(level-1)*(1+this->M)];
+        }
+
+        inline const int* linkList(int item, int level) const {
+            return (level == 0) ? &this->links0[(size_t)item*(1+this->maxM0)]
+                                : &this->upperLinks[item][(size_t)(level-1)*(1+this->M)];
+        }
+
+        inline unsigned int maxLinks(int level) const {
+            return (level == 0) ? this->maxM0 : this->M;
+        }
+
+        // ---------------------------------
+        // squared L2 distances
+        // ---------------------------------
+        inline double distance(const factor_t* query, double queryNorm, int item) const {
+            return queryNorm + this->norms[item] - 2.0*MatrixOps::dot(query, this->factors[item], this->numLatentFactors);
+        }
+
+        inline double distance(int a, int b) const {
+            return distance(this->factors[a], this->norms[a], b);
+        }
+
+        // ---------------------------------
+        // copy a neighbor list under its lock
+        // ---------------------------------
+        void copyLinks(int item, int level, vector<int>& neighbors, bool locked) const {
+            if( locked ){
+                lock_guard<mutex> guard(this->locks[item]);
+                const int* list = linkList(item, level);
+                neighbors.assign(list+1, list+1+list[0]);
+            } else {
+                const int* list = linkList(item, level);
+                neighbors.assign(list+1, list+1+list[0]);
+            }
+        }
+
+        // ---------------------------------
+        // greedy descent to the nearest item on one level
+        // ---------------------------------
+        int greedyClosest(const factor_t* query, double queryNorm, int current, int level,
+                          HNSWContext& context, bool locked) const {
+            double currentDistance = distance(query, queryNorm, current);
+            bool changed = true;
+            while( changed ){
+                changed = false;
+                copyLinks(current, level, context.neighbors, locked);
+                for(int neighbor : context.neighbors){
+                    double d = distance(query, queryNorm, neighbor);
+                    if( d < currentDistance || (d == currentDistance && neighbor < current) ){
+                        currentDistance = d;
+                        current = neighbor;
+                        changed = true;
+                    }
+                }
+            }
+            return current;
+        }
+
+        // ---------------------------------
+        // beam search of width ef on one level,
+        // context.results gets the ef nearest found, nearest first
+        // ---------------------------------
+        void searchLevel(const factor_t* query, double queryNorm, int entry, unsigned int ef, int level,
+                         HNSWContext& context, bool locked) const {
+
+            context.visited.clear(this->numItems);
+            MinHeap candidates;
+            MaxHeap top;
+
+            double entryDistance = distance(query, queryNorm, entry);
+            candidates.push({entryDistance, entry});
+            top.push({entryDistance, entry});
+            context.visited.mark(entry);
+
+            while( !candidates.empty() ){
+                DistItem current = candidates.top();
+                if( top.size() >= ef && current > top.top() ){
+                    break;
+                }
+                candidates.pop();
+
+                copyLinks(current.second, level, context.neighbors, locked);
+                for(int neighbor : context.neighbors){
+                    if( !context.visited.insert(neighbor) ){
+                        continue;
+                    }
+                    DistItem next(distance(query, queryNorm, neighbor), neighbor);
+                    if( top.size() < ef || next < top.top() ){
+                        candidates.push(next);
+                        top.push(next);
+                        if( top.size() > ef ){
+                            top.pop();
+                        }
+                    }
+                }
+            }
+
+            context.results.resize(top.size());
+            for(size_t n=top.size(); n>0; n--){
+                context.results[n-1] = top.top();
+                top.pop();
+            }
+        }
+
+        // ---------------------------------
+        // diversity heuristic: keep a candidate only if it is closer to
+        // the query than to every neighbor kept so far
+        // candidates sorted nearest first
+        // ---------------------------------
+        void selectNeighbors(const vector<DistItem>& candidates, unsigned int maxNeighbors,
+                             vector<int>& selected) const {
+            selected.clear();
+            for(const DistItem& candidate : candidates){
+                if( selected.size() >= maxNeighbors ){
+                    break;
+                }
+                bool keep = true;
+                for(int s : selected){
+                    if( distance(candidate.second, s) < candidate.first ){
+                        keep = false;
+                        break;
+                    }
+                }
+                if( keep ){
+                    selected.push_back(candidate.second);
+                }
+            }
+        }
+
+        // ---------------------------------
+        // link newNeighbor into the list of item, shrinking it by the
+        // heuristic when full
+        // ---------------------------------
+        void addLink(int item, int newNeighbor, int level){
+            lock_guard<mutex> guard(this->locks[item]);
+            int* list = linkList(item, level);
+            unsigned int capacity = maxLinks(level);
+            if( (unsigned int)list[0] < capacity ){
+                list[1+list[0]] = newNeighbor;
+                list[0]++;
+                return;
+            }
+
+            vector<DistItem> candidates;
+            candidates.reserve(capacity+1);
+            candidates.push_back({distance(item, newNeighbor), newNeighbor});
+            for(int n=0; n<list[0]; n++){
+                candidates.push_back({distance(item, list[1+n]), list[1+n]});
+            }
+            sort(candidates.begin(), candidates.end());
+            vector<int> selected;
+            selectNeighbors(candidates, capacity, selected);
+            list[0] = selected.size();
+            copy(selected.begin(), selected.end(), list+1);
+        }
+
+        // ---------------------------------
+        // insert an item, the entry point must exist
+        // ---------------------------------
+        void insert(int item, HNSWContext& context){
+
+            int level = this->levels[item];
+            unique_lock<mutex> entryGuard(this->entryLock);
+            int topLevel = this->maxLevel;
+            int current = this->entryPoint;
+            if( level <= topLevel ){
+                entryGuard.unlock();
+            }
+
+            const factor_t* query = this->factors[item];
+            double queryNorm = this->norms[item];
+            for(int l=topLevel; l>level; l--){
+                current = greedyClosest(query, queryNorm, current, l, context, true);
+            }
+
+            vector<int> selected;
+            for(int l=min(level, topLevel); l>=0; l--){
+                searchLevel(query, queryNorm, current, this->efConstruction, l, context, true);
+                current = context.results[0].second;
+
+                selectNeighbors(context.results, this->M, selected);
+                {
+                    lock_guard<mutex> guard(this->locks[item]);
+                    int* list = linkList(item, l);
+                    list[0] = selected.size();
+                    copy(selected.begin(), selected.end(), list+1);
+                }
+                for(int neighbor : selected){
+                    addLink(neighbor, item, l);
+                }
+            }
+
+            if( level > topLevel ){
+                this->maxLevel = level;
+                this->entryPoint = item;
+            }
+        }
+
+        // ---------------------------------
+        // FNV-1a over the bytes of all factor rows (without padding)
+        // ---------------------------------
+        uint64_t factorChecksum() const {
+            uint64_t hash = 14695981039346656037ull;
+            for(unsigned int i=0; i<this->numItems; i++){
+                const unsigned char* bytes = reinterpret_cast<const unsigned char*>(this->factors[i]);
+                for(size_t b=0; b<this->numLatentFactors*sizeof(factor_t); b++){
+                    hash = (hash ^ bytes[b]) * 1099511628211ull;
+                }
+            }
+            return hash;
+        }
+
+        // ---------------------------------
+        // link counts within the list sizes and links to existing items
+        // ---------------------------------
+        bool validLinks() const {
+            for(unsigned int i=0; i<this->numItems; i++){
+                for(int l=0; l<=this->levels[i]; l++){
+                    const int* list = linkList(i, l);
+                    if( list[0] < 0 || (unsigned int)list[0] > maxLinks(l) ){
+                        return false;
+                    }
+                    for(int k=1; k<=list[0]; k++){
+                        if( list[k] < 0 || (unsigned int)list[k] >= this->numItems ){
+                            return false;
+                        }
+                    }
+                }
+            }
+            return true;
+        }
+
+        void allocate(){
+            this->norms.resize(this->numItems);
+            for(unsigned int i=0; i<this->numItems; i++){
+                this->norms[i] = MatrixOps::dot(this->factors[i], this->factors[i], this->numLatentFactors);
+            }
+            this->links0.assign((size_t)this->numItems*(1+this->maxM0), 0);
+            this->upperLinks.assign(this->numItems, vector<int>());
+            for(unsigned int i=0; i<this->numItems; i++){
+                this->upperLinks[i].assign((size_t)this->levels[i]*(1+this->M), 0);
+            }
+            this->locks = vector<mutex>(this->numItems);
+        }
+
+    public:
+
+        // ---------------------------------
+        // Constructor, the index is empty until build or load
+        // ---------------------------------
+        HNSW( const FactorMatrix &factors,
+              unsigned int M = 16,
+              unsigned int efConstruction = 200)
+              : factors(factors) {
+
+            this->numItems = factors.getNumRows();
+            this->numLatentFactors = factors.getNumCols();
+            this->M = max(M, 2u);
+            this->maxM0 = 2*this->M;
+            this->efConstruction = max(efConstruction, this->M);
+            this->levelMult = 1.0/log(1.0*this->M);
+            this->maxLevel = -1;
+            this->entryPoint = -1;
+        }
+
+        // ---------------------------------
+        // insert all items, numThreads == 0 uses all cores
+        // ---------------------------------
+        void build(unsigned int numThreads = 0, unsigned int seed = 1234){
+
+            mt19937 generator(seed);
+            uniform_real_distribution<double> distribution(0.0, 1.0);
+            this->levels.resize(this->numItems);
+            for(unsigned int i=0; i<this->numItems; i++){
+                this->levels[i] = (int)(-log(1.0 - distribution(generator)) * this->levelMult);
+            }
+            allocate();
+            if( this->numItems == 0 ){
+                return;
+            }
+
+            this->entryPoint = 0;
+            this->maxLevel = this->levels[0];
+
+            #pragma omp parallel num_threads(numThreads > 0 ? numThreads : omp_get_max_threads())
+            {
+                HNSWContext context;
+                #pragma omp for schedule(dynamic, 64)
+                for(long long i=1; i<this->numItems; i++){
+                    insert(i, context);
+                }
+            }
+        }
+
+        // ---------------------------------
+        // k approximate nearest items of a query row, nearest first,
+        // written to knns, -1 where fewer were found
+        // ---------------------------------
+        void search(const factor_t* query, unsigned int k, unsigned int efSearch, int* knns, HNSWContext& context) const {
+
+            fill(knns, knns+k, -1);
+            if( this->entryPoint < 0 ){
+                return;
+            }
+            double queryNorm = MatrixOps::dot(query, query, this->numLatentFactors);
+            int current = this->entryPoint;
+            for(int l=this->maxLevel; l>0; l--){
+                current = greedyClosest(query, queryNorm, current, l, context, false);
+            }
+            searchLevel(query, queryNorm, current, max(efSearch, k), 0, context, false);
+            for(unsigned int n=0; n<k && n<context.results.size(); n++){
+                knns[n] = context.results[n].second;
+            }
+        }
+
+        // ---------------------------------
+        // knn table in the layout of NN, numItems x numNeighbors,
+        // every item queried with its own factors
+        // ---------------------------------
+        vector<int> knn(unsigned int numNeighbors, unsigned int efSearch, unsigned int numThreads = 0) const {
+            return knn(this->factors, numNeighbors, efSearch, numThreads);
+        }
+
+        // ---------------------------------
+        // as above, item i queried with row i of queries, which has the
+        // columns of the indexed factors (see KnnSpace)
+        // ---------------------------------
+        vector<int> knn(const FactorMatrix& queries, unsigned int numNeighbors, unsigned int efSearch,
+                        unsigned int numThreads = 0) const {
+
+            unsigned int numQueries = queries.getNumRows();
+            vector<int> knns((size_t)numQueries*numNeighbors, -1);
+            #pragma omp parallel num_threads(numThreads > 0 ? numThreads : omp_get_max_threads())
+            {
+                HNSWContext context;
+                #pragma omp for schedule(dynamic, 64)
+                for(long long i=0; i<numQueries; i++){
+                    search(queries[i], numNeighbors, efSearch, &knns[(size_t)i*numNeighbors], context);
+                }
+            }
+            return knns;
+        }
+
+        // ---------------------------------
+        // save the graph (not the factors)
+        // ---------------------------------
+        bool save(const string& path) const {
+
+            HNSWHeader header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, magic(), sizeof(header.magic));
+            header.version = VERSION;
+            header.numItems = this->numItems;
+            header.numLatentFactors = this->numLatentFactors;
+            header.M = this->M;
+            header.maxLevel = this->maxLevel;
+            header.entryPoint = this->entryPoint;
+            header.factorChecksum = factorChecksum();
+
+            ofstream ofs(path, ios::binary | ios::trunc);
+            if( !ofs.is_open() ){
+                cout << "ERROR: Unable to open file " << path << endl;
+                return false;
+            }
+            ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            ofs.write(reinterpret_cast<const char*>(this->levels.data()), this->levels.size()*sizeof(int));
+            ofs.write(reinterpret_cast<const char*>(this->links0.data()), this->links0.size()*sizeof(int));
+            for(unsigned int i=0; i<this->numItems; i++){
+                ofs.write(reinterpret_cast<const char*>(this->upperLinks[i].data()), this->upperLinks[i].size()*sizeof(int));
+            }
+            ofs.close();
+            if( ofs.fail() ){
+                cout << "ERROR: Unable to write file " << path << endl;
+                return false;
+            }
+            return true;
+        }
+
+        // ---------------------------------
+        // load a graph saved for the same factors,
+        // false if missing, corrupt or built for other factors
+        // ---------------------------------
+        bool load(const string& path){
+
+            ifstream ifs(path, ios::binary);
+            if( !ifs.is_open() ){
+                cout << "ERROR: Unable to open file " << path << endl;
+                return false;
+            }
+            HNSWHeader header;
+            if( !ifs.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+                memcmp(header.magic, magic(), sizeof(header.magic)) != 0 ||
+                header.version != VERSION ||
+                header.numItems != this->numItems ||
+                header.numLatentFactors != this->numLatentFactors ||
+                header.M < 2 || header.M > MAX_M ||
+                header.maxLevel < (this->numItems > 0 ? 0 : -1) || header.maxLevel > MAX_LEVEL ||
+                (this->numItems > 0 && (header.entryPoint < 0 || (unsigned int)header.entryPoint >= this->numItems)) ){
+                cout << "ERROR: Incompatible HNSW index " << path << endl;
+                return false;
+            }
+            if( header.factorChecksum != factorChecksum() ){
+                cout << "ERROR: HNSW index " << path << " was built for other factors" << endl;
+                return false;
+            }
+
+            // levels before anything is allocated from them
+            this->levels.resize(this->numItems);
+            ifs.read(reinterpret_cast<char*>(this->levels.data()), this->levels.size()*sizeof(int));
+            bool valid = (bool)ifs;
+            for(unsigned int i=0; i<this->numItems && valid; i++){
+                valid = (this->levels[i] >= 0 && this->levels[i] <= header.maxLevel);
+            }
+            if( !valid || (this->numItems > 0 && this->levels[header.entryPoint] != header.maxLevel) ){
+                cout << "ERROR: Corrupt HNSW index " << path << endl;
+                this->levels.clear();
+                return false;
+            }
+
+            this->M = header.M;
+            this->maxM0 = 2*this->M;
+            this->levelMult = 1.0/log(1.0*this->M);
+            allocate();
+            ifs.read(reinterpret_cast<char*>(this->links0.data()), this->links0.size()*sizeof(int));
+            for(unsigned int i=0; i<this->numItems; i++){
+                ifs.read(reinterpret_cast<char*>(this->upperLinks[i].data()), this->upperLinks[i].size()*sizeof(int));
+            }
+            if( !ifs || !validLinks() ){
+                cout << "ERROR: Corrupt HNSW index " << path << endl;
+                this->maxLevel = -1;
+                this->entryPoint = -1;
+                return false;
+            }
+            this->maxLevel = header.maxLevel;
+            this->entryPoint = header.entryPoint;
+            return true;
+        }
+
+        // ---------------------------------
+        // Getters
+        // ---------------------------------
+        unsigned int getM() const { return this->M; }
+        int getMaxLevel() const { return this->maxLevel; }
+
+};
+
+#endif
@@ -0,0 +1,309 @@
+#ifndef KNNBUILDER_H
+#define KNNBUILDER_H
+
+/*
+    Exact item-item kNN graph by blocked brute force
+
+    All pairwise distances are computed with the dot product tiles of
+    MatrixOps: a block of query rows is scored against a block of item
+    rows at a time, so both blocks stay in cache, and blocks of query
+    rows are spread over threads. Every query row keeps a sorted list
+    of its best K+1 items, ties broken by the smaller item index, so the
+    result does not depend on the number of threads.
+
+    As with FLANN, an item is its own first neighbor under L2, hence
+    K+1. Other metrics are searched on transformed rows, see KnnSpace.
+
+    updateL2 refreshes a previous graph after some rows changed, with
+    exact queries for the affected rows only.
+
+    Part of MMFNN guiding code. Provided as is.
+    Tested with C++17 (g++ ver. 12.2)
+ */
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+#include "../common/MatrixOps.h"
+
+using namespace std;
+
+class KnnBuilder{
+
+    private:
+
+        static const unsigned int ROW_BLOCK = 32;
+        static const unsigned int COL_BLOCK = 256;
+
+        // ---------------------------------
+        // insert (distance, item) into a list sorted by (distance, item)
+        // holding at most capacity entries
+        // ---------------------------------
+        static inline void insert(double* distances, int* items, unsigned int& size, unsigned int capacity,
+                                  double distance, int item){
+            unsigned int pos = size;
+            if( size == capacity ){
+                if( distance > distances[size-1] || (distance == distances[size-1] && item > items[size-1]) ){
+                    return;
+                }
+                pos--;
+            } else {
+                size++;
+            }
+            while( pos > 0 && (distances[pos-1] > distance || (distances[pos-1] == distance && items[pos-1] > item)) ){
+                distances[pos] = distances[pos-1];
+                items[pos] = items[pos-1];
+                pos--;
+            }
+            distances[pos] = distance;
+            items[pos] = item;
+        }
+
+    public:
+
+        // ---------------------------------
+        // numNeighbors nearest rows of Q (L2) for every row of Q,
+        // numRows x numNeighbors row-major, nearest first, -1 if Q has
+        // fewer rows than numNeighbors
+        // numThreads == 0 uses all cores
+        // ---------------------------------
+        static vector<int> exactL2(const FactorMatrix& Q, unsigned int numNeighbors, unsigned int numThreads = 0){
+            vector<unsigned int> queryRows(Q.getNumRows());
+            for(unsigned int i=0; i<queryRows.size(); i++){
+                queryRows[i] = i;
+            }
+            return exactL2(Q, queryRows, numNeighbors, numThreads);
+        }
+
+        // ---------------------------------
+        // as above for the given rows of Q only,
+        // queryRows.size() x numNeighbors in the order of queryRows
+        // ---------------------------------
+        static vector<int> exactL2(const FactorMatrix& Q, const vector<unsigned int>& queryRows,
+                                   unsigned int numNeighbors, unsigned int numThreads = 0){
+            return exactL2(Q, Q, queryRows, numNeighbors, numThreads);
+        }
+
+        // ---------------------------------
+        // numNeighbors nearest rows of data for the given rows of
+        // queries, which has the columns of data (see KnnSpace)
+        // ---------------------------------
+        static vector<int> exactL2(const FactorMatrix& data, const FactorMatrix& queries,
+                                   const vector<unsigned int>& queryRows,
+                                   unsigned int numNeighbors, unsigned int numThreads = 0){
+
+            unsigned int numRows = data.getNumRows();
+            unsigned int numCols = data.getNumCols();
+            unsigned int numQueries = queryRows.size();
+            vector<int> knns((size_t)numQueries*numNeighbors, -1);
+            if( numRows == 0 || numQueries == 0 || numNeighbors == 0 ){
+                return knns;
+            }
+
+            // squared norms, |x-y|^2 = |x|^2 + |y|^2 - 2 x.y
+            vector<double> norms(numRows);
+            for(unsigned int i=0; i<numRows; i++){
+                norms[i] = MatrixOps::dot(data[i], data[i], numCols);
+            }
+            vector<double> queryNorms(numQueries);
+            for(unsigned int q=0; q<numQueries; q++){
+                queryNorms[q] = MatrixOps::dot(queries[queryRows[q]], queries[queryRows[q]], numCols);
+            }
+
+            #pragma omp parallel num_threads(numThreads > 0 ? numThreads : omp_get_max_threads())
+            {
+                vector<const factor_t*> rows(ROW_BLOCK);
+                vector<double> tile((size_t)ROW_BLOCK*COL_BLOCK);
+                vector<double> distances((size_t)ROW_BLOCK*numNeighbors);
+                vector<int> items((size_t)ROW_BLOCK*numNeighbors);
+                vector<unsigned int> sizes(ROW_BLOCK);
+
+                #pragma omp for schedule(dynamic)
+                for(long long r0=0; r0<numQueries; r0+=ROW_BLOCK){
+                    unsigned int numBlockRows = min<long long>(ROW_BLOCK, numQueries-r0);
+                    for(unsigned int a=0; a<numBlockRows; a++){
+                        rows[a] = queries[queryRows[r0+a]];
+                        sizes[a] = 0;
+                    }
+
+                    for(unsigned int c0=0; c0<numRows; c0+=COL_BLOCK){
+                        unsigned int numBlockCols = min(COL_BLOCK, numRows-c0);
+                        MatrixOps::scoreTile(rows.data(), numBlockRows, data, c0, numBlockCols,
+                                             tile.data(), COL_BLOCK);
+
+                        for(unsigned int a=0; a<numBlockRows; a++){
+                            const double* scores = &tile[(size_t)a*COL_BLOCK];
+                            double* rowDistances = &distances[(size_t)a*numNeighbors];
+                            int* rowItems = &items[(size_t)a*numNeighbors];
+                            double rowNorm = queryNorms[r0+a];
+                            for(unsigned int b=0; b<numBlockCols; b++){
+                                double distance = rowNorm + norms[c0+b] - 2.0*scores[b];
+                                // cheap rejection before the sorted insert
+                                if( sizes[a] == numNeighbors && distance > rowDistances[numNeighbors-1] ){
+                                    continue;
+                                }
+                                insert(rowDistances, rowItems, sizes[a], numNeighbors, distance, c0+b);
+                            }
+                        }
+                    }
+
+                    for(unsigned int a=0; a<numBlockRows; a++){
+                        copy(&items[(size_t)a*numNeighbors], &items[(size_t)a*numNeighbors] + sizes[a],
+                             &knns[(size_t)(r0+a)*numNeighbors]);
+                    }
+                }
+            }
+
+            return knns;
+        }
+
+        // ---------------------------------
+        // knns of all rows after some rows changed. previousKnns
+        // (numPrevious x numNeighbors) are the knns of the first
+        // numPrevious rows before; of these, movedRows changed, and the
+        // rows from numPrevious on are new. Rows beyond data (a smaller
+        // catalog) are taken as moved.
+        // Moved and new rows and the rows that had a moved neighbor are
+        // requeried. Every other row keeps its neighbors, which did not
+        // move, merged with its nearest moved or new rows. The merge
+        // ranks by MatrixOps::dot rather than the tiles of exactL2, so
+        // the result equals a rebuild up to the order of floating-point
+        // ties. numRequeried is set if given.
+        // ---------------------------------
+        static vector<int> updateL2(const FactorMatrix& data, const FactorMatrix& queries,
+                                    const int* previousKnns, unsigned int numPrevious,
+                                    const vector<unsigned int>& movedRows, unsigned int numNeighbors,
+                                    unsigned int numThreads = 0, size_t* numRequeried = nullptr){
+
+            unsigned int numRows = data.getNumRows();
+            unsigned int numCols = data.getNumCols();
+            numPrevious = min(numPrevious, numRows);
+            numThreads = numThreads > 0 ? numThreads : omp_get_max_threads();
+
+            // rows with a moved or dropped neighbor
+            vector<char> moved(numRows, 0);
+            for(unsigned int i : movedRows){
+                moved[i] = 1;
+            }
+            vector<char> requery(moved);
+            #pragma omp parallel for schedule(dynamic, 256) num_threads(numThreads)
+            for(long long i=0; i<numPrevious; i++){
+                const int* rowKnns = previousKnns + (size_t)i*numNeighbors;
+                for(unsigned int k=0; k<numNeighbors && !requery[i]; k++){
+                    requery[i] = (rowKnns[k] >= 0 && ((unsigned int)rowKnns[k] >= numRows || moved[rowKnns[k]]));
+                }
+            }
+
+            vector<unsigned int> requeryRows, keptRows, changedRows(movedRows);
+            for(unsigned int i=0; i<numRows; i++){
+                if( i >= numPrevious || requery[i] ){
+                    requeryRows.push_back(i);
+                } else {
+                    keptRows.push_back(i);
+                }
+            }
+            for(unsigned int i=numPrevious; i<numRows; i++){
+                changedRows.push_back(i);
+            }
+            if( numRequeried != nullptr ){
+                *numRequeried = requeryRows.size();
+            }
+
+            vector<int> knns((size_t)numRows*numNeighbors, -1);
+            for(unsigned int i : keptRows){
+                copy(previousKnns + (size_t)i*numNeighbors, previousKnns + (size_t)(i+1)*numNeighbors,
+                     &knns[(size_t)i*numNeighbors]);
+            }
+            vector<int> requeried = exactL2(data, queries, requeryRows, numNeighbors, numThreads);
+            for(size_t r=0; r<requeryRows.size(); r++){
+                copy(&requeried[r*numNeighbors], &requeried[(r+1)*numNeighbors],
+                     &knns[(size_t)requeryRows[r]*numNeighbors]);
+            }
+            if( changedRows.empty() ){
+                return knns;
+            }
+
+            // nearest changed rows of the kept rows, as indexes into changedRows
+            FactorMatrix changedData(changedRows.size(), numCols);
+            for(size_t c=0; c<changedRows.size(); c++){
+                copy(data[changedRows[c]], data[changedRows[c]] + numCols, changedData[c]);
+            }
+            vector<int> nearestChanged = exactL2(changedData, queries, keptRows, numNeighbors, numThreads);
+
+            #pragma omp parallel num_threads(numThreads)
+            {
+                vector<double> distances(numNeighbors);
+                vector<int> items(numNeighbors);
+
+                #pragma omp for schedule(dynamic, 256)
+                for(long long r=0; r<(long long)keptRows.size(); r++){
+                    const factor_t* query = queries[keptRows[r]];
+                    double queryNorm = MatrixOps::dot(query, query, numCols);
+                    int* rowKnns = &knns[(size_t)keptRows[r]*numNeighbors];
+                    unsigned int size = 0;
+                    for(unsigned int k=0; k<2*numNeighbors; k++){
+                        int item = (k < numNeighbors) ? rowKnns[k] : nearestChanged[r*numNeighbors + k-numNeighbors];
+                        if( item < 0 ){
+                            continue;
+                        }
+                        if( k >= numNeighbors ){
+                            item = changedRows[item];
+                        }
+                        double distance = queryNorm + MatrixOps::dot(data[item], data[item], numCols)
+                                          - 2.0*MatrixOps::dot(query, data[item], numCols);
+                        insert(distances.data(), items.data(), size, numNeighbors, distance, item);
+                    }
+                    copy(items.begin(), items.begin() + size, rowKnns);
+                }
+            }
+
+            return knns;
+        }
+
+        // ---------------------------------
+        // mean recall of approximate knn rows against exact ones,
+        // both numRows x numNeighbors
+        // ---------------------------------
+        static double recall(const int* approximate, const int* exact, unsigned int numRows, unsigned int numNeighbors){
+            if( numRows == 0 || numNeighbors == 0 ){
+                return 0.0;
+            }
+            size_t found = 0;
+            vector<int> sortedExact(numNeighbors);
+            for(unsigned int r=0; r<numRows; r++){
+                copy(exact + (size_t)r*numNeighbors, exact + (size_t)(r+1)*numNeighbors, sortedExact.begin());
+                sort(sortedExact.begin(), sortedExact.end());
+                for(unsigned int k=0; k<numNeighbors; k++){
+                    int item = approximate[(size_t)r*numNeighbors+k];
+                    if( item >= 0 && binary_search(sortedExact.begin(), sortedExact.end(), item) ){
+                        found++;
+                    }
+                }
+            }
+            return 1.0*found/((size_t)numRows*numNeighbors);
+        }
+
+        // ---------------------------------
+        // recall of a full knn table (data rows x numNeighbors) against
+        // exact knns on about sampleSize evenly spaced rows
+        // ---------------------------------
+        static double sampleRecall(const int* knns, const FactorMatrix& data, const FactorMatrix& queries,
+                                   unsigned int numNeighbors, unsigned int sampleSize, unsigned int numThreads = 0){
+            unsigned int numRows = data.getNumRows();
+            vector<unsigned int> sampleRows;
+            unsigned int step = max(1u, numRows/max(sampleSize, 1u));
+            for(unsigned int i=0; i<numRows; i+=step){
+                sampleRows.push_back(i);
+            }
+            vector<int> exactKnns = exactL2(data, queries, sampleRows, numNeighbors, numThreads);
+            vector<int> sampleKnns;
+            for(unsigned int i : sampleRows){
+                sampleKnns.insert(sampleKnns.end(), knns + (size_t)i*numNeighbors, knns + (size_t)(i+1)*numNeighbors);
+            }
+            return recall(sampleKnns.data(), exactKnns.data(), sampleRows.size(), numNeighbors);
+        }
+
+};
+
+#endif
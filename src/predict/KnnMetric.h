@@ -0,0 +1,98 @@
+#ifndef KNNMETRIC_H
+#define KNNMETRIC_H
+
+/*
+    Neighbor metrics for item knns, reduced to L2 search
+
+    Predictions rank items by P[user].Q[item], while an L2 knn graph
+    favors items with small norms. The knn builders (exact, HNSW, FLANN)
+    all search by L2, so other metrics are handled by transforming the
+    item factors into data rows (what is indexed) and query rows (what
+    is searched for), whose L2 neighbors are the neighbors under the
+    metric:
+
+      L2      data = queries = Q
+      MIPS    data    = [Q[i], sqrt(maxNorm^2 - |Q[i]|^2)]
+              queries = [Q[i], 0]
+              |query - data|^2 = |Q[i]|^2 + maxNorm^2 - 2 Q[i].Q[j],
+              so the nearest rows have the largest inner product
+      COSINE  data = queries = Q[i]/|Q[i]|
+
+    Part of MMFNN guiding code. Provided as is.
+    Tested with C++17 (g++ ver. 12.2)
+ */
+
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include "../common/MatrixOps.h"
+
+using namespace std;
+
+enum KnnMetric { KNN_METRIC_L2 = 0, KNN_METRIC_MIPS = 1, KNN_METRIC_COSINE = 2 };
+
+class KnnSpace{
+
+    public:
+
+        // ---------------------------------
+        // "l2", "mips" or "cosine", L2 if unknown
+        // ---------------------------------
+        static KnnMetric parse(const string& name){
+            if( name == "mips" ) return KNN_METRIC_MIPS;
+            if( name == "cosine" ) return KNN_METRIC_COSINE;
+            return KNN_METRIC_L2;
+        }
+
+        static const char* name(KnnMetric metric){
+            switch( metric ){
+                case KNN_METRIC_MIPS: return "mips";
+                case KNN_METRIC_COSINE: return "cosine";
+                default: return "l2";
+            }
+        }
+
+        // ---------------------------------
+        // data and query rows for the metric, false for L2, where Q
+        // itself is used and data and queries are left untouched
+        // ---------------------------------
+        static bool transform(const FactorMatrix& Q, KnnMetric metric, FactorMatrix& data, FactorMatrix& queries){
+
+            unsigned int numRows = Q.getNumRows();
+            unsigned int numCols = Q.getNumCols();
+
+            if( metric == KNN_METRIC_MIPS ){
+                double maxNorm2 = 0.0;
+                for(unsigned int i=0; i<numRows; i++){
+                    maxNorm2 = max(maxNorm2, MatrixOps::dot(Q[i], Q[i], numCols));
+                }
+                data = FactorMatrix(numRows, numCols+1);
+                queries = FactorMatrix(numRows, numCols+1);
+                for(unsigned int i=0; i<numRows; i++){
+                    double norm2 = MatrixOps::dot(Q[i], Q[i], numCols);
+                    copy(Q[i], Q[i]+numCols, data[i]);
+                    copy(Q[i], Q[i]+numCols, queries[i]);
+                    data[i][numCols] = sqrt(max(0.0, maxNorm2 - norm2));
+                }
+                return true;
+            }
+
+            if( metric == KNN_METRIC_COSINE ){
+                data = FactorMatrix(numRows, numCols);
+                for(unsigned int i=0; i<numRows; i++){
+                    double norm = sqrt(MatrixOps::dot(Q[i], Q[i], numCols));
+                    double scale = (norm > 0.0) ? 1.0/norm : 0.0;
+                    for(unsigned int f=0; f<numCols; f++){
+                        data[i][f] = Q[i][f]*scale;
+                    }
+                }
+                queries = FactorMatrix::view(data.getData(), numRows, numCols);
+                return true;
+            }
+
+            return false;
+        }
+
+};
+
+#endif
@@ -4,25 +4,77 @@
 /*
     NN with and without min. heap
 
-    Requires FLANN to be pre-installed. See:
+    Item knns come from the built-in exact builder (buildKnn), from
+    precomputed tables (useKnns, e.g. from an HNSW index) or, if FLANN
+    is installed, from a FLANN index (indexAndKnn). FLANN support is
+    compiled in when its header is found and MMFNN_NO_FLANN is not
+    defined. The knns of a previous model can be updated for the items
+    that moved (updateKnn) instead of found again. See:
     - https://github.com/mariusmuja/flann
     - http://www.cs.ubc.ca/research/flann
 
+    Candidates are the union of the knns of the user's history. They
+    are gathered into a flat buffer, deduplicated with an epoch-stamped
+    array, and scored in one pass (MatrixOps::scoreRows). An optional
+    candidate budget bounds the work per call for long histories, see
+    setCandidateBudget.
+    recommend() returns (item, score) pairs in a caller-owned buffer,
+    see EP.
+
+    Once its knns are set, an NN object is read-only and can be
+    shared by threads. All per-call state lives in an NNContext.
+
     Part of MMFNN guiding code. Provided as is.
-    Tested with C++11 (g++ ver. 4.9.4) and flann-1.8.4
+    Tested with C++17 (g++ ver. 12.2), optionally flann-1.8.4
  */
 
 #include <iostream>
 #include <vector>
-#include <unordered_map>
-#include <unordered_set>
 #include <algorithm>
 #include <queue>
+#include <random>
 #include "helper.h"
+#include "../common/MatrixOps.h"
+#include "../common/UserHistory.h"
+#include "../common/ItemMarker.h"
+#include "KnnBuilder.h"
+#include "KnnMetric.h"
+#include "TopKBuffer.h"
+#include "../common/Stats.h"
+
+#if !defined(MMFNN_NO_FLANN) && __has_include(<flann/flann.hpp>)
+#define MMFNN_HAS_FLANN 1
 #include <flann/flann.hpp>
+#endif
 
 using namespace std;
 
+// ---------------------------------
+// choice of the history items whose knns are candidates, when the
+// candidate budget does not cover all of them
+// ---------------------------------
+enum SeedPolicy { SEED_HIGHEST_ID = 0, SEED_SCORE = 1, SEED_RANDOM = 2 };
+
+// ---------------------------------
+// per-thread scratch for NN predictions
+// ---------------------------------
+struct NNContext{
+    vector<ScorePair> vecScorePairs; // holds (item,score) pairs
+    vector<unsigned int> topNList; // holds top-N list for a user
+    priority_queue<ScorePair> pq; // for min. heap
+    ItemMarker visited; // history of the current user, then its candidates
+    ItemMarker history; // with MMFNN_STATS only, tells history items from duplicates
+    vector<unsigned int> candidates; // union of the neighbors outside the history
+    vector<const factor_t*> candidateRows;
+    vector<double> candidateScores;
+    TopKBuffer topK;
+    vector<unsigned int> seeds; // history items used under a budget
+    vector<ScorePair> seedScores;
+    size_t numScored = 0; // candidates scored so far
+    size_t maxScored = 0; // most candidates of a single call
+    size_t numBudgeted = 0; // calls that were cut by the budget
+};
+
 class NN{
 
     private:
@@ -32,34 +84,188 @@ class NN{
         unsigned int numLatentFactors;
 
         unsigned int K; // for knn
-        flann::Matrix<int> knns;
+        KnnMetric knnMetric;
 
-        double **factorQ;
-        double **factorP;
-        unordered_map<unsigned int, unordered_set<unsigned int>> mapUserHistory;
+        unsigned int candidateBudget; // 0 for none
+        SeedPolicy seedPolicy;
+        unsigned int seed; // for SEED_RANDOM
+        vector<uint64_t> seedOffsets; // SEED_SCORE, numUsers+1 offsets into seedItems
+        vector<unsigned int> seedItems; // best scored history items of the users over the budget
+        vector<int> ownedKnns;
+        const int* knns; // numItems x (K+1) row-major
 
-        unordered_set<unsigned int> currentHistoryItems;
-        vector<ScorePair> vecScorePairs; // holds (item,score) pairs
-        unsigned int *topNList; // holds top-N list for a user
+        const FactorMatrix &factorQ;
+        const FactorMatrix &factorP;
+        const UserHistory &userHistory;
 
-        priority_queue<ScorePair> pq; // for min. heap
+        // ---------------------------------
+        // knns of an item, K+1 entries, -1 if missing
+        // ---------------------------------
+        inline const int* knnsOf(unsigned int item) const {
+            return this->knns + (size_t)item*(this->K+1);
+        }
 
         // ---------------------------------
-        // flann converter
+        // numSeeds history items of a user by the seed policy into
+        // context.seeds, the most relevant first
+        // SEED_SCORE takes the seeds ranked by rankSeeds, SEED_RANDOM
+        // numSeeds evenly spaced history items from a random offset in
+        // random order, so the work is bounded by numSeeds rather than
+        // by the history.
         // ---------------------------------
-        flann::Matrix<double> Q2Flann() {
+        void selectSeeds(unsigned int user, unsigned int numSeeds, NNContext& context) const {
+            const unsigned int* begin = this->userHistory.begin(user);
+            unsigned int historySize = this->userHistory.end(user) - begin;
+            vector<unsigned int>& seeds = context.seeds;
+            seeds.resize(numSeeds);
+
+            if( this->seedPolicy == SEED_HIGHEST_ID ){
+                for(unsigned int s=0; s<numSeeds; s++){
+                    seeds[s] = begin[historySize-1-s];
+                }
+            } else if( this->seedPolicy == SEED_RANDOM ){
+                // reproducible per user
+                mt19937 generator(this->seed + user*2654435761u);
+                size_t offset = uniform_int_distribution<unsigned int>(0, historySize-1)(generator);
+                for(unsigned int s=0; s<numSeeds; s++){
+                    seeds[s] = begin[(offset + (size_t)s*historySize/numSeeds) % historySize];
+                }
+                shuffle(seeds.begin(), seeds.end(), generator);
+            } else {
+                const unsigned int* ranked = &this->seedItems[this->seedOffsets[user]];
+                seeds.assign(ranked, ranked + min<uint64_t>(numSeeds, this->seedOffsets[user+1] - this->seedOffsets[user]));
+            }
+        }
 
-            size_t rows = this->numItems;
-            size_t cols = this->numLatentFactors;
-            size_t size = this->numItems*this->numLatentFactors;
-            flann::Matrix<double>m(new double[size], rows, cols);
+        // ---------------------------------
+        // for SEED_SCORE, the min(|history|, budget) history items each
+        // user over the budget scores highest, once for all calls
+        // ---------------------------------
+        void rankSeeds() {
+            this->seedOffsets.assign(this->numUsers+1, 0);
+            for(unsigned int u=0; u<this->numUsers; u++){
+                size_t historySize = this->userHistory.size(u);
+                bool overBudget = historySize*(this->K+1) > this->candidateBudget;
+                this->seedOffsets[u+1] = this->seedOffsets[u] + (overBudget ? min<size_t>(historySize, this->candidateBudget) : 0);
+            }
+            this->seedItems.resize(this->seedOffsets[this->numUsers]);
+
+            #pragma omp parallel
+            {
+                vector<const factor_t*> rows;
+                vector<double> scores;
+                vector<ScorePair> seedScores;
+
+                #pragma omp for schedule(dynamic, 64)
+                for(long long u=0; u<this->numUsers; u++){
+                    unsigned int numSeeds = this->seedOffsets[u+1] - this->seedOffsets[u];
+                    if( numSeeds == 0 ){
+                        continue;
+                    }
+                    const unsigned int* begin = this->userHistory.begin(u);
+                    unsigned int historySize = this->userHistory.end(u) - begin;
+                    rows.resize(historySize);
+                    scores.resize(historySize);
+                    for(unsigned int h=0; h<historySize; h++){
+                        rows[h] = this->factorQ[begin[h]];
+                    }
+                    MatrixOps::scoreRows(this->factorP[u], rows.data(), historySize,
+                                         this->factorQ.getStride(), scores.data());
+                    seedScores.resize(historySize);
+                    for(unsigned int h=0; h<historySize; h++){
+                        seedScores[h] = {begin[h], scores[h]};
+                    }
+                    partial_sort(seedScores.begin(), seedScores.begin() + numSeeds, seedScores.end(), ScoreIndexOrder());
+                    for(unsigned int s=0; s<numSeeds; s++){
+                        this->seedItems[this->seedOffsets[u]+s] = seedScores[s].index;
+                    }
+                }
+            }
+        }
+
+        // ---------------------------------
+        // union of the knns of the user's history, without the history,
+        // into context.candidates, in order of first appearance
+        // One epoch-stamped array covers both tests: history items are
+        // marked first, a neighbor is taken when it is not marked yet.
+        // Under a candidate budget, see setCandidateBudget.
+        // ---------------------------------
+        void gatherCandidates(unsigned int user, NNContext& context) const {
+            Stats::add(STAT_NN_CALLS);
+            ItemMarker& visited = context.visited;
+            vector<unsigned int>& candidates = context.candidates;
+            visited.clear(this->numItems);
+            candidates.clear();
+            if( !this->userHistory.hasHistory(user) ){
+                return;
+            }
+            visited.mark(this->userHistory.begin(user), this->userHistory.end(user));
+
+            const unsigned int* seeds = this->userHistory.begin(user);
+            unsigned int numSeeds = this->userHistory.end(user) - seeds;
+            unsigned int perSeed = this->K+1;
+            size_t budget = (this->candidateBudget > 0) ? this->candidateBudget : (size_t)numSeeds*perSeed;
+            if( (size_t)numSeeds*perSeed > budget ){
+                perSeed = min(this->K+1, max(2u, this->candidateBudget / numSeeds + 1));
+                unsigned int numOrderedSeeds = min(numSeeds, this->candidateBudget);
+                selectSeeds(user, numOrderedSeeds, context);
+                seeds = context.seeds.data();
+                numSeeds = numOrderedSeeds;
+                context.numBudgeted++;
+            }
+
+            size_t numRejected = 0, numInHistory = 0; // for Stats only
+            if( Stats::ENABLED ){
+                context.history.clear(this->numItems);
+                context.history.mark(this->userHistory.begin(user), this->userHistory.end(user));
+            }
+            for(unsigned int s=0; s<numSeeds && candidates.size()<budget; s++){
+                const int* itemKnns = knnsOf(seeds[s]);
+                for(unsigned int k=0; k<perSeed && candidates.size()<budget; k++){
+                    if ( itemKnns[k] >= 0 && visited.insert(itemKnns[k]) ){
+                        candidates.push_back(itemKnns[k]);
+                    } else if ( Stats::ENABLED && itemKnns[k] >= 0 ){
+                        numRejected++;
+                        numInHistory += context.history.isMarked(itemKnns[k]);
+                    }
+                }
+            }
+            Stats::add(STAT_NN_CANDIDATES, candidates.size());
+            Stats::add(STAT_NN_DUPLICATES, numRejected - numInHistory);
+            Stats::add(STAT_NN_HISTORY_EXCLUDED, numInHistory);
+        }
 
-            for(size_t n = 0; n < size; ++n){
-                *(m.ptr()+n) = this->factorQ[n/cols][n%cols];
+        // ---------------------------------
+        // scores of context.candidates into context.candidateScores,
+        // in one pass over the gathered rows
+        // ---------------------------------
+        void scoreCandidates(unsigned int user, NNContext& context) const {
+            const vector<unsigned int>& candidates = context.candidates;
+            unsigned int numCandidates = candidates.size();
+            context.candidateRows.resize(numCandidates);
+            context.candidateScores.resize(numCandidates);
+            for(unsigned int c=0; c<numCandidates; c++){
+                context.candidateRows[c] = this->factorQ[candidates[c]];
             }
+            MatrixOps::scoreRows(this->factorP[user], context.candidateRows.data(), numCandidates,
+                                 this->factorQ.getStride(), context.candidateScores.data());
+            context.numScored += numCandidates;
+            context.maxScored = max(context.maxScored, (size_t)numCandidates);
+        }
 
-            return m;
+#ifdef MMFNN_HAS_FLANN
+        // ---------------------------------
+        // flann view of factors
+        // ---------------------------------
+        static flann::Matrix<factor_t> toFlann(const FactorMatrix& factors) {
+
+            // rows are padded, flann follows the stride (in bytes)
+            return flann::Matrix<factor_t>( const_cast<factor_t*>(factors.getData()),
+                                          factors.getNumRows(),
+                                          factors.getNumCols(),
+                                          factors.getStride()*sizeof(factor_t) );
         }
+#endif
 
 
     public:
@@ -71,20 +277,153 @@ class NN{
             unsigned int numItems,
             unsigned int numLatentFactors,
             unsigned int K,
-            double **factorQ,
-            double **factorP,
-            unordered_map<unsigned int, unordered_set<unsigned int>> mapUserHistory) {
+            const FactorMatrix &factorQ,
+            const FactorMatrix &factorP,
+            const UserHistory &userHistory)
+            : factorQ(factorQ), factorP(factorP), userHistory(userHistory) {
 
             this->numUsers = numUsers;
             this->numItems = numItems;
             this->numLatentFactors = numLatentFactors;
             this->K = K;
-            this->factorQ = factorQ;
-            this->factorP = factorP;
-            this->mapUserHistory = mapUserHistory;
-            this->vecScorePairs.resize(numItems);
+            this->knnMetric = KNN_METRIC_L2;
+            this->knns = nullptr;
+            this->candidateBudget = 0;
+            this->seedPolicy = SEED_SCORE;
+            this->seed = 1234;
         }
 
+        // ---------------------------------
+        // metric for buildKnn and indexAndKnn, L2 by default
+        // ---------------------------------
+        void setKnnMetric(KnnMetric knnMetric) {
+            this->knnMetric = knnMetric;
+        }
+
+        KnnMetric getKnnMetric() const {
+            return this->knnMetric;
+        }
+
+        // ---------------------------------
+        // at most candidateBudget candidates per call, 0 for no limit
+        // If the knns of the history may exceed the budget, fewer
+        // neighbors are taken per item (budget/|history| + 1, as an item
+        // is usually its own first neighbor, and at least 2 up to K+1),
+        // at most candidateBudget items are visited in the order of the
+        // seed policy, and gathering stops at the budget. Seed selection
+        // is bounded by the budget as well: SEED_SCORE ranks the
+        // histories of the users over the budget here, once (see
+        // rankSeeds). What remains O(|history|) per call is marking the
+        // history for exclusion, one write per history item.
+        // ---------------------------------
+        void setCandidateBudget(unsigned int candidateBudget, SeedPolicy seedPolicy = SEED_SCORE, unsigned int seed = 1234) {
+            this->candidateBudget = candidateBudget;
+            this->seedPolicy = seedPolicy;
+            this->seed = seed;
+            this->seedOffsets.clear();
+            this->seedItems.clear();
+            if( candidateBudget > 0 && seedPolicy == SEED_SCORE ){
+                this->rankSeeds();
+            }
+        }
+
+        // "highest_id", "score" or "random", SEED_SCORE if unknown
+        static SeedPolicy parseSeedPolicy(const string& name) {
+            if( name == "highest_id" ) return SEED_HIGHEST_ID;
+            if( name == "random" ) return SEED_RANDOM;
+            return SEED_SCORE;
+        }
+
+        // ---------------------------------
+        // Find exact knns by blocked brute force
+        // numThreads == 0 uses all cores
+        // ---------------------------------
+        void buildKnn(unsigned int numThreads = 0) {
+
+            struct timespec start, finish;
+            double elapsed;
+
+            cout << "finding exact knns (" << KnnSpace::name(this->knnMetric) << ") ..." << endl;
+
+            // start elapsed time
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            FactorMatrix data, queries;
+            if( KnnSpace::transform(this->factorQ, this->knnMetric, data, queries) ){
+                vector<unsigned int> allItems(this->numItems);
+                for(unsigned int i=0; i<this->numItems; i++){
+                    allItems[i] = i;
+                }
+                this->ownedKnns = KnnBuilder::exactL2(data, queries, allItems, this->K+1, numThreads);
+            } else {
+                this->ownedKnns = KnnBuilder::exactL2(this->factorQ, this->K+1, numThreads);
+            }
+            this->knns = this->ownedKnns.data();
+
+            // end elapsed time
+            clock_gettime(CLOCK_MONOTONIC, &finish);
+            elapsed = (finish.tv_sec - start.tv_sec);
+            elapsed += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+            cout << "*** NN finding for items - elapsed time :" << elapsed << " sec ***" << endl;
+        }
+
+        // ---------------------------------
+        // Update the knns of a previous model, e.g. after a warm-started
+        // training run, instead of finding them all again
+        // previousKnns are the numItems x (K+1) knns of previousQ under
+        // the same metric; previousQ may have fewer items (appended new
+        // items) or more (dropped from the end of the catalog, their
+        // reverse neighbors are requeried). Items whose factors moved by
+        // more than threshold times their previous norm, their reverse
+        // neighbors and the new items are requeried exactly, see
+        // KnnBuilder::updateL2. With threshold 0 the result equals
+        // buildKnn up to the order of floating-point ties.
+        // ---------------------------------
+        void updateKnn(const FactorMatrix& previousQ, const int* previousKnns, double threshold,
+                       unsigned int numThreads = 0) {
+
+            struct timespec start, finish;
+            double elapsed;
+
+            cout << "updating knns (" << KnnSpace::name(this->knnMetric) << ") ..." << endl;
+
+            // start elapsed time
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            unsigned int numPrevious = min(previousQ.getNumRows(), this->numItems);
+            vector<unsigned int> movedItems;
+            for(unsigned int i=0; i<numPrevious; i++){
+                double change = 0.0;
+                for(unsigned int f=0; f<this->numLatentFactors; f++){
+                    double diff = this->factorQ[i][f] - previousQ[i][f];
+                    change += diff*diff;
+                }
+                if( change > 0.0 && change >= threshold*threshold*MatrixOps::dot(previousQ[i], previousQ[i], this->numLatentFactors) ){
+                    movedItems.push_back(i);
+                }
+            }
+
+            size_t numRequeried = 0;
+            FactorMatrix data, queries;
+            if( KnnSpace::transform(this->factorQ, this->knnMetric, data, queries) ){
+                this->ownedKnns = KnnBuilder::updateL2(data, queries, previousKnns, numPrevious, movedItems,
+                                                       this->K+1, numThreads, &numRequeried);
+            } else {
+                this->ownedKnns = KnnBuilder::updateL2(this->factorQ, this->factorQ, previousKnns, numPrevious, movedItems,
+                                                       this->K+1, numThreads, &numRequeried);
+            }
+            this->knns = this->ownedKnns.data();
+
+            // end elapsed time
+            clock_gettime(CLOCK_MONOTONIC, &finish);
+            elapsed = (finish.tv_sec - start.tv_sec);
+            elapsed += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+            cout << movedItems.size() << " moved and " << this->numItems - numPrevious << " new items, "
+                 << numRequeried << " of " << this->numItems << " items requeried" << endl;
+            cout << "*** NN updating for items - elapsed time :" << elapsed << " sec ***" << endl;
+        }
+
+#ifdef MMFNN_HAS_FLANN
         // ---------------------------------
         // Build index and find knns
         // ---------------------------------
@@ -95,11 +434,16 @@ class NN{
                           int searchNumChecks,
                           int searchNumCores) {
 
+            struct timespec start, finish;
+            double elapsed;
+
             flann::log_verbosity(flann::FLANN_LOG_INFO);
 
-            cout << "converting item factors to flann matrix ..." << endl;
-            // This may be otherwise implemented in production implementations ...
-            flann::Matrix<double> factorQFlann = Q2Flann();
+            // no copy for L2, flann reads the item factors in place
+            FactorMatrix data, queries;
+            bool transformed = KnnSpace::transform(this->factorQ, this->knnMetric, data, queries);
+            flann::Matrix<factor_t> factorQFlann = toFlann(transformed ? data : this->factorQ);
+            flann::Matrix<factor_t> queriesFlann = toFlann(transformed ? queries : this->factorQ);
 
             cout << "building index and finding knns ..." << endl;
 
@@ -114,7 +458,7 @@ class NN{
             clock_gettime(CLOCK_MONOTONIC, &start);
 
             // build index
-            flann::Index<flann::L2<double> > index(factorQFlann, indexParameters);
+            flann::Index<flann::L2<factor_t> > index(factorQFlann, indexParameters);
             index.buildIndex();
 
             // end elapsed time
@@ -123,9 +467,11 @@ class NN{
             elapsed += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
             cout << "*** NN tree building - elapsed time :" << elapsed << " sec ***" << endl;
 
-            // create flann matrices for knn
-            flann::Matrix<int> knns(new int[factorQFlann.rows*(this->K+1)], factorQFlann.rows, this->K+1);
-            flann::Matrix<double> knnDistances(new double[factorQFlann.rows*(this->K+1)], factorQFlann.rows, this->K+1);
+            // create flann matrices for knn, flann writes the knns in place
+            this->ownedKnns.assign(factorQFlann.rows*(this->K+1), -1);
+            flann::Matrix<int> knns(this->ownedKnns.data(), factorQFlann.rows, this->K+1);
+            typedef flann::L2<factor_t>::ResultType DistanceType;
+            flann::Matrix<DistanceType> knnDistances(new DistanceType[factorQFlann.rows*(this->K+1)], factorQFlann.rows, this->K+1);
 
             flann::SearchParams searchParameters = flann::SearchParams();
             searchParameters.checks = searchNumChecks;
@@ -136,7 +482,7 @@ class NN{
 
             // do a knn search
             cout << "doing a knn search ..." << endl;
-            index.knnSearch(factorQFlann, knns, knnDistances, this->K+1, searchParameters);
+            index.knnSearch(queriesFlann, knns, knnDistances, this->K+1, searchParameters);
 
             // end elapsed time
             clock_gettime(CLOCK_MONOTONIC, &finish);
@@ -144,100 +490,130 @@ class NN{
             elapsed += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
             cout << "*** NN finding for items - elapsed time :" << elapsed << " sec ***" << endl;
 
-            delete[] factorQFlann.ptr();
+            delete[] knnDistances.ptr();
 
-            this->knns = knns;
+            this->knns = this->ownedKnns.data();
         }
+#endif
 
         // ---------------------------------
-        // top-N prediction without min. heap
+        // Use precomputed knns, e.g. from a model bundle
+        // numItems x (K+1) row-major, must outlive this object
         // ---------------------------------
-        unsigned int* predictTopN(unsigned int user, unsigned int N){
+        void useKnns(const int* knnTable) {
+            this->ownedKnns.clear();
+            this->knns = knnTable;
+        }
 
-            currentHistoryItems = mapUserHistory[user];
-            unordered_set<unsigned int> unionNeighbors;
+        // ---------------------------------
+        // Take ownership of knns, e.g. from an HNSW index
+        // numItems x (K+1) row-major
+        // ---------------------------------
+        void useKnns(vector<int>&& knnTable) {
+            this->ownedKnns = std::move(knnTable);
+            this->knns = this->ownedKnns.data();
+        }
 
-            for (unsigned int historyItem : currentHistoryItems){
-                for(unsigned int k=0; k<this->K+1;k++){
-                    if (currentHistoryItems.find(this->knns[historyItem][k]) == currentHistoryItems.end() ){
-                        // i.e. exclude items already in history
-                        unionNeighbors.insert(this->knns[historyItem][k]);
-                    }
-                }
+        // numItems x (K+1) row-major, after buildKnn, indexAndKnn or useKnns
+        const int* getKnns() const {
+            return this->knns;
+        }
+
+        // ---------------------------------
+        // top-N (item, score) pairs among the neighbors of the user's
+        // history, best first, written to topN (room for N pairs);
+        // returns their number, less than N if there are fewer candidates
+        // Of equal scores, the smaller item ranks first.
+        // ---------------------------------
+        unsigned int recommend(unsigned int user, unsigned int N, ScorePair* topN, NNContext& context) const {
+
+            StatsTimer timer(STAT_NN_CALL_NS);
+            gatherCandidates(user, context);
+            scoreCandidates(user, context);
+
+            TopKBuffer& topK = context.topK;
+            topK.reset(N);
+            const vector<unsigned int>& candidates = context.candidates;
+            const vector<double>& scores = context.candidateScores;
+            for(unsigned int c=0; c<candidates.size(); c++){
+                topK.push(candidates[c], scores[c]);
             }
 
-            vector<ScorePair> vecScorePairs(unionNeighbors.size());
-            unsigned int ii = 0;
-            for (unsigned int neighbor : unionNeighbors){
-                double score = 0.0;
-                for(unsigned int f=0; f<this->numLatentFactors; f++){
-                    score += factorP[user][f] * factorQ[neighbor][f];
-                }
-                vecScorePairs[ii].index = neighbor;
-                vecScorePairs[ii].value = score;
-                ii++;
+            return topK.extract(topN);
+        }
+
+        // ---------------------------------
+        // top-N prediction without min. heap
+        // returned list is owned by context
+        // ---------------------------------
+        const unsigned int* predictTopN(unsigned int user, unsigned int N, NNContext& context) const {
+
+            StatsTimer timer(STAT_NN_CALL_NS);
+            gatherCandidates(user, context);
+            scoreCandidates(user, context);
+
+            vector<ScorePair>& vecScorePairs = context.vecScorePairs;
+            vecScorePairs.resize(context.candidates.size());
+            for(unsigned int c=0; c<context.candidates.size(); c++){
+                vecScorePairs[c].index = context.candidates[c];
+                vecScorePairs[c].value = context.candidateScores[c];
             }
 
             sort(vecScorePairs.begin(), vecScorePairs.end());
 
             // get top-N
             unsigned int n=0;
-            topNList = new unsigned int[N]();
+            context.topNList.assign(N, 0);
             for(unsigned int i=0; i<vecScorePairs.size(); i++){
                 if( n<N ){
-                    topNList[n] = vecScorePairs[i].index;
+                    context.topNList[n] = vecScorePairs[i].index;
                     n++;
                 } else {
                     break;
                 }
             }
 
-            return topNList;
+            return context.topNList.data();
         }
 
         // ---------------------------------
         // top-N prediction using min. heap
+        // returned list is owned by context
         // ---------------------------------
-        unsigned int* predictTopNWithMinHeap(unsigned int user, unsigned int N){
-
-            currentHistoryItems = mapUserHistory[user];
-
-            unordered_set<unsigned int> unionNeighbors;
-            for (unsigned int historyItem : currentHistoryItems){
-                for(unsigned int k=0; k<this->K+1;k++){
-                    unsigned int neighbor = this->knns[historyItem][k];
-                    if ( currentHistoryItems.find(neighbor) == currentHistoryItems.end() &&
-                        unionNeighbors.find(neighbor) == unionNeighbors.end() ){
-                        // i.e. exclude items already in history, and neighbors that are already handled
-
-                        double score = 0.0;
-                        for(unsigned int f=0; f<this->numLatentFactors; f++){
-                            score += factorP[user][f] * factorQ[neighbor][f];
-                        }
-                        if (pq.size() == N){
-                            if (pq.top().value < score) {
-                                pq.pop();
-                                pq.push({neighbor,score});
-                            }
-                        } else {
-                            pq.push({neighbor,score});
-                        }
-
-                        unionNeighbors.insert(neighbor);
+        const unsigned int* predictTopNWithMinHeap(unsigned int user, unsigned int N, NNContext& context) const {
+
+            StatsTimer timer(STAT_NN_CALL_NS);
+            gatherCandidates(user, context);
+            scoreCandidates(user, context);
+
+            priority_queue<ScorePair>& pq = context.pq;
+            size_t numInserts = 0;
+            for(unsigned int c=0; c<context.candidates.size(); c++){
+                unsigned int neighbor = context.candidates[c];
+                double score = context.candidateScores[c];
+                if (pq.size() == N){
+                    if (pq.top().value < score) {
+                        pq.pop();
+                        pq.push({neighbor,score});
+                        numInserts++;
                     }
+                } else {
+                    pq.push({neighbor,score});
+                    numInserts++;
                 }
             }
+            Stats::add(STAT_TOPK_INSERTS, numInserts);
 
             // get top-N
             unsigned int n=N-1;
-            topNList = new unsigned int[N]();
+            context.topNList.assign(N, 0);
             while( !pq.empty() ) {
-                topNList[n] = pq.top().index;
+                context.topNList[n] = pq.top().index;
                 pq.pop();
                 n--;
             }
 
-            return topNList;
+            return context.topNList.data();
         }
 
 };
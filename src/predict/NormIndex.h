@@ -0,0 +1,101 @@
+#ifndef NORMINDEX_H
+#define NORMINDEX_H
+
+/*
+    Item factors sorted by norm for exact top-N with pruning (LEMP)
+
+    By Cauchy-Schwarz, P[u].Q[i] <= |P[u]|*|Q[i]|. With the rows of Q
+    copied in order of decreasing norm, a scan can stop at the first
+    row whose bound falls below the N-th best score so far: no later
+    row can enter the top-N. Rows that pass are first scored on their
+    head columns, and skipped if
+      head score + |P[u] tail|*|Q[i] tail| < N-th best score.
+    Otherwise the full dot product is computed exactly as in the plain
+    scan, so scores, and hence results, are identical.
+
+    Bounds are widened by the rounding error of a dot product in
+    accum_t, so that a computed score is never above its bound.
+
+    A NormIndex is read-only after construction and can be shared by
+    threads.
+
+    Part of MMFNN guiding code. Provided as is.
+    Tested with C++17 (g++ ver. 12.2)
+ */
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "../common/MatrixOps.h"
+
+using namespace std;
+
+class NormIndex{
+
+    private:
+
+        unsigned int numItems;
+        unsigned int numLatentFactors;
+        unsigned int headSize; // columns scored before the tail bound
+
+        FactorMatrix sortedQ; // rows of Q by decreasing norm
+        vector<unsigned int> items; // item of each row of sortedQ
+        vector<double> norms;
+        vector<double> tailNorms;
+
+    public:
+
+        NormIndex() : numItems(0), numLatentFactors(0), headSize(0) {}
+
+        // ---------------------------------
+        // index of the rows of Q, headSize == 0 uses half the columns
+        // ---------------------------------
+        explicit NormIndex(const FactorMatrix& Q, unsigned int headSize = 0){
+
+            this->numItems = Q.getNumRows();
+            this->numLatentFactors = Q.getNumCols();
+            this->headSize = (headSize > 0) ? min(headSize, this->numLatentFactors) : this->numLatentFactors/2;
+
+            vector<double> itemNorms(this->numItems);
+            for(unsigned int i=0; i<this->numItems; i++){
+                itemNorms[i] = sqrt(MatrixOps::dot(Q[i], Q[i], this->numLatentFactors));
+            }
+
+            this->items.resize(this->numItems);
+            for(unsigned int i=0; i<this->numItems; i++){
+                this->items[i] = i;
+            }
+            stable_sort(this->items.begin(), this->items.end(),
+                        [&itemNorms](unsigned int a, unsigned int b){ return itemNorms[a] > itemNorms[b]; });
+
+            this->sortedQ = FactorMatrix(this->numItems, this->numLatentFactors);
+            this->norms.resize(this->numItems);
+            this->tailNorms.resize(this->numItems);
+            unsigned int tailSize = this->numLatentFactors - this->headSize;
+            for(unsigned int r=0; r<this->numItems; r++){
+                const factor_t* row = Q[this->items[r]];
+                copy(row, row + this->numLatentFactors, this->sortedQ[r]);
+                this->norms[r] = itemNorms[this->items[r]];
+                this->tailNorms[r] = sqrt(MatrixOps::dot(row + this->headSize, row + this->headSize, tailSize));
+            }
+        }
+
+        // ---------------------------------
+        // relative rounding error of a dot product, as a multiple of
+        // |x|*|y|, with a factor 4 for the norms and the partial sums
+        // ---------------------------------
+        double slack() const {
+            return 4.0 * (this->numLatentFactors + 2) * numeric_limits<accum_t>::epsilon();
+        }
+
+        unsigned int getNumItems() const { return this->numItems; }
+        unsigned int getHeadSize() const { return this->headSize; }
+        const FactorMatrix& getSortedQ() const { return this->sortedQ; }
+        unsigned int itemOf(unsigned int row) const { return this->items[row]; }
+        double normOf(unsigned int row) const { return this->norms[row]; }
+        double tailNormOf(unsigned int row) const { return this->tailNorms[row]; }
+
+};
+
+#endif
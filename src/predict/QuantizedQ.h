@@ -0,0 +1,373 @@
+#ifndef QUANTIZEDQ_H
+#define QUANTIZEDQ_H
+
+/*
+    Compressed item factors for approximate scoring
+
+    Two encodings of Q:
+
+      INT8  every row is scaled by max|Q[i][f]|/127 and rounded to
+            int8, a quarter (double: an eighth) of the bytes of Q.
+            The user row is rounded to int16 the same way, to at most
+            queryMax = min(32767, (2^31-1)/(127*numLatentFactors)) so
+            that the int32 sums cannot overflow, and a score is an exact
+            integer dot product times both scales. Past 516 latent
+            factors the user row therefore keeps fewer bits.
+      PQ    the columns are split into numSubspaces contiguous ranges,
+            each with its own 256 k-means centroids; an item is stored
+            as one centroid index (byte) per range. A user gets a lookup
+            table of user.centroid per range and centroid, so an item
+            costs numSubspaces table lookups (ADC).
+
+    The approximate scores are meant for a first pass over the whole
+    catalog, whose best few hundred items are rescored exactly with
+    factorQ, see EP::recommendQuantized.
+
+    A QuantizedQ is read-only after building and can be shared by
+    threads, per-user buffers live in a QuantizedScratch.
+
+    Part of MMFNN guiding code. Provided as is.
+    Tested with C++17 (g++ ver. 12.2)
+ */
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <omp.h>
+#include "../common/MatrixOps.h"
+
+using namespace std;
+
+enum QuantizationMode { QUANT_NONE = 0, QUANT_INT8 = 1, QUANT_PQ = 2 };
+
+// ---------------------------------
+// per-thread scratch for scoring a user
+// ---------------------------------
+struct QuantizedScratch{
+    vector<int16_t> query; // int8 : quantized user row
+    vector<float> table; // pq : lookup table
+};
+
+class QuantizedQ{
+
+    public:
+
+        static const unsigned int PQ_CENTROIDS = 256; // one byte per code
+
+    private:
+
+        typedef void (*Int8Kernel)(const int16_t* query, float queryScale, const int8_t* codes, unsigned int codeStride,
+                                   const float* scales, unsigned int numItems, unsigned int len, float* scores);
+
+        QuantizationMode mode;
+        unsigned int numItems;
+        unsigned int numLatentFactors;
+
+        // int8 : rows of codeStride bytes, zero padded to a cache line,
+        // scored over the first codeLength (a multiple of 16) bytes
+        unsigned int codeStride;
+        unsigned int codeLength;
+        vector<int8_t> codes;
+        vector<float> scales;
+        double queryMax; // largest |query[f]|, keeps the int32 sums in range
+        Int8Kernel int8Kernel;
+
+        // pq : subspace m covers columns subBegins[m] .. subBegins[m+1]-1,
+        // its centroids are numCentroids rows of that length starting at
+        // centroids[subBegins[m]*numCentroids]
+        unsigned int numSubspaces;
+        unsigned int numCentroids;
+        vector<unsigned int> subBegins;
+        vector<float> centroids;
+        vector<uint8_t> pqCodes; // numItems x numSubspaces
+
+        // ---------------------------------
+        // int8 scoring of all items against an int16 query, exact
+        // integer sums, so every kernel gives the same scores
+        // scores[i] = queryScale*scales[i]*(query . codes[i])
+        // ---------------------------------
+        static void int8Generic(const int16_t* query, float queryScale, const int8_t* codes, unsigned int codeStride,
+                                const float* scales, unsigned int numItems, unsigned int len, float* scores){
+            for(unsigned int i=0; i<numItems; i++){
+                const int8_t* row = codes + (size_t)i*codeStride;
+                int32_t s = 0;
+                for(unsigned int f=0; f<len; f++){
+                    s += (int32_t)query[f]*row[f];
+                }
+                scores[i] = (float)s*scales[i]*queryScale;
+            }
+        }
+
+#ifdef MMFNN_X86_SIMD
+        // 4 items per pass, 16 codes per step, len must be a multiple of 16
+        __attribute__((target("avx2,fma")))
+        static void int8AVX2(const int16_t* query, float queryScale, const int8_t* codes, unsigned int codeStride,
+                             const float* scales, unsigned int numItems, unsigned int len, float* scores){
+            unsigned int i = 0;
+            __m128 qs = _mm_set1_ps(queryScale);
+            for(; i+4<=numItems; i+=4){
+                const int8_t *r0 = codes + (size_t)i*codeStride, *r1 = r0 + codeStride,
+                             *r2 = r1 + codeStride, *r3 = r2 + codeStride;
+                __m256i s0 = _mm256_setzero_si256(), s1 = _mm256_setzero_si256(),
+                        s2 = _mm256_setzero_si256(), s3 = _mm256_setzero_si256();
+                for(unsigned int f=0; f<len; f+=16){
+                    __m256i q = _mm256_loadu_si256((const __m256i*)(query+f));
+                    s0 = _mm256_add_epi32(s0, _mm256_madd_epi16(q, _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(r0+f)))));
+                    s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(q, _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(r1+f)))));
+                    s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(q, _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(r2+f)))));
+                    s3 = _mm256_add_epi32(s3, _mm256_madd_epi16(q, _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(r3+f)))));
+                }
+                // per 128-bit lane [s0, s1, s2, s3] partial sums, then both lanes
+                __m256i h = _mm256_hadd_epi32(_mm256_hadd_epi32(s0, s1), _mm256_hadd_epi32(s2, s3));
+                __m128i sums = _mm_add_epi32(_mm256_castsi256_si128(h), _mm256_extracti128_si256(h, 1));
+                __m128 result = _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(sums), _mm_loadu_ps(scales+i)), qs);
+                _mm_storeu_ps(scores+i, result);
+            }
+            int8Generic(query, queryScale, codes + (size_t)i*codeStride, codeStride,
+                        scales+i, numItems-i, len, scores+i);
+        }
+#endif
+
+        static Int8Kernel pickInt8Kernel(){
+#ifdef MMFNN_X86_SIMD
+            const char* level = MatrixOps::simdLevel();
+            if( strcmp(level, "avx512") == 0 || strcmp(level, "avx2") == 0 ) return &int8AVX2;
+#endif
+            return &int8Generic;
+        }
+
+        // ---------------------------------
+        // nearest centroid of subspace m for a row of Q
+        // ---------------------------------
+        unsigned int nearestCentroid(const factor_t* row, unsigned int m) const {
+            unsigned int begin = this->subBegins[m];
+            unsigned int dim = this->subBegins[m+1] - begin;
+            const float* base = &this->centroids[(size_t)begin*this->numCentroids];
+            unsigned int best = 0;
+            float bestDistance = numeric_limits<float>::max();
+            for(unsigned int c=0; c<this->numCentroids; c++){
+                const float* centroid = base + (size_t)c*dim;
+                float distance = 0.0f;
+                for(unsigned int d=0; d<dim; d++){
+                    float diff = (float)row[begin+d] - centroid[d];
+                    distance += diff*diff;
+                }
+                if( distance < bestDistance ){
+                    bestDistance = distance;
+                    best = c;
+                }
+            }
+            return best;
+        }
+
+    public:
+
+        QuantizedQ() : mode(QUANT_NONE), numItems(0), numLatentFactors(0), codeStride(0), codeLength(0),
+                       queryMax(32767.0), int8Kernel(nullptr), numSubspaces(0), numCentroids(0) {}
+
+        // ---------------------------------
+        // per-row int8 scalar quantization of Q
+        // ---------------------------------
+        void buildInt8(const FactorMatrix& Q){
+
+            this->mode = QUANT_INT8;
+            this->numItems = Q.getNumRows();
+            this->numLatentFactors = Q.getNumCols();
+            this->codeStride = (this->numLatentFactors + 63) / 64 * 64;
+            this->codeLength = (this->numLatentFactors + 15) / 16 * 16;
+            this->codes.assign((size_t)this->numItems*this->codeStride, 0);
+            this->scales.assign(this->numItems, 0.0f);
+            this->queryMax = min(32767.0, floor(2147483647.0/(127.0*max(this->numLatentFactors, 1u))));
+            this->int8Kernel = pickInt8Kernel();
+
+            for(unsigned int i=0; i<this->numItems; i++){
+                double maxAbs = 0.0;
+                for(unsigned int f=0; f<this->numLatentFactors; f++){
+                    maxAbs = max(maxAbs, fabs((double)Q[i][f]));
+                }
+                if( maxAbs == 0.0 ){
+                    continue;
+                }
+                double scale = maxAbs/127.0;
+                int8_t* row = &this->codes[(size_t)i*this->codeStride];
+                for(unsigned int f=0; f<this->numLatentFactors; f++){
+                    row[f] = (int8_t)lround(Q[i][f]/scale);
+                }
+                this->scales[i] = scale;
+            }
+        }
+
+        // ---------------------------------
+        // product quantization of Q, numSubspaces <= columns of Q
+        // centroids are trained by numIterations rounds of k-means on at
+        // most trainSize items drawn with seed
+        // numThreads == 0 uses all cores
+        // ---------------------------------
+        void buildPQ(const FactorMatrix& Q, unsigned int numSubspaces, unsigned int numIterations = 10,
+                     unsigned int trainSize = 65536, unsigned int seed = 1234, unsigned int numThreads = 0){
+
+            this->mode = QUANT_PQ;
+            this->numItems = Q.getNumRows();
+            this->numLatentFactors = Q.getNumCols();
+            this->numSubspaces = max(1u, min(numSubspaces, this->numLatentFactors));
+            this->numCentroids = min((unsigned int)PQ_CENTROIDS, this->numItems);
+
+            this->subBegins.resize(this->numSubspaces+1);
+            for(unsigned int m=0; m<=this->numSubspaces; m++){
+                this->subBegins[m] = (unsigned int)((size_t)m*this->numLatentFactors/this->numSubspaces);
+            }
+            this->centroids.clear();
+            this->pqCodes.clear();
+            if( this->numItems == 0 ){
+                return; // no centroids, nothing to score
+            }
+
+            // training rows, a seeded random subset if Q is large
+            vector<unsigned int> trainItems(this->numItems);
+            for(unsigned int i=0; i<this->numItems; i++){
+                trainItems[i] = i;
+            }
+            mt19937 generator(seed);
+            shuffle(trainItems.begin(), trainItems.end(), generator);
+            trainItems.resize(min<size_t>(trainItems.size(), max(trainSize, this->numCentroids)));
+            unsigned int numTrain = trainItems.size();
+
+            // initial centroids are the first training rows
+            this->centroids.assign((size_t)this->numCentroids*this->numLatentFactors, 0.0f);
+            for(unsigned int m=0; m<this->numSubspaces; m++){
+                unsigned int begin = this->subBegins[m];
+                unsigned int dim = this->subBegins[m+1] - begin;
+                float* base = &this->centroids[(size_t)begin*this->numCentroids];
+                for(unsigned int c=0; c<this->numCentroids; c++){
+                    for(unsigned int d=0; d<dim; d++){
+                        base[(size_t)c*dim+d] = Q[trainItems[c]][begin+d];
+                    }
+                }
+            }
+
+            unsigned int threads = (numThreads > 0) ? numThreads : omp_get_max_threads();
+            vector<unsigned int> assignment((size_t)numTrain*this->numSubspaces);
+            for(unsigned int it=0; it<numIterations; it++){
+
+                #pragma omp parallel for num_threads(threads) schedule(static)
+                for(long long t=0; t<numTrain; t++){
+                    for(unsigned int m=0; m<this->numSubspaces; m++){
+                        assignment[(size_t)t*this->numSubspaces+m] = nearestCentroid(Q[trainItems[t]], m);
+                    }
+                }
+
+                // new means, an empty cluster keeps its centroid
+                #pragma omp parallel for num_threads(threads) schedule(dynamic)
+                for(unsigned int m=0; m<this->numSubspaces; m++){
+                    unsigned int begin = this->subBegins[m];
+                    unsigned int dim = this->subBegins[m+1] - begin;
+                    float* base = &this->centroids[(size_t)begin*this->numCentroids];
+                    vector<double> sums((size_t)this->numCentroids*dim, 0.0);
+                    vector<unsigned int> counts(this->numCentroids, 0);
+                    for(unsigned int t=0; t<numTrain; t++){
+                        unsigned int c = assignment[(size_t)t*this->numSubspaces+m];
+                        const factor_t* row = Q[trainItems[t]];
+                        for(unsigned int d=0; d<dim; d++){
+                            sums[(size_t)c*dim+d] += row[begin+d];
+                        }
+                        counts[c]++;
+                    }
+                    for(unsigned int c=0; c<this->numCentroids; c++){
+                        if( counts[c] == 0 ){
+                            continue;
+                        }
+                        for(unsigned int d=0; d<dim; d++){
+                            base[(size_t)c*dim+d] = sums[(size_t)c*dim+d]/counts[c];
+                        }
+                    }
+                }
+            }
+
+            // encode all items
+            this->pqCodes.resize((size_t)this->numItems*this->numSubspaces);
+            #pragma omp parallel for num_threads(threads) schedule(static)
+            for(long long i=0; i<this->numItems; i++){
+                for(unsigned int m=0; m<this->numSubspaces; m++){
+                    this->pqCodes[(size_t)i*this->numSubspaces+m] = (uint8_t)nearestCentroid(Q[i], m);
+                }
+            }
+        }
+
+        // ---------------------------------
+        // approximate scores of a user row against all items
+        // scratch is per-thread, scores receives numItems values
+        // ---------------------------------
+        void score(const factor_t* user, QuantizedScratch& scratch, float* scores) const {
+
+            if( this->mode == QUANT_INT8 ){
+                // the user row as int16, scaled like the item rows
+                double maxAbs = 0.0;
+                for(unsigned int f=0; f<this->numLatentFactors; f++){
+                    maxAbs = max(maxAbs, fabs((double)user[f]));
+                }
+                double queryScale = maxAbs/this->queryMax;
+                scratch.query.assign(this->codeLength, 0);
+                if( maxAbs > 0.0 ){
+                    for(unsigned int f=0; f<this->numLatentFactors; f++){
+                        scratch.query[f] = (int16_t)lround(user[f]/queryScale);
+                    }
+                }
+                this->int8Kernel(scratch.query.data(), queryScale, this->codes.data(), this->codeStride,
+                                 this->scales.data(), this->numItems, this->codeLength, scores);
+                return;
+            }
+
+            if( this->mode == QUANT_PQ ){
+                vector<float>& table = scratch.table;
+                // lookup table, user.centroid per subspace and centroid
+                table.resize((size_t)this->numSubspaces*this->numCentroids);
+                for(unsigned int m=0; m<this->numSubspaces; m++){
+                    unsigned int begin = this->subBegins[m];
+                    unsigned int dim = this->subBegins[m+1] - begin;
+                    const float* base = &this->centroids[(size_t)begin*this->numCentroids];
+                    float* lut = &table[(size_t)m*this->numCentroids];
+                    for(unsigned int c=0; c<this->numCentroids; c++){
+                        float s = 0.0f;
+                        for(unsigned int d=0; d<dim; d++){
+                            s += (float)user[begin+d]*base[(size_t)c*dim+d];
+                        }
+                        lut[c] = s;
+                    }
+                }
+
+                const float* lut = table.data();
+                const uint8_t* code = this->pqCodes.data();
+                for(unsigned int i=0; i<this->numItems; i++, code+=this->numSubspaces){
+                    float s = 0.0f;
+                    for(unsigned int m=0; m<this->numSubspaces; m++){
+                        s += lut[(size_t)m*this->numCentroids + code[m]];
+                    }
+                    scores[i] = s;
+                }
+            }
+        }
+
+        QuantizationMode getMode() const { return this->mode; }
+        unsigned int getNumItems() const { return this->numItems; }
+
+        // ---------------------------------
+        // size of the encoded items in bytes, codebooks included
+        // ---------------------------------
+        size_t getBytes() const {
+            if( this->mode == QUANT_INT8 ){
+                return this->codes.size() + this->scales.size()*sizeof(float);
+            }
+            if( this->mode == QUANT_PQ ){
+                return this->pqCodes.size() + this->centroids.size()*sizeof(float);
+            }
+            return 0;
+        }
+
+};
+
+#endif
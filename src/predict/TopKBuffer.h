@@ -0,0 +1,118 @@
+#ifndef TOPKBUFFER_H
+#define TOPKBUFFER_H
+
+/*
+    Fixed-capacity top-k selection of (item, score) pairs
+
+    Pairs are appended to a buffer of 2k slots. When it is full,
+    nth_element keeps the best k and their worst pair becomes the
+    bound; later pairs that do not beat the bound are rejected by one
+    comparison. A push is thus a compare and a store, and selection
+    costs O(1) amortized per pair instead of the O(log k) sift of a
+    heap. The bound is also set as soon as the first k pairs are in.
+
+    Pairs are ordered by ScoreIndexOrder (higher score first, the
+    smaller item on ties), so the result does not depend on the order
+    of the pushes.
+
+    No allocation after the first reset() to a given k.
+
+    Part of MMFNN guiding code. Provided as is.
+    Tested with C++17 (g++ ver. 12.2)
+ */
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include "helper.h"
+#include "../common/Stats.h"
+
+using namespace std;
+
+class TopKBuffer{
+
+    private:
+
+        vector<ScorePair> entries;
+        unsigned int k;
+        unsigned int size;
+        ScorePair bound; // k-th best pair after the last compaction, -infinity before
+        bool bounded;
+
+        // ---------------------------------
+        // keep the best k pairs, their worst one is the new bound
+        // ---------------------------------
+        void compact(){
+            nth_element(this->entries.begin(), this->entries.begin() + (this->k-1),
+                        this->entries.begin() + this->size, ScoreIndexOrder());
+            this->size = this->k;
+            this->bound = this->entries[this->k-1];
+        }
+
+    public:
+
+        TopKBuffer() : k(0), size(0), bound({numeric_limits<unsigned int>::max(), -numeric_limits<double>::infinity()}),
+                       bounded(false) {}
+
+        // ---------------------------------
+        // empty buffer for the best k pairs
+        // ---------------------------------
+        void reset(unsigned int k){
+            this->k = k;
+            this->size = 0;
+            this->bounded = false;
+            this->bound = {numeric_limits<unsigned int>::max(), -numeric_limits<double>::infinity()};
+            if( this->entries.size() < 2*(size_t)k ){
+                this->entries.resize(2*(size_t)k);
+            }
+        }
+
+        // ---------------------------------
+        // true if (item, score) may still be among the best k
+        // ---------------------------------
+        inline bool accepts(unsigned int item, double score) const {
+            return score > this->bound.value || (score == this->bound.value && item < this->bound.index);
+        }
+
+        inline void push(unsigned int item, double score){
+            if( this->k == 0 || !accepts(item, score) ){
+                return;
+            }
+            Stats::add(STAT_TOPK_INSERTS);
+            this->entries[this->size++] = {item, score};
+            if( this->size == 2*this->k ){
+                compact();
+            } else if( !this->bounded && this->size == this->k ){
+                this->bound = *max_element(this->entries.begin(), this->entries.begin() + this->size, ScoreIndexOrder());
+                this->bounded = true;
+            }
+        }
+
+        // ---------------------------------
+        // once k pairs are in, no pair scoring below this can enter
+        // (a lower bound of the k-th best score), else -infinity
+        // ---------------------------------
+        inline bool isBounded() const {
+            return this->bounded;
+        }
+
+        inline double threshold() const {
+            return this->bound.value;
+        }
+
+        // ---------------------------------
+        // writes the best min(k, pairs pushed) pairs to out, best first,
+        // and returns their number; the buffer is empty afterwards
+        // ---------------------------------
+        unsigned int extract(ScorePair* out){
+            unsigned int n = min(this->size, this->k);
+            partial_sort(this->entries.begin(), this->entries.begin() + n,
+                         this->entries.begin() + this->size, ScoreIndexOrder());
+            copy(this->entries.begin(), this->entries.begin() + n, out);
+            reset(this->k);
+            return n;
+        }
+
+};
+
+#endif
@@ -3,18 +3,20 @@
 
 /*
     Common helper structs 
-    + functions for file reading
+    + functions for file reading (parallel, see TextReader)
 
     Part of MMFNN guiding code. Provided as is.
-    Tested with C++11 (g++ ver. 4.9.4)
+    Tested with C++17 (g++ ver. 12.2)
 */
 
 #include <iostream>
-#include <fstream>
-#include <sstream>
 #include <vector>
-#include <unordered_map>
-#include <unordered_set>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include "../common/FactorMatrix.h"
+#include "../common/UserHistory.h"
+#include "../common/TextReader.h"
 
 using namespace std;
 
@@ -37,93 +39,76 @@ struct ScorePair{
     }
 };
 
-// for measuring elapsed time
-struct timespec start, finish;
-double elapsed;
+// (score, index) order, higher score first and the smaller index on
+// ties, as a priority_queue comparator it keeps the worst pair on top
+struct ScoreIndexOrder{
+    bool operator()(const ScorePair& a, const ScorePair& b) const {
+        return a.value > b.value || (a.value == b.value && a.index < b.index);
+    }
+};
 
 // ---------------------------------
 // File reading stuff
 // ---------------------------------
 
-// a few variables useful for file reading
-string line, field;
-unsigned int ee, uu, ii, ff, columnNumber;
-
-// reading factors
-double** getFactors(string dataFactors, unsigned int numEntities, unsigned int numLatentFactors){
-    double **factors = new double*[numEntities];
-    ifstream ifs(dataFactors);
-    if(ifs.is_open()){
-        ee = 0;
-        while(getline(ifs, line)){
-            factors[ee] = new double[numLatentFactors];
-            istringstream iss(line);
-            ff = 0;
-            while (getline(iss, field, ',')){
-                factors[ee][ff] = stod(field);
-                ff++;
-            }
-            ee++;
+// reading factors, one comma separated row per line; empty if the file
+// does not have numEntities rows of numLatentFactors numbers
+FactorMatrix getFactors(string dataFactors, unsigned int numEntities, unsigned int numLatentFactors){
+    TextReader reader;
+    if(!reader.open(dataFactors)){
+        return FactorMatrix();
+    }
+    if(reader.getNumLines() != numEntities){
+        cout << "ERROR: " << dataFactors << " has " << reader.getNumLines() << " rows instead of " << numEntities << endl;
+        return FactorMatrix();
+    }
+    FactorMatrix factors(numEntities, numLatentFactors);
+    atomic<size_t> numBadRows(0);
+    reader.parseLines([&](size_t ee, const char* begin, const char* end){
+        unsigned int numRead = TextReader::parseRow(begin, end, ',', factors[ee], numLatentFactors);
+        if(numRead != numLatentFactors || (unsigned int)count(begin, end, ',') != numLatentFactors-1){
+            numBadRows++;
         }
-    } else {
-        cout << "ERROR: Unable to open file " << dataFactors << endl;
+    });
+    if(numBadRows > 0){
+        cout << "ERROR: " << numBadRows << " rows of " << dataFactors << " do not have "
+             << numLatentFactors << " latent factors" << endl;
+        return FactorMatrix();
     }
 
     return factors;
 }
 
-// reading user histories
-unordered_map<unsigned int, unordered_set<unsigned int>> getUserHistory(string dataUserHistory){
-    unordered_map<unsigned int, unordered_set<unsigned int>> mapUserHistory;
-    ifstream ifs(dataUserHistory);
-    if(ifs.is_open()){
-        while(getline(ifs, line)){
-            istringstream iss(line);
-            unordered_set<unsigned int> setHistoryItems;
-            columnNumber = 0;
-            while (getline(iss, field, '\t')){
-                if(columnNumber == 0){
-                    uu = stoi(field);
-                } else {
-                    stringstream ss(field);
-                    while(ss.good()){
-                        string historyItem;
-                        getline(ss, historyItem, ',');
-                        setHistoryItems.insert(stoi(historyItem));
-                    }
-                }
-                columnNumber++;
-            }
-            mapUserHistory[uu] = setHistoryItems;
-        }
-    } else {
-        cout << "ERROR: Unable to open file " << dataUserHistory << endl;
-    }
-
-    return mapUserHistory;
+// reading user histories, "user<TAB>item,item,..." per line; items
+// >= numItems are dropped
+UserHistory getUserHistory(string dataUserHistory, unsigned int numUsers, unsigned int numItems){
+    return UserHistory::read(dataUserHistory, numUsers, numItems);
 }
 
-// reading test data
+// reading test data, lines without a user and an item are dropped
 vector<UIPair> getTestData(string dataTest, int userIndex, int itemIndex, char delimiter){
+    const unsigned int noId = numeric_limits<unsigned int>::max();
     vector<UIPair> vecTestPairs;
-    ifstream ifs(dataTest);
-    if(ifs.is_open()){
-        while(getline(ifs, line)){
-            istringstream iss(line);
-            UIPair lp;
-            columnNumber = 0;
-            while (getline(iss, field, delimiter)){
-                if(columnNumber == userIndex){
-                    lp.user = stoi(field);
-                } else if(columnNumber == itemIndex){
-                    lp.item = stoi(field);
-                }
-                columnNumber++;
+    TextReader reader;
+    if(reader.open(dataTest)){
+        const int columnIndexes[2] = {userIndex, itemIndex};
+        vecTestPairs.resize(reader.getNumLines());
+        reader.parseLines([&](size_t ll, const char* begin, const char* end){
+            unsigned int values[2] = {noId, noId};
+            if(TextReader::parseColumns(begin, end, delimiter, columnIndexes, 2, values) < 2){
+                values[0] = values[1] = noId;
             }
-            vecTestPairs.push_back(lp);
-        }
-    } else {
-        cout << "ERROR: Unable to open file " << dataTest << endl;
+            vecTestPairs[ll].user = values[0];
+            vecTestPairs[ll].item = values[1];
+        });
+    }
+
+    size_t numLines = vecTestPairs.size();
+    vecTestPairs.erase(remove_if(vecTestPairs.begin(), vecTestPairs.end(), [&](const UIPair& lp){
+        return lp.user == noId || lp.item == noId;
+    }), vecTestPairs.end());
+    if(vecTestPairs.size() < numLines){
+        cout << "WARNING: " << numLines - vecTestPairs.size() << " malformed lines in " << dataTest << " skipped" << endl;
     }
 
     return vecTestPairs;
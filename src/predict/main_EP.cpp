@@ -1,15 +1,17 @@
 /*
     Tester for prediction with EP
 
-    To compile : g++-4.9 -O3 -std=c++11 main_EP.cpp -o main_EP.x
+    To compile : g++ -O3 -std=c++17 main_EP.cpp -fopenmp -o main_EP.x
 
     Part of MMFNN guiding code. Provided as is.
-    Tested with C++11 (g++ ver. 4.9.4)
+    Tested with C++17 (g++ ver. 12.2)
 
 */
 
 # include <iostream>
+#include <omp.h>
 #include "helper.h"
+#include "../common/ModelBundle.h"
 #include "EP.h"
 
 using namespace std;
@@ -26,6 +28,9 @@ int main(){
     string userHistoryFile = "../mf/BPRMF/output/ml1m/userHistory.csv";
     string testFile = "../../data/ml1m/test.csv";
 
+    // binary model bundle from the trainer, the CSV files above are read if it cannot be opened
+    string modelBundleFile = "../mf/BPRMF/output/ml1m/model.bin";
+
     unsigned int numUsers = 6040;
     unsigned int numItems = 3952;
     unsigned int numLatentFactors = 40;
@@ -34,18 +39,59 @@ int main(){
     unsigned int N = 10;
     unsigned int reportEvery = 1000;
 
+    // > 0 : score test users in blocks of this size with predictTopNBatch
+    unsigned int userBatchSize = 0;
+
+    // approximate first pass over a compressed Q : "none", "int8" or "pq",
+    // the best rerankSize items of a user are then scored with factorQ
+    string quantization = "none";
+    unsigned int rerankSize = 200;
+    unsigned int pqNumSubspaces = 10; // 256 centroids each
+    unsigned int pqNumIterations = 10;
+
+    // exact top-N that skips items by norm bounds, see NormIndex
+    bool normPruning = false;
+
+    // evaluation threads, 0 uses all cores
+    unsigned int numThreads = 0;
+
+    // counters and latency histograms, when compiled with -DMMFNN_STATS
+    string statsFile = "stats_EP.json";
+
     // ---------------------------------
     // Reading data
     // ---------------------------------
-    cout << "reading item factors ..." << endl;
-    double **factorQ = getFactors(factorQFile, numItems, numLatentFactors);
+    Stats::install(statsFile);
+
+    ModelBundle bundle;
+    FactorMatrix factorQ, factorP;
+    UserHistory userHistory;
+    if( !modelBundleFile.empty() && bundle.open(modelBundleFile) ){
+
+        cout << "mapping model bundle ..." << endl;
+        numUsers = bundle.getNumUsers();
+        numItems = bundle.getNumItems();
+        numLatentFactors = bundle.getNumLatentFactors();
+        factorQ = bundle.getQ();
+        factorP = bundle.getP();
+        userHistory = bundle.getUserHistory();
+
+    } else {
+
+        cout << "reading item factors ..." << endl;
+        factorQ = getFactors(factorQFile, numItems, numLatentFactors);
 
-    cout << "reading user factors ..." << endl;
-    double **factorP = getFactors(factorPFile, numUsers, numLatentFactors);
+        cout << "reading user factors ..." << endl;
+        factorP = getFactors(factorPFile, numUsers, numLatentFactors);
 
-    cout << "reading user histories ..." << endl;
-    unordered_map<unsigned int, unordered_set<unsigned int>> mapUserHistory = 
-        getUserHistory(userHistoryFile);
+        if( factorQ.getNumRows() == 0 || factorP.getNumRows() == 0 ){
+            return 1;
+        }
+
+        cout << "reading user histories ..." << endl;
+        userHistory = getUserHistory(userHistoryFile, numUsers, numItems);
+
+    }
 
     cout << "reading test data ..." << endl;
     int userIndex = 0, itemIndex = 1;
@@ -55,52 +101,139 @@ int main(){
     // ---------------------------------
     // top-N Predictions
     // ---------------------------------
+    QuantizedQ quantizedQ;
+    if( quantization == "int8" || quantization == "pq" ){
+
+        cout << "quantizing item factors (" << quantization << ") ..." << endl;
+        struct timespec start, finish;
+        double elapsed;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if( quantization == "int8" ){
+            quantizedQ.buildInt8(factorQ);
+        } else {
+            quantizedQ.buildPQ(factorQ, pqNumSubspaces, pqNumIterations);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        elapsed = (finish.tv_sec - start.tv_sec);
+        elapsed += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+        cout << "*** Quantization - elapsed time : " << elapsed << " sec ***" << endl;
+        cout << "quantized Q : " << quantizedQ.getBytes() << " bytes, factorQ : "
+             << (size_t)numItems*numLatentFactors*sizeof(factor_t) << " bytes" << endl;
+
+    }
+
+    NormIndex normIndex;
+    if( normPruning ){
+        cout << "sorting item factors by norm ..." << endl;
+        normIndex = NormIndex(factorQ);
+    }
+
     cout << "predicting ..." << endl;
-    EP ep(numUsers, numItems, numLatentFactors, factorQ, factorP, mapUserHistory);
+    EP ep(numUsers, numItems, numLatentFactors, factorQ, factorP, userHistory);
     unsigned int hits = 0;
     unsigned int numRecs = 0;
     double mrr = 0.0;
+    size_t numScored = 0;
+
+    if( numThreads > 0 ){
+        omp_set_num_threads(numThreads);
+    }
+
+    // only users with a history are predicted
+    vector<UIPair> vecEvalPairs;
+    for(UIPair& lp : vecTestPairs){
+        if( userHistory.hasHistory(lp.user) ){
+            vecEvalPairs.push_back(lp);
+        }
+    }
+    long long numEvalPairs = vecEvalPairs.size();
 
     // start elapsed time
+    struct timespec start, finish;
+    double elapsed;
     clock_gettime(CLOCK_MONOTONIC, &start);
 
-    // start evaluation
-    unsigned int iterCount = 0;
-    unsigned int *topNList; // holds top-N list for a user
-    for(UIPair& lp : vecTestPairs){
+    // start evaluation, ep is shared and each thread has its own context
+    #pragma omp parallel reduction(+:hits,numRecs,mrr,numScored)
+    {
+        EPContext context;
+        vector<ScorePair> topN(N);
 
-        auto search = mapUserHistory.find(lp.user);
-        if( search != mapUserHistory.end() ){
+        if( userBatchSize > 0 ){
 
-            topNList = ep.predictTopNWithMinHeap(lp.user, N);
+            vector<unsigned int> batchUsers(userBatchSize);
+            vector<unsigned int> batchTopNLists((size_t)userBatchSize*N);
 
-            // *** This section can be commented if measuring execution time
-            for(unsigned int n=0; n<N; n++){
-                if(lp.item == topNList[n]){
-                    hits++;
-                    mrr += 1.0/(n+1);
+            #pragma omp for schedule(dynamic)
+            for(long long b0=0; b0<numEvalPairs; b0+=userBatchSize){
+                unsigned int numBatchUsers = min((long long)userBatchSize, numEvalPairs-b0);
+                for(unsigned int b=0; b<numBatchUsers; b++){
+                    batchUsers[b] = vecEvalPairs[b0+b].user;
+                }
+
+                ep.predictTopNBatch(batchUsers.data(), numBatchUsers, N, batchTopNLists.data(), context);
+
+                for(unsigned int b=0; b<numBatchUsers; b++){
+                    const unsigned int* topNList = &batchTopNLists[(size_t)b*N];
+                    for(unsigned int n=0; n<N; n++){
+                        if(vecEvalPairs[b0+b].item == topNList[n]){
+                            hits++;
+                            mrr += 1.0/(n+1);
+                        }
+                    }
+                    numRecs++;
+                }
+            }
+
+        } else {
+
+            #pragma omp for schedule(dynamic, 16)
+            for(long long p=0; p<numEvalPairs; p++){
+                const UIPair& lp = vecEvalPairs[p];
+
+                unsigned int numFound;
+                if( quantizedQ.getMode() != QUANT_NONE ){
+                    numFound = ep.recommendQuantized(lp.user, N, quantizedQ, rerankSize, topN.data(), context);
+                } else if( normPruning ){
+                    numFound = ep.recommendPruned(lp.user, N, normIndex, topN.data(), context);
+                } else {
+                    numFound = ep.recommend(lp.user, N, topN.data(), context);
+                }
+
+                // *** This section can be commented if measuring execution time
+                for(unsigned int n=0; n<numFound; n++){
+                    if(lp.item == topN[n].index){
+                        hits++;
+                        mrr += 1.0/(n+1);
+                    }
+                }
+                numRecs++;
+                // *** End of section
+
+                if(p%reportEvery == 0){
+                    #pragma omp critical
+                    cout << "tested: " << p << endl;
                 }
             }
-            numRecs++;
-            // *** End of section
 
         }
-        if(iterCount%reportEvery == 0){
-            cout << "tested: " << iterCount << endl;
-        }
-        iterCount++;
+        numScored += context.numScored;
     }
 
     // end elapsed time
     clock_gettime(CLOCK_MONOTONIC, &finish);
     elapsed = (finish.tv_sec - start.tv_sec);
     elapsed += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
-    cout << "*** top-N prediction - elapsed time : " << elapsed << " sec ***" << endl;
+    cout << "*** top-N prediction - elapsed time : " << elapsed << " sec ("
+         << omp_get_max_threads() << " threads) ***" << endl;
 
     // communicate some more results
     cout << "num recs = " << numRecs << endl;
     cout << "hit rate = " << 1.*hits/numRecs << endl;
     cout << "mrr = " << mrr/numRecs << endl;
+    if( normPruning ){
+        cout << "items scored per rec = " << 1.*numScored/numRecs << " of " << numItems << endl;
+    }
 
     return 0;
 }
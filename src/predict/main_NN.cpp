@@ -1,20 +1,24 @@
 /*
     Tester for prediction with MMFNN
 
-    Requires FLANN to be pre-installed. See:
+    Knns are found exactly by default. FLANN is optional, see:
     - https://github.com/mariusmuja/flann
     - http://www.cs.ubc.ca/research/flann
 
-    To compile : g++-4.9 -O3 -std=c++11 -I $FLANN_ROOT/include  main_NN.cpp -fopenmp -o main_NN.x
+    To compile : g++ -O3 -std=c++17 main_NN.cpp -fopenmp -o main_NN.x
+    with FLANN : g++ -O3 -std=c++17 -I $FLANN_ROOT/include  main_NN.cpp -fopenmp -o main_NN.x
 
     Part of MMFNN guiding code. Provided as is.
-    Tested with C++11 (g++ ver. 4.9.4) and flann-1.8.4
+    Tested with C++17 (g++ ver. 12.2), optionally FLANN API of flann-1.8.4
 
 */
 
 # include <iostream>
+#include <omp.h>
 #include "helper.h"
+#include "../common/ModelBundle.h"
 #include "NN.h"
+#include "HNSW.h"
 
 using namespace std;
 
@@ -30,10 +34,29 @@ int main(){
     string userHistoryFile = "../mf/BPRMF/output/ml1m/userHistory.csv";
     string testFile = "../../data/ml1m/test.csv";
 
+    // binary model bundle from the trainer, the CSV files above are read if it cannot be opened
+    string modelBundleFile = "../mf/BPRMF/output/ml1m/model.bin";
+
     unsigned int numUsers = 6040;
     unsigned int numItems = 3952;
     unsigned int numLatentFactors = 40;
 
+    // knn method : "exact" (built-in), "hnsw" or "flann"
+    string knnMethod = "exact";
+    unsigned int knnNumThreads = 0; // use 0 for all cores
+
+    // knn metric : "l2", "mips" (inner product, as used for ranking) or "cosine"
+    string knnMetricName = "l2";
+    KnnMetric knnMetric = KnnSpace::parse(knnMetricName);
+
+    // hnsw params, the graph is loaded from hnswFile if it was built on these factors (checksum)
+    unsigned int hnswM = 16;
+    unsigned int hnswEfConstruction = 200;
+    unsigned int hnswEfSearch = 64;
+    string hnswFile = "../mf/BPRMF/output/ml1m/hnsw_" + knnMetricName + ".bin";
+    unsigned int recallSampleSize = 1000; // items checked against exact knns, 0 for none
+
+#ifdef MMFNN_HAS_FLANN
     // nn index params
     flann::flann_algorithm_t algorithm = flann::FLANN_INDEX_KDTREE; // KDTREE or KMEANS
     int kdtreeNumTrees = 8;
@@ -41,26 +64,68 @@ int main(){
     int kmeansNumIterations = 5;
 
     // nn search params
-    int K = 10; // for K nearest neighbors
     int searchNumChecks = 128;
     int searchNumCores = 2; // use 0 for all cores
+#endif
+
+    unsigned int K = 10; // for K nearest neighbors
+
+    // a previous model bundle with knns of the same K and metric, e.g. before a warm-started
+    // training run: only the items whose factors moved by more than knnUpdateThreshold times
+    // their norm, their reverse neighbors and new items are requeried. Empty to find all knns.
+    string previousModelBundleFile = "";
+    double knnUpdateThreshold = 0.05; // 0 gives the same knns as "exact"
+
+    // at most this many candidates per rec, 0 for no limit; for longer
+    // histories the seed items are chosen by seedPolicyName : "highest_id",
+    // "score" (highest P[u].Q[i] of a sample of budget items) or "random"
+    unsigned int candidateBudget = 0;
+    string seedPolicyName = "score";
 
     // for top-N
     unsigned int N = 10;
     unsigned int reportEvery = 1000;
 
+    // evaluation threads, 0 uses all cores
+    unsigned int numThreads = 0;
+
+    // counters and latency histograms, when compiled with -DMMFNN_STATS
+    string statsFile = "stats_NN.json";
+
     // ---------------------------------
     // Reading data
     // ---------------------------------
-    cout << "reading item factors ..." << endl;
-    double **factorQ = getFactors(factorQFile, numItems, numLatentFactors);
+    Stats::install(statsFile);
+
+    ModelBundle bundle;
+    FactorMatrix factorQ, factorP;
+    UserHistory userHistory;
+    if( !modelBundleFile.empty() && bundle.open(modelBundleFile) ){
+
+        cout << "mapping model bundle ..." << endl;
+        numUsers = bundle.getNumUsers();
+        numItems = bundle.getNumItems();
+        numLatentFactors = bundle.getNumLatentFactors();
+        factorQ = bundle.getQ();
+        factorP = bundle.getP();
+        userHistory = bundle.getUserHistory();
+
+    } else {
+
+        cout << "reading item factors ..." << endl;
+        factorQ = getFactors(factorQFile, numItems, numLatentFactors);
 
-    cout << "reading user factors ..." << endl;
-    double **factorP = getFactors(factorPFile, numUsers, numLatentFactors);
+        cout << "reading user factors ..." << endl;
+        factorP = getFactors(factorPFile, numUsers, numLatentFactors);
 
-    cout << "reading user histories ..." << endl;
-    unordered_map<unsigned int, unordered_set<unsigned int>> mapUserHistory =
-        getUserHistory(userHistoryFile);
+        if( factorQ.getNumRows() == 0 || factorP.getNumRows() == 0 ){
+            return 1;
+        }
+
+        cout << "reading user histories ..." << endl;
+        userHistory = getUserHistory(userHistoryFile, numUsers, numItems);
+
+    }
 
     cout << "reading test data ..." << endl;
     int userIndex = 0, itemIndex = 1;
@@ -71,11 +136,99 @@ int main(){
     // Find nearest neighbors
     // ---------------------------------
 
-    NN nn(numUsers, numItems, numLatentFactors, K, factorQ, factorP, mapUserHistory);
+    NN nn(numUsers, numItems, numLatentFactors, K, factorQ, factorP, userHistory);
+    nn.setKnnMetric(knnMetric);
+    nn.setCandidateBudget(candidateBudget, NN::parseSeedPolicy(seedPolicyName));
+
+    if( bundle.getKnns() != nullptr && bundle.getKnnCols() == K+1 && bundle.getKnnMetric() == knnMetric ){
+
+        cout << "using knns from model bundle ..." << endl;
+        nn.useKnns(bundle.getKnns());
+
+    } else {
+
+        ModelBundle previousBundle;
+        bool updatable = !previousModelBundleFile.empty() && previousBundle.open(previousModelBundleFile) &&
+                         previousBundle.getKnns() != nullptr && previousBundle.getKnnCols() == K+1 &&
+                         previousBundle.getKnnMetric() == knnMetric &&
+                         previousBundle.getNumLatentFactors() == numLatentFactors;
+
+        if( updatable ){
+
+            nn.updateKnn(previousBundle.getQ(), previousBundle.getKnns(), knnUpdateThreshold, knnNumThreads);
+
+            // recall against exact knns on evenly spaced items, 1 up to ties with threshold 0
+            if( recallSampleSize > 0 ){
+                FactorMatrix data, queries;
+                bool transformed = KnnSpace::transform(factorQ, knnMetric, data, queries);
+                const FactorMatrix& knnData = transformed ? data : factorQ;
+                const FactorMatrix& knnQueries = transformed ? queries : factorQ;
+                cout << "updated knns recall@" << K+1 << " on about " << recallSampleSize << " items = "
+                     << KnnBuilder::sampleRecall(nn.getKnns(), knnData, knnQueries, K+1, recallSampleSize, knnNumThreads) << endl;
+            }
+
+        } else if( knnMethod == "hnsw" ){
 
-    nn.indexAndKnn( algorithm,
-                    kdtreeNumTrees, kmeansBranching, kmeansNumIterations,
-                    searchNumChecks, searchNumCores);
+            struct timespec start, finish;
+            double elapsed;
+
+            // the index holds the data rows of the metric, see KnnSpace
+            FactorMatrix data, queries;
+            bool transformed = KnnSpace::transform(factorQ, knnMetric, data, queries);
+            const FactorMatrix& hnswData = transformed ? data : factorQ;
+            const FactorMatrix& hnswQueries = transformed ? queries : factorQ;
+
+            HNSW index(hnswData, hnswM, hnswEfConstruction);
+            if( hnswFile.empty() || !index.load(hnswFile) ){
+                cout << "building hnsw index ..." << endl;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                index.build(knnNumThreads);
+                clock_gettime(CLOCK_MONOTONIC, &finish);
+                elapsed = (finish.tv_sec - start.tv_sec);
+                elapsed += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+                cout << "*** HNSW building - elapsed time :" << elapsed << " sec ***" << endl;
+                if( !hnswFile.empty() ){
+                    index.save(hnswFile);
+                }
+            }
+
+            cout << "finding hnsw knns ..." << endl;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            vector<int> knns = index.knn(hnswQueries, K+1, hnswEfSearch, knnNumThreads);
+            clock_gettime(CLOCK_MONOTONIC, &finish);
+            elapsed = (finish.tv_sec - start.tv_sec);
+            elapsed += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+            cout << "*** NN finding for items - elapsed time :" << elapsed << " sec ***" << endl;
+
+            // recall against exact knns on evenly spaced items
+            if( recallSampleSize > 0 ){
+                cout << "hnsw recall@" << K+1 << " on about " << recallSampleSize << " items = "
+                     << KnnBuilder::sampleRecall(knns.data(), hnswData, hnswQueries, K+1, recallSampleSize, knnNumThreads) << endl;
+            }
+
+            nn.useKnns(std::move(knns));
+
+        } else if( knnMethod == "flann" ){
+#ifdef MMFNN_HAS_FLANN
+            nn.indexAndKnn( algorithm,
+                            kdtreeNumTrees, kmeansBranching, kmeansNumIterations,
+                            searchNumChecks, searchNumCores);
+#else
+            cout << "ERROR: Built without FLANN, using exact knns" << endl;
+            nn.buildKnn(knnNumThreads);
+#endif
+        } else {
+            nn.buildKnn(knnNumThreads);
+        }
+
+        // store the knns so that later runs skip index building
+        if( bundle.isOpen() ){
+            cout << "adding knns to model bundle ..." << endl;
+            ModelBundle::write(modelBundleFile, factorP, factorQ,
+                               userHistory, nn.getKnns(), K+1, knnMetric);
+        }
+
+    }
 
     // ---------------------------------
     // top-N Predictions
@@ -84,23 +237,48 @@ int main(){
     unsigned int hits = 0;
     unsigned int numRecs = 0;
     double mrr = 0.0;
+    size_t numScored = 0;
+    size_t maxScored = 0;
+    size_t numBudgeted = 0;
+
+    if( numThreads > 0 ){
+        omp_set_num_threads(numThreads);
+    }
+
+    // only users with a history are predicted
+    vector<UIPair> vecEvalPairs;
+    for(UIPair& lp : vecTestPairs){
+        if( userHistory.hasHistory(lp.user) ){
+            vecEvalPairs.push_back(lp);
+        }
+    }
+    long long numEvalPairs = vecEvalPairs.size();
+    vector<double> latencies(numEvalPairs); // per rec, in microseconds
 
     // start elapsed time
+    struct timespec start, finish;
+    double elapsed;
     clock_gettime(CLOCK_MONOTONIC, &start);
 
-    // start evaluation
-    unsigned int iterCount = 0;
-    unsigned int *topNList; // holds top-N list for a user
-    for(UIPair& lp : vecTestPairs){
+    // start evaluation, nn is shared and each thread has its own context
+    #pragma omp parallel reduction(+:hits,numRecs,mrr,numScored,numBudgeted) reduction(max:maxScored)
+    {
+        NNContext context;
+        vector<ScorePair> topN(N);
 
-        auto search = mapUserHistory.find(lp.user);
-        if( search != mapUserHistory.end() ){
+        #pragma omp for schedule(dynamic, 16)
+        for(long long p=0; p<numEvalPairs; p++){
+            const UIPair& lp = vecEvalPairs[p];
 
-            topNList = nn.predictTopNWithMinHeap(lp.user, N);
+            struct timespec recStart, recFinish;
+            clock_gettime(CLOCK_MONOTONIC, &recStart);
+            unsigned int numFound = nn.recommend(lp.user, N, topN.data(), context);
+            clock_gettime(CLOCK_MONOTONIC, &recFinish);
+            latencies[p] = (recFinish.tv_sec - recStart.tv_sec)*1e6 + (recFinish.tv_nsec - recStart.tv_nsec)/1e3;
 
             // *** This section can be commented if measuring execution time
-            for(unsigned int n=0; n<N; n++){
-                if(lp.item == topNList[n]){
+            for(unsigned int n=0; n<numFound; n++){
+                if(lp.item == topN[n].index){
                     hits++;
                     mrr += 1.0/(n+1);
                 }
@@ -108,23 +286,39 @@ int main(){
             numRecs++;
             // *** End of section
 
+            if(p%reportEvery == 0){
+                #pragma omp critical
+                cout << "tested: " << p << endl;
+            }
         }
-        if(iterCount%reportEvery == 0){
-            cout << "tested: " << iterCount << endl;
-        }
-        iterCount++;
+        numScored += context.numScored;
+        maxScored = max(maxScored, context.maxScored);
+        numBudgeted += context.numBudgeted;
     }
 
     // end elapsed time
     clock_gettime(CLOCK_MONOTONIC, &finish);
     elapsed = (finish.tv_sec - start.tv_sec);
     elapsed += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
-    cout << "*** top-N prediction - elapsed time : " << elapsed << " sec ***" << endl;
+    cout << "*** top-N prediction - elapsed time : " << elapsed << " sec ("
+         << omp_get_max_threads() << " threads) ***" << endl;
 
     // communicate some more results
     cout << "num recs = " << numRecs << endl;
     cout << "hit rate = " << 1.*hits/numRecs << endl;
     cout << "mrr = " << mrr/numRecs << endl;
+    cout << "candidates scored per rec = " << 1.*numScored/numRecs << endl;
+    cout << "max candidates per rec = " << maxScored << endl;
+    if( candidateBudget > 0 ){
+        cout << "recs cut by budget (" << candidateBudget << ", " << seedPolicyName << ") = " << numBudgeted << endl;
+    }
+    cout << "hits per 1000 candidates = " << 1000.*hits/numScored << endl;
+    if( numEvalPairs > 0 ){
+        sort(latencies.begin(), latencies.end());
+        cout << "latency per rec (us) : p50 = " << latencies[numEvalPairs/2]
+             << ", p99 = " << latencies[numEvalPairs*99/100]
+             << ", max = " << latencies[numEvalPairs-1] << endl;
+    }
 
     return 0;
 }
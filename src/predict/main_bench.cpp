@@ -0,0 +1,356 @@
+/*
+    Benchmark of top-N prediction with EP and NN
+
+    Sweeps methods, N, K, knn methods and thread counts over model
+    bundles from the trainer. Factor dimension and catalog size are
+    swept by listing bundles of those sizes. Every configuration gets
+    warmup passes and then repeated timed passes over the test users
+    with a history; see Benchmark.h. Results are printed and written to
+    csvFile and jsonFile.
+
+    Methods :
+    - "EP", "EP-heap" : EP::predictTopN, EP::predictTopNWithMinHeap
+    - "NN", "NN-heap" : NN::predictTopN, NN::predictTopNWithMinHeap
+    - "EP-rec", "NN-rec" : recommend() of EP and NN
+
+    To compile : g++ -O3 -std=c++17 main_bench.cpp -fopenmp -o main_bench.x
+    with FLANN : g++ -O3 -std=c++17 -I $FLANN_ROOT/include  main_bench.cpp -fopenmp -o main_bench.x
+
+    Part of MMFNN guiding code. Provided as is.
+    Tested with C++17 (g++ ver. 12.2), optionally FLANN API of flann-1.8.4
+
+*/
+
+# include <iostream>
+#include <omp.h>
+#include "helper.h"
+#include "../common/ModelBundle.h"
+#include "EP.h"
+#include "NN.h"
+#include "HNSW.h"
+#include "Benchmark.h"
+
+using namespace std;
+
+// model bundle and test pairs of a dataset
+struct BenchDataset{
+    string name;
+    string modelBundleFile;
+    string testFile;
+};
+
+// knn method for NN : "exact", "hnsw" (param : efSearch) or "flann" (param : checks)
+struct BenchKnn{
+    string method;
+    unsigned int param;
+};
+
+// per-thread state of a benchmarked method
+template <typename Context>
+struct BenchContext{
+    Context context;
+    vector<ScorePair> topN; // recommend() output
+    const unsigned int* list = nullptr; // predictTopN* output, nullptr for recommend()
+    unsigned int numFound = 0;
+};
+
+// ---------------------------------
+// warmup and timed passes of one configuration, added to report
+// ---------------------------------
+template <typename Context, typename Predict>
+void measure(BenchRun run, const vector<UIPair>& requests, unsigned int numWarmupPasses, unsigned int numRepeats,
+             Predict predict, BenchReport& report){
+
+    long long numRequests = requests.size();
+    vector<BenchContext<Context>> contexts(run.numThreads);
+    for(BenchContext<Context>& context : contexts){
+        context.topN.resize(run.N);
+    }
+
+    auto rank = [&requests](long long r, const BenchContext<Context>& context) -> unsigned int {
+        for(unsigned int n=0; n<context.numFound; n++){
+            unsigned int item = context.list ? context.list[n] : context.topN[n].index;
+            if( item == requests[r].item ){
+                return n+1;
+            }
+        }
+        return 0;
+    };
+
+    vector<double> latencies((size_t)numRequests);
+    for(unsigned int w=0; w<numWarmupPasses; w++){
+        Benchmark::pass(numRequests, contexts, latencies.data(), predict, rank);
+    }
+    for(BenchContext<Context>& context : contexts){
+        context.context.numScored = 0;
+    }
+
+    vector<double> allLatencies;
+    allLatencies.reserve((size_t)numRequests*numRepeats);
+    vector<double> throughputs;
+    BenchPass first;
+    for(unsigned int t=0; t<numRepeats; t++){
+        BenchPass result = Benchmark::pass(numRequests, contexts, latencies.data(), predict, rank);
+        if( t == 0 ){
+            first = result;
+        }
+        allLatencies.insert(allLatencies.end(), latencies.begin(), latencies.end());
+        throughputs.push_back(numRequests / result.seconds);
+    }
+
+    run.numRequests = numRequests;
+    run.numRepeats = numRepeats;
+    Benchmark::summarize(allLatencies, run);
+    sort(throughputs.begin(), throughputs.end());
+    run.throughput = Benchmark::percentile(throughputs, 0.5);
+    run.hitRate = 1.*first.hits/numRequests;
+    run.mrr = first.mrr/numRequests;
+    size_t numScored = 0;
+    for(const BenchContext<Context>& context : contexts){
+        numScored += context.context.numScored;
+    }
+    if( numScored > 0 ){
+        run.candidatesPerRec = 1.*numScored/((size_t)numRequests*numRepeats);
+    }
+
+    cout << run.dataset << " " << run.method << (run.knn.empty() ? "" : " " + run.knn)
+         << " N=" << run.N << (run.K > 0 ? " K=" + to_string(run.K) : "") << " threads=" << run.numThreads
+         << " : p50 = " << run.p50 << " us, p99 = " << run.p99 << " us, " << run.throughput << " recs/sec"
+         << ", hit rate = " << run.hitRate << ", mrr = " << run.mrr << endl;
+    report.add(run);
+}
+
+int main(){
+
+    // ---------------------------------
+    // Input parameters
+    // ---------------------------------
+
+    // model bundles, with knns or not, and their test files
+    vector<BenchDataset> datasets = {
+        {"ml1m", "../mf/BPRMF/output/ml1m/model.bin", "../../data/ml1m/test.csv"}
+    };
+
+    vector<string> methods = {"EP", "EP-heap", "NN", "NN-heap"};
+    vector<unsigned int> Ns = {10, 50};
+    vector<unsigned int> Ks = {10, 20}; // for NN
+
+    // knns of NN are found once per dataset, K and entry, and timed
+    string knnMetricName = "l2";
+    KnnMetric knnMetric = KnnSpace::parse(knnMetricName);
+    vector<BenchKnn> knnMethods = {
+        {"exact", 0},
+        {"hnsw", 64},
+#ifdef MMFNN_HAS_FLANN
+        {"flann", 128},
+#endif
+    };
+    unsigned int hnswM = 16;
+    unsigned int hnswEfConstruction = 200;
+#ifdef MMFNN_HAS_FLANN
+    flann::flann_algorithm_t algorithm = flann::FLANN_INDEX_KDTREE; // KDTREE or KMEANS
+    int kdtreeNumTrees = 8;
+    int kmeansBranching = 32;
+    int kmeansNumIterations = 5;
+#endif
+    unsigned int knnNumThreads = 0; // use 0 for all cores
+
+    // evaluation threads, 0 uses all cores
+    vector<unsigned int> threadCounts = {1, 0};
+
+    unsigned int numWarmupPasses = 1;
+    unsigned int numRepeats = 3;
+    long long maxRequests = 0; // test pairs per pass, 0 for all
+
+    string csvFile = "bench.csv";
+    string jsonFile = "bench.json";
+
+    // ---------------------------------
+    // Benchmark
+    // ---------------------------------
+    BenchReport report(MatrixOps::simdLevel(), sizeof(factor_t) == sizeof(float) ? "single" : "double");
+    for(unsigned int& threads : threadCounts){
+        threads = (threads > 0) ? threads : omp_get_max_threads();
+    }
+    sort(threadCounts.begin(), threadCounts.end());
+    threadCounts.erase(unique(threadCounts.begin(), threadCounts.end()), threadCounts.end());
+
+    bool runEP = false, runNN = false;
+    for(const string& method : methods){
+        runEP = runEP || method.rfind("EP", 0) == 0;
+        runNN = runNN || method.rfind("NN", 0) == 0;
+    }
+
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(const BenchDataset& dataset : datasets){
+
+        ModelBundle bundle;
+        if( !bundle.open(dataset.modelBundleFile) ){
+            cout << "ERROR: Cannot open model bundle " << dataset.modelBundleFile << ", skipping " << dataset.name << endl;
+            continue;
+        }
+        cout << "mapping model bundle " << dataset.modelBundleFile << " ..." << endl;
+        unsigned int numUsers = bundle.getNumUsers();
+        unsigned int numItems = bundle.getNumItems();
+        unsigned int numLatentFactors = bundle.getNumLatentFactors();
+        FactorMatrix factorQ = bundle.getQ();
+        FactorMatrix factorP = bundle.getP();
+        UserHistory userHistory = bundle.getUserHistory();
+
+        cout << "reading test data ..." << endl;
+        int userIndex = 0, itemIndex = 1;
+        char delimiter = '\t';
+        vector<UIPair> vecTestPairs = getTestData(dataset.testFile, userIndex, itemIndex, delimiter);
+
+        // only users with a history are predicted
+        vector<UIPair> requests;
+        for(const UIPair& lp : vecTestPairs){
+            if( lp.user < numUsers && userHistory.hasHistory(lp.user) ){
+                requests.push_back(lp);
+            }
+        }
+        if( maxRequests > 0 && (long long)requests.size() > maxRequests ){
+            requests.resize(maxRequests);
+        }
+        if( requests.empty() ){
+            cout << "ERROR: No test pairs for " << dataset.name << endl;
+            continue;
+        }
+
+        BenchRun base;
+        base.dataset = dataset.name;
+        base.numUsers = numUsers;
+        base.numItems = numItems;
+        base.numLatentFactors = numLatentFactors;
+
+        // ---------------------------------
+        // EP
+        // ---------------------------------
+        EP ep(numUsers, numItems, numLatentFactors, factorQ, factorP, userHistory);
+        for(const string& method : methods){
+            if( !runEP || method.rfind("EP", 0) != 0 ){
+                continue;
+            }
+            for(unsigned int N : Ns){
+                for(unsigned int threads : threadCounts){
+                    BenchRun run = base;
+                    run.method = method;
+                    run.N = N;
+                    run.numThreads = threads;
+                    run.candidatesPerRec = numItems;
+
+                    typedef BenchContext<EPContext> Context;
+                    if( method == "EP" || method == "EP-heap" ){
+                        bool heap = (method == "EP-heap");
+                        measure<EPContext>(run, requests, numWarmupPasses, numRepeats, [&](long long r, Context& context){
+                            unsigned int user = requests[r].user;
+                            const unsigned int* list = heap ? ep.predictTopNWithMinHeap(user, N, context.context)
+                                                            : ep.predictTopN(user, N, context.context);
+                            // lists are padded at the front (heap) or back if fewer than N items remain
+                            unsigned int historySize = userHistory.end(user) - userHistory.begin(user);
+                            context.numFound = min(N, numItems - min(numItems, historySize));
+                            context.list = heap ? list + (N - context.numFound) : list;
+                        }, report);
+                    } else if( method == "EP-rec" ){
+                        measure<EPContext>(run, requests, numWarmupPasses, numRepeats, [&](long long r, Context& context){
+                            context.numFound = ep.recommend(requests[r].user, N, context.topN.data(), context.context);
+                        }, report);
+                    } else {
+                        cout << "ERROR: Unknown method " << method << endl;
+                    }
+                }
+            }
+        }
+
+        // ---------------------------------
+        // NN
+        // ---------------------------------
+        for(unsigned int K : Ks){
+            if( !runNN ){
+                break;
+            }
+            for(const BenchKnn& knnMethod : knnMethods){
+
+                NN nn(numUsers, numItems, numLatentFactors, K, factorQ, factorP, userHistory);
+                nn.setKnnMetric(knnMetric);
+
+                string knnLabel = knnMethod.method;
+                struct timespec knnStart, knnFinish;
+                clock_gettime(CLOCK_MONOTONIC, &knnStart);
+                if( knnMethod.method == "hnsw" ){
+
+                    knnLabel += ":ef" + to_string(knnMethod.param);
+                    FactorMatrix data, queries;
+                    bool transformed = KnnSpace::transform(factorQ, knnMetric, data, queries);
+                    HNSW index(transformed ? data : factorQ, hnswM, hnswEfConstruction);
+                    index.build(knnNumThreads);
+                    nn.useKnns(index.knn(transformed ? queries : factorQ, K+1, knnMethod.param, knnNumThreads));
+
+                } else if( knnMethod.method == "flann" ){
+#ifdef MMFNN_HAS_FLANN
+                    knnLabel += ":checks" + to_string(knnMethod.param);
+                    nn.indexAndKnn(algorithm, kdtreeNumTrees, kmeansBranching, kmeansNumIterations,
+                                   knnMethod.param, knnNumThreads);
+#else
+                    cout << "ERROR: Built without FLANN, skipping flann" << endl;
+                    continue;
+#endif
+                } else {
+                    nn.buildKnn(knnNumThreads);
+                }
+                clock_gettime(CLOCK_MONOTONIC, &knnFinish);
+                double knnSeconds = Benchmark::seconds(knnStart, knnFinish);
+                cout << "*** " << knnLabel << " knns (K=" << K << ") - elapsed time : " << knnSeconds << " sec ***" << endl;
+
+                for(const string& method : methods){
+                    if( method.rfind("NN", 0) != 0 ){
+                        continue;
+                    }
+                    for(unsigned int N : Ns){
+                        for(unsigned int threads : threadCounts){
+                            BenchRun run = base;
+                            run.method = method;
+                            run.knn = knnLabel;
+                            run.N = N;
+                            run.K = K;
+                            run.numThreads = threads;
+                            run.knnSeconds = knnSeconds;
+
+                            typedef BenchContext<NNContext> Context;
+                            if( method == "NN" || method == "NN-heap" ){
+                                bool heap = (method == "NN-heap");
+                                measure<NNContext>(run, requests, numWarmupPasses, numRepeats, [&](long long r, Context& context){
+                                    const unsigned int* list = heap ? nn.predictTopNWithMinHeap(requests[r].user, N, context.context)
+                                                                    : nn.predictTopN(requests[r].user, N, context.context);
+                                    // lists are padded at the front (heap) or back if there are fewer than N candidates
+                                    context.numFound = min((size_t)N, context.context.candidates.size());
+                                    context.list = heap ? list + (N - context.numFound) : list;
+                                }, report);
+                            } else if( method == "NN-rec" ){
+                                measure<NNContext>(run, requests, numWarmupPasses, numRepeats, [&](long long r, Context& context){
+                                    context.numFound = nn.recommend(requests[r].user, N, context.topN.data(), context.context);
+                                }, report);
+                            } else {
+                                cout << "ERROR: Unknown method " << method << endl;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    cout << "*** Benchmark - elapsed time : " << Benchmark::seconds(start, finish) << " sec ***" << endl;
+
+    if( !csvFile.empty() && report.writeCSV(csvFile) ){
+        cout << "results written to " << csvFile << endl;
+    }
+    if( !jsonFile.empty() && report.writeJSON(jsonFile) ){
+        cout << "results written to " << jsonFile << endl;
+    }
+
+    return 0;
+}